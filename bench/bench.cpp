@@ -0,0 +1,253 @@
+// Throughput and latency benchmark against simulated controllers, so changes
+// to detection and the DFU sequence can be measured without a Mac on the
+// bench. Each simulated port runs the real WaitForDBMa/EnterDFUMode from
+// hpm.h through a mock backend; only detection and the disconnect wait are
+// modelled here, after the polling loop and the notification path in
+// main.cpp.
+//
+//   clang++ -std=c++17 -O2 bench/bench.cpp -o auto_dfu_bench
+//   ./auto_dfu_bench --ports 4 --seconds 60 --strategy both
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../connection.h"
+#include "mock_hpm.h"
+
+struct BenchConfig {
+    int ports = 4;
+    int seconds = 30;
+    milliseconds scan{1000};         // polling: re-scan interval for idle ports
+    milliseconds fallbackPoll{2000}; // notify: register 0x3f re-check without messages
+    milliseconds disconnectPoll{500};// polling: register 0x3f re-check after DFU
+    int disconnectErrors = 3;
+    PollConfig dbma;
+    MockProfile profile;
+    unsigned seed = 1;
+};
+
+enum class Strategy { Poll, Notify };
+
+struct BenchPort {
+    std::unique_ptr<MockController> mock;
+    std::unique_ptr<HPMPort> port;
+    std::shared_ptr<ConnectionTracker> conn = std::make_shared<ConnectionTracker>();
+    std::thread worker;
+    int completed = 0;
+    int failed = 0;
+};
+
+static bool Connected(HPMPort &port, int &errors) {
+    HPMRegister status;
+    try {
+        port.readRegister(0, 0x3f, status);
+        errors = 0;
+        return status[0] & 1;
+    } catch (...) {
+        ++errors;
+        return false;
+    }
+}
+
+// One port's life: wait for a target, DFU it, wait for it to leave.
+static void RunBenchPort(BenchPort &p, Strategy strategy, const BenchConfig &cfg, std::atomic<bool> &running) {
+    HPMPort &port = *p.port;
+    const std::string &label = port.label;
+    auto epoch = Clock::now();
+    while (running) {
+        int errors = 0;
+        if (strategy == Strategy::Poll) {
+            // All ports share one scan tick, like RunPolling.
+            auto since = Clock::now() - epoch;
+            std::this_thread::sleep_for(cfg.scan - since % cfg.scan);
+        } else {
+            p.conn->wait(cfg.fallbackPoll);
+        }
+        if (!running || !Connected(port, errors))
+            continue;
+        TimingLog::shared().record(label, "", "detect", p.mock->connectedAtNs(), MonotonicNs(), true);
+
+        PhaseSpan session("session", label);
+        bool sent = false;
+        try {
+            sent = EnterDFUMode(port, cfg.dbma);
+        } catch (const std::exception &) {
+        }
+
+        errors = 0;
+        while (running) {
+            if (strategy == Strategy::Poll)
+                std::this_thread::sleep_for(cfg.disconnectPoll);
+            else
+                p.conn->wait(errors ? milliseconds(100) : cfg.fallbackPoll);
+            if (!Connected(port, errors) && (errors == 0 || errors >= cfg.disconnectErrors))
+                break;
+        }
+        if (!running) {
+            session.discard();
+            break;
+        }
+        TimingLog::shared().record(label, "", "disconnect", p.mock->disconnectedAtNs(), MonotonicNs(), true);
+        session.finish(sent);
+        ++(sent ? p.completed : p.failed);
+    }
+}
+
+static void RunBench(Strategy strategy, const BenchConfig &cfg) {
+    const char *name = strategy == Strategy::Poll ? "poll" : "notify";
+    TimingLog::shared().reset();
+    std::vector<std::unique_ptr<BenchPort>> ports;
+    for (int i = 0; i < cfg.ports; ++i) {
+        auto p = std::make_unique<BenchPort>();
+        std::string label = "sim" + std::to_string(i);
+        p->mock = std::make_unique<MockController>(label, cfg.profile, cfg.seed + i);
+        p->port = std::make_unique<HPMPort>(p->mock->backend());
+        p->port->label = label;
+        ports.push_back(std::move(p));
+    }
+
+    std::atomic<bool> running{true};
+    auto start = Clock::now();
+    for (auto &p : ports) {
+        ConnectionTracker *conn = p->conn.get();
+        p->mock->start([conn, strategy] {
+            if (strategy == Strategy::Notify)
+                conn->post();
+        });
+        BenchPort *bp = p.get();
+        p->worker = std::thread([bp, strategy, &cfg, &running] { RunBenchPort(*bp, strategy, cfg, running); });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.seconds));
+    running = false;
+    for (auto &p : ports) {
+        p->conn->interrupt();
+        p->worker.join();
+        p->mock->stop();
+    }
+    double hours = std::chrono::duration<double>(Clock::now() - start).count() / 3600.0;
+
+    int completed = 0, failed = 0;
+    uint64_t transactions = 0, errors = 0;
+    for (auto &p : ports) {
+        completed += p->completed;
+        failed += p->failed;
+        transactions += p->mock->transactions;
+        errors += p->mock->errors;
+    }
+    printf("\n\U0001F3C1 %s: %d port%s, %d s\n", name, cfg.ports, cfg.ports == 1 ? "" : "s", cfg.seconds);
+    printf("\U0001F3C1 %d targets in DFU, %d failed, %.0f targets/hour (%.0f per port)\n", completed, failed,
+           completed / hours, completed / hours / cfg.ports);
+    printf("\U0001F3C1 %llu I2C transactions (%llu failed), %.0f per target\n", (unsigned long long)transactions,
+           (unsigned long long)errors, completed ? (double)transactions / completed : 0.0);
+    TimingLog::shared().printSummary(stdout);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  --strategy poll|notify|both   detection strategy to measure (default both)\n"
+                    "  --ports N                     simulated controllers (default 4)\n"
+                    "  --seconds N                   run time per strategy (default 30)\n"
+                    "  --scan-ms N                   polling: idle port re-scan interval (default 1000)\n"
+                    "  --disconnect-poll-ms N        polling: register 0x3f re-check after DFU (default 500)\n"
+                    "  --fallback-poll-ms N          notify: re-check when no message arrives (default 2000)\n"
+                    "  --dbma-ms N, --dbma-jitter-ms N   simulated DBMa switch time (default 40 + 0..20)\n"
+                    "  --dbma-ignore-rate F          fraction of 'DBMa' commands dropped (default 0)\n"
+                    "  --i2c-error-rate F            fraction of I2C transactions that fail (default 0)\n"
+                    "  --i2c-latency-us N            time per I2C transaction (default 300)\n"
+                    "  --gap-ms N                    port empty between targets (default 500)\n"
+                    "  --dwell-ms N                  target attached after the VDM (default 1500)\n"
+                    "  --dbma-poll-ms N, --dbma-poll-max-ms N, --dbma-reissue-ms N, --dbma-deadline-ms N\n"
+                    "                                as for auto_dfu\n"
+                    "  --seed N                      random seed (default 1)\n"
+                    "  --timing-log FILE             append every phase as NDJSON\n"
+                    "  --verbose                     show the per-port log\n",
+            argv0);
+}
+
+template <class Duration> static bool ParseMs(const char *s, Duration &out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v < 0)
+        return false;
+    out = milliseconds(v);
+    return true;
+}
+
+static bool ParseRate(const char *s, double &out) {
+    char *end;
+    out = strtod(s, &end);
+    return *s && *end == '\0' && out >= 0 && out <= 1;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    bool poll = true, notify = true;
+    Logger::shared().setLevel(LogLevel::Warn);
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = true;
+        milliseconds us{0};
+        if (!strcmp(arg, "--strategy")) {
+            poll = !strcmp(val, "poll") || !strcmp(val, "both");
+            notify = !strcmp(val, "notify") || !strcmp(val, "both");
+            ok = poll || notify, ++i;
+        } else if (!strcmp(arg, "--ports")) {
+            cfg.ports = atoi(val), ok = cfg.ports > 0, ++i;
+        } else if (!strcmp(arg, "--seconds")) {
+            cfg.seconds = atoi(val), ok = cfg.seconds > 0, ++i;
+        } else if (!strcmp(arg, "--scan-ms")) {
+            ok = ParseMs(val, cfg.scan) && cfg.scan.count() > 0, ++i;
+        } else if (!strcmp(arg, "--disconnect-poll-ms")) {
+            ok = ParseMs(val, cfg.disconnectPoll), ++i;
+        } else if (!strcmp(arg, "--fallback-poll-ms")) {
+            ok = ParseMs(val, cfg.fallbackPoll), ++i;
+        } else if (!strcmp(arg, "--dbma-ms")) {
+            ok = ParseMs(val, cfg.profile.dbmaDelay), ++i;
+        } else if (!strcmp(arg, "--dbma-jitter-ms")) {
+            ok = ParseMs(val, cfg.profile.dbmaJitter), ++i;
+        } else if (!strcmp(arg, "--dbma-ignore-rate")) {
+            ok = ParseRate(val, cfg.profile.dbmaIgnoreRate), ++i;
+        } else if (!strcmp(arg, "--i2c-error-rate")) {
+            ok = ParseRate(val, cfg.profile.i2cErrorRate), ++i;
+        } else if (!strcmp(arg, "--i2c-latency-us")) {
+            ok = ParseMs(val, us), cfg.profile.i2cLatency = microseconds(us.count()), ++i;
+        } else if (!strcmp(arg, "--gap-ms")) {
+            ok = ParseMs(val, cfg.profile.gap), ++i;
+        } else if (!strcmp(arg, "--dwell-ms")) {
+            ok = ParseMs(val, cfg.profile.dwell), ++i;
+        } else if (!strcmp(arg, "--dbma-poll-ms")) {
+            ok = ParseMs(val, cfg.dbma.initial), ++i;
+        } else if (!strcmp(arg, "--dbma-poll-max-ms")) {
+            ok = ParseMs(val, cfg.dbma.max), ++i;
+        } else if (!strcmp(arg, "--dbma-reissue-ms")) {
+            ok = ParseMs(val, cfg.dbma.reissue), ++i;
+        } else if (!strcmp(arg, "--dbma-deadline-ms")) {
+            ok = ParseMs(val, cfg.dbma.deadline), ++i;
+        } else if (!strcmp(arg, "--seed")) {
+            cfg.seed = (unsigned)strtoul(val, nullptr, 10), ok = *val, ++i;
+        } else if (!strcmp(arg, "--timing-log")) {
+            ok = *val && TimingLog::shared().open(val), ++i;
+        } else if (!strcmp(arg, "--verbose")) {
+            Logger::shared().setLevel(LogLevel::Info);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    Logger::shared().start();
+    if (poll)
+        RunBench(Strategy::Poll, cfg);
+    if (notify)
+        RunBench(Strategy::Notify, cfg);
+    return 0;
+}
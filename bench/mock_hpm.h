@@ -0,0 +1,297 @@
+#ifndef mock_hpm_h
+#define mock_hpm_h
+
+// Simulated HPM controllers for the benchmark. Each MockController plays one
+// port: a target is plugged in, waits to be put into DFU, stays attached for
+// a while (re-enumeration and restore) and is unplugged again, forever. The
+// backend answers the same registers and commands main.cpp uses. A
+// scenario can plug and unplug targets itself instead.
+// TraceReplay plays a controller back from a --trace-dir recording instead.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../hpm.h"
+#include "../hpm_trace.h"
+
+using std::chrono::microseconds;
+
+struct MockProfile {
+    milliseconds dbmaDelay{40};    // 'DBMa' until register 0x03 reads "DBMa"
+    milliseconds dbmaJitter{20};   // plus uniform 0..jitter
+    double dbmaIgnoreRate = 0;     // fraction of 'DBMa' commands the controller drops
+    double i2cErrorRate = 0;       // fraction of transactions that fail
+    microseconds i2cLatency{300};  // per Read/Write/Command
+    milliseconds gap{500};         // port empty between targets
+    milliseconds dwell{1500};      // target stays attached after the VDM
+    milliseconds abandon{10000};   // operator unplugs a target that never got the VDM
+    double speedup = 1;            // the DBMa switch and I2C latency run this much faster
+};
+
+class MockController {
+public:
+    static constexpr int kIOError = 0x2bc; // kIOReturnError
+
+    MockController(std::string name, MockProfile profile, unsigned seed)
+        : name(std::move(name)), profile(profile), rng(seed) {}
+
+    ~MockController() { stop(); }
+
+    const std::string &label() const { return name; }
+
+    // Starts the plug/unplug schedule. `onChange` runs on the schedule thread
+    // after every transition, like an IOKit interest message.
+    void start(std::function<void()> onChange) {
+        this->onChange = std::move(onChange);
+        running = true;
+        thread = std::thread([this] { loop(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = false;
+        }
+        cv.notify_all();
+        if (thread.joinable()) thread.join();
+    }
+
+    // Drives the controller by hand instead of start()'s schedule. plug()
+    // attaches a target that switches to DBMa as `target`'s dbma* fields
+    // say, with its own random seed so a unit behaves the same on any port;
+    // unplug() takes it away. Both call `onChange` as start() would.
+    void attach(std::function<void()> onChange) { this->onChange = std::move(onChange); }
+
+    void plug(const MockProfile &target, unsigned seed) {
+        std::unique_lock<std::mutex> guard(lock);
+        profile.dbmaDelay = target.dbmaDelay;
+        profile.dbmaJitter = target.dbmaJitter;
+        profile.dbmaIgnoreRate = target.dbmaIgnoreRate;
+        rng.seed(seed);
+        connected = true;
+        dbmaArmed = vdmSent = false;
+        connectNs = MonotonicNs();
+        notify(guard);
+    }
+
+    void unplug() {
+        std::unique_lock<std::mutex> guard(lock);
+        connected = false;
+        disconnectNs = MonotonicNs();
+        notify(guard);
+    }
+
+    // When the current (or last) target was plugged in / pulled out.
+    uint64_t connectedAtNs() {
+        std::lock_guard<std::mutex> guard(lock);
+        return connectNs;
+    }
+    uint64_t disconnectedAtNs() {
+        std::lock_guard<std::mutex> guard(lock);
+        return disconnectNs;
+    }
+
+    std::atomic<uint64_t> transactions{0};
+    std::atomic<uint64_t> errors{0};
+
+    std::unique_ptr<HPMBackend> backend() { return std::unique_ptr<HPMBackend>(new Backend(*this)); }
+
+private:
+    class Backend : public HPMBackend {
+    public:
+        explicit Backend(MockController &c) : c(c) {}
+
+        int read(uint64_t, uint8_t dataAddr, void *buf, uint64_t maxLen, uint32_t, uint64_t *readLen) override {
+            if (!c.transact())
+                return kIOError;
+            uint8_t reg[64] = {};
+            {
+                std::lock_guard<std::mutex> guard(c.lock);
+                switch (dataAddr) {
+                case 0x3f:
+                    reg[0] = c.connected ? 1 : 0;
+                    break;
+                case 0x03:
+                    memcpy(reg, c.inDBMa() ? "DBMa" : "APP ", 4);
+                    break;
+                case 0x09:
+                    reg[0] = c.lastResult;
+                    break;
+                }
+            }
+            size_t n = std::min<uint64_t>(maxLen, sizeof(reg));
+            memcpy(buf, reg, n);
+            *readLen = n;
+            return 0;
+        }
+
+        int write(uint64_t, uint8_t, const void *, uint64_t, uint32_t) override {
+            return c.transact() ? 0 : kIOError;
+        }
+
+        int command(uint64_t, uint32_t cmd, uint32_t) override {
+            if (!c.transact())
+                return kIOError;
+            std::lock_guard<std::mutex> guard(c.lock);
+            if (!c.connected) {
+                c.lastResult = 1;
+            } else if (cmd == 'DBMa') {
+                c.lastResult = 0;
+                if (!c.chance(c.profile.dbmaIgnoreRate) && !c.dbmaArmed) {
+                    std::uniform_int_distribution<int> jitter(0, (int)c.profile.dbmaJitter.count());
+                    c.dbmaReadyNs = MonotonicNs() + (uint64_t)((c.profile.dbmaDelay.count() + jitter(c.rng)) * 1e6 /
+                                                               c.profile.speedup);
+                    c.dbmaArmed = true;
+                }
+            } else if (cmd == 'VDMs' && c.inDBMa()) {
+                c.lastResult = 0;
+                c.vdmSent = true;
+                c.cv.notify_all();
+            } else {
+                c.lastResult = 3;
+            }
+            return 0;
+        }
+
+    private:
+        MockController &c;
+    };
+
+    // One I2C transaction: costs the configured latency and may fail.
+    bool transact() {
+        ++transactions;
+        std::this_thread::sleep_for(
+            std::chrono::duration<double, std::micro>(profile.i2cLatency.count() / profile.speedup));
+        std::lock_guard<std::mutex> guard(lock);
+        if (chance(profile.i2cErrorRate)) {
+            ++errors;
+            return false;
+        }
+        return true;
+    }
+
+    // Callers hold `lock`.
+    bool chance(double p) { return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p; }
+    bool inDBMa() { return dbmaArmed && MonotonicNs() >= dbmaReadyNs; }
+
+    void loop() {
+        std::unique_lock<std::mutex> guard(lock);
+        // Spread the first plug-in so the ports don't move in lockstep.
+        auto gap = microseconds(std::uniform_int_distribution<long long>(
+            0, std::chrono::duration_cast<microseconds>(profile.gap).count())(rng));
+        while (running) {
+            if (cv.wait_for(guard, gap, [this] { return !running; }))
+                break;
+            gap = profile.gap;
+            connected = true;
+            dbmaArmed = vdmSent = false;
+            connectNs = MonotonicNs();
+            notify(guard);
+            if (cv.wait_for(guard, profile.abandon, [this] { return !running || vdmSent; }) && vdmSent)
+                cv.wait_for(guard, profile.dwell, [this] { return !running; });
+            connected = false;
+            disconnectNs = MonotonicNs();
+            notify(guard);
+        }
+    }
+
+    void notify(std::unique_lock<std::mutex> &guard) {
+        guard.unlock();
+        if (onChange) onChange();
+        guard.lock();
+    }
+
+    std::string name;
+    MockProfile profile;
+    std::mt19937 rng;
+    std::function<void()> onChange;
+
+    std::mutex lock; // guards everything below
+    std::condition_variable cv;
+    bool running = false;
+    bool connected = false;
+    bool dbmaArmed = false;
+    bool vdmSent = false;
+    uint64_t dbmaReadyNs = 0;
+    uint8_t lastResult = 0;
+    uint64_t connectNs = 0;
+    uint64_t disconnectNs = 0;
+    std::thread thread;
+};
+
+// A controller played back from one recorded DBMa/VDM attempt. The
+// recording's clock starts at its first 'DBMa' command and the replay's at
+// the first 'DBMa' it is sent; every call is then answered with the
+// recorded call of the same kind (same register, same command) that was
+// made most recently at that point in the recording, and takes as long as
+// that call took. The controller's timing is kept, not the order of the
+// calls, so a different poll schedule sees the mode change exactly as late
+// as the real controller reported it.
+class TraceReplay : public HPMBackend {
+public:
+    explicit TraceReplay(std::vector<TraceRecord> records) : records(std::move(records)) {
+        for (auto &r : this->records)
+            if (r.op == (uint8_t)TraceOp::Command && r.cmd == 'DBMa') {
+                recordedAnchorNs = r.startNs;
+                break;
+            }
+    }
+
+    std::atomic<uint64_t> transactions{0};
+
+    int read(uint64_t, uint8_t dataAddr, void *buf, uint64_t maxLen, uint32_t, uint64_t *readLen) override {
+        const TraceRecord *r = find(TraceOp::Read, dataAddr, 0);
+        memset(buf, 0, maxLen);
+        if (!r) {
+            *readLen = maxLen;
+            return 0;
+        }
+        memcpy(buf, r->data, std::min<uint64_t>(maxLen, std::min<uint64_t>(r->len, sizeof(r->data))));
+        *readLen = std::min<uint64_t>(maxLen, r->len);
+        return r->ret;
+    }
+
+    int write(uint64_t, uint8_t dataAddr, const void *, uint64_t, uint32_t) override {
+        const TraceRecord *r = find(TraceOp::Write, dataAddr, 0);
+        return r ? r->ret : 0;
+    }
+
+    int command(uint64_t, uint32_t cmd, uint32_t) override {
+        if (cmd == 'DBMa' && !anchorNs)
+            anchorNs = MonotonicNs();
+        const TraceRecord *r = find(TraceOp::Command, 0, cmd);
+        return r ? r->ret : 0;
+    }
+
+private:
+    // Picks the answer for a call made now and spends its recorded duration.
+    const TraceRecord *find(TraceOp op, uint8_t dataAddr, uint32_t cmd) {
+        ++transactions;
+        uint64_t at = recordedAnchorNs + (anchorNs ? MonotonicNs() - anchorNs : 0);
+        const TraceRecord *best = nullptr;
+        for (auto &r : records) {
+            if (r.op != (uint8_t)op || r.dataAddr != dataAddr || r.cmd != cmd)
+                continue;
+            if (best && r.startNs > at)
+                break;
+            best = &r;
+        }
+        if (best)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(best->durationNs));
+        return best;
+    }
+
+    std::vector<TraceRecord> records;
+    uint64_t recordedAnchorNs = 0;
+    uint64_t anchorNs = 0;
+};
+
+#endif /* mock_hpm_h */
@@ -0,0 +1,250 @@
+// Replays HPM traces recorded with auto_dfu --trace-dir. Every DBMa/VDM
+// attempt in a trace is cut out and run again through the real DBMaSequence
+// and SendVdm against a TraceReplay controller, so a slow or failed DBMa
+// seen on the station can be reproduced offline, and a change to the poll
+// schedule can be measured against the controller timing that was actually
+// observed. Each attempt sends the VDM profile it sent on the station, found
+// from the payload written to register 9 before 'VDMs'; an attempt whose
+// payload matches no profile is replayed up to the VDM only, and left out
+// of the VDM columns on both rows.
+//
+//   clang++ -std=c++17 -O2 bench/replay.cpp -o auto_dfu_replay
+//   ./auto_dfu_replay traces/hpm0.hpmtrace --dbma-poll-max-ms 40
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mock_hpm.h"
+
+// What one attempt took; -1 where it never got that far.
+struct AttemptStats {
+    double dbmaMs = -1;
+    double vdmMs = -1;
+    int commands = 0;
+    uint64_t transactions = 0;
+};
+
+// Splits a segment into attempts: each starts at a 'DBMa' command that
+// follows the start of the trace or a 'VDMs' command.
+static std::vector<std::vector<TraceRecord>> SplitAttempts(const std::vector<TraceRecord> &records) {
+    std::vector<std::vector<TraceRecord>> out;
+    bool open = false;
+    for (auto &r : records) {
+        bool command = r.op == (uint8_t)TraceOp::Command;
+        if (command && r.cmd == 'DBMa' && !open) {
+            out.emplace_back();
+            open = true;
+        }
+        if (!out.empty())
+            out.back().push_back(r);
+        if (command && r.cmd == 'VDMs')
+            open = false;
+    }
+    return out;
+}
+
+// The profile whose payload the attempt wrote before 'VDMs', nullptr if it
+// sent none or one that isn't in kVdmProfiles.
+static const VdmProfile *RecordedVdm(const std::vector<TraceRecord> &attempt) {
+    const TraceRecord *payload = nullptr;
+    for (auto &r : attempt) {
+        if (r.op == (uint8_t)TraceOp::Write && r.dataAddr == 9)
+            payload = &r;
+        if (r.op == (uint8_t)TraceOp::Command && r.cmd == 'VDMs')
+            break;
+    }
+    if (!payload)
+        return nullptr;
+    for (auto &p : kVdmProfiles)
+        if (payload->len == p.size && memcmp(payload->data, p.data, std::min(p.size, sizeof(payload->data))) == 0)
+            return &p;
+    return nullptr;
+}
+
+static AttemptStats Recorded(const std::vector<TraceRecord> &attempt) {
+    AttemptStats s;
+    uint64_t anchor = attempt.front().startNs;
+    bool vdmIssued = false;
+    for (auto &r : attempt) {
+        ++s.transactions;
+        double end = (r.startNs + r.durationNs - anchor) / 1e6;
+        if (r.op == (uint8_t)TraceOp::Command && r.cmd == 'DBMa' && s.dbmaMs < 0)
+            ++s.commands;
+        if (r.op == (uint8_t)TraceOp::Read && r.dataAddr == 3 && r.ret == 0 && s.dbmaMs < 0 &&
+            memcmp(r.data, "DBMa", 4) == 0)
+            s.dbmaMs = end;
+        if (r.op == (uint8_t)TraceOp::Command && r.cmd == 'VDMs')
+            vdmIssued = r.ret == 0;
+        else if (vdmIssued && r.op == (uint8_t)TraceOp::Read && r.dataAddr == 9) {
+            if (r.ret == 0 && (r.data[0] & 0xf) == 0)
+                s.vdmMs = end; // as SendVdm, once the result is read back
+            break;
+        }
+    }
+    return s;
+}
+
+// `vdm` null replays DBMa only.
+static AttemptStats Replay(const std::vector<TraceRecord> &attempt, const std::string &label,
+                           const PollConfig &dbma, const VdmProfile *vdm) {
+    AttemptStats s;
+    auto *mock = new TraceReplay(attempt);
+    HPMPort port{std::unique_ptr<HPMBackend>(mock)};
+    port.label = label;
+    auto start = Clock::now();
+    try {
+        DBMaSequence seq(port, dbma);
+        Clock::duration wait;
+        DBMaSequence::Result r;
+        while ((r = seq.step(wait)) == DBMaSequence::Pending)
+            std::this_thread::sleep_for(wait);
+        if (r == DBMaSequence::Reached) {
+            s.dbmaMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            if (vdm && SendVdm(port, *vdm))
+                s.vdmMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+    } catch (const std::exception &e) {
+        LogWarn(label.c_str(), "replay stopped: %s", e.what());
+    }
+    s.transactions = mock->transactions;
+    return s;
+}
+
+static void Dump(const TraceSegment &seg) {
+    uint64_t first = seg.records.empty() ? 0 : seg.records.front().startNs;
+    printf("# %s: %zu calls\n", seg.label.c_str(), seg.records.size());
+    for (auto &r : seg.records) {
+        char what[32];
+        if (r.op == (uint8_t)TraceOp::Command)
+            snprintf(what, sizeof(what), "command '%c%c%c%c'", (char)(r.cmd >> 24), (char)(r.cmd >> 16),
+                     (char)(r.cmd >> 8), (char)r.cmd);
+        else
+            snprintf(what, sizeof(what), "%s 0x%02x", r.op == (uint8_t)TraceOp::Read ? "read " : "write",
+                     r.dataAddr);
+        char hex[16 * 3 + 1] = "";
+        for (int i = 0; i < r.len && i < 16; ++i) snprintf(hex + i * 3, 4, "%02x ", r.data[i]);
+        printf("%12.3f ms %8.3f ms  %-16s ret=0x%08x len=%-3u %s\n", (r.startNs - first) / 1e6, r.durationNs / 1e6,
+               what, (unsigned)r.ret, r.len, hex);
+    }
+}
+
+static std::vector<double> Sorted(const std::vector<AttemptStats> &v, double AttemptStats::*field) {
+    std::vector<double> out;
+    for (auto &s : v)
+        if (s.*field >= 0)
+            out.push_back(s.*field);
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+static void PrintRow(const char *name, const std::vector<AttemptStats> &v) {
+    std::vector<double> dbma = Sorted(v, &AttemptStats::dbmaMs), vdm = Sorted(v, &AttemptStats::vdmMs);
+    uint64_t transactions = 0;
+    for (auto &s : v) transactions += s.transactions;
+    printf("\U0001F501 %-9s %5zu/%-5zu %9.1f %9.1f %9.1f %9.1f %10.1f\n", name, vdm.size(), v.size(),
+           TimingLog::Percentile(dbma, 50), TimingLog::Percentile(dbma, 95), TimingLog::Percentile(vdm, 50),
+           TimingLog::Percentile(vdm, 95), v.empty() ? 0.0 : (double)transactions / v.size());
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] TRACE...\n"
+                    "  --dump                        print every recorded call instead of replaying\n"
+                    "  --dbma-poll-ms N, --dbma-poll-max-ms N, --dbma-reissue-ms N, --dbma-deadline-ms N\n"
+                    "                                as for auto_dfu\n"
+                    "  --verbose                     one line per attempt and the per-port log\n",
+            argv0);
+}
+
+template <class Duration> static bool ParseMs(const char *s, Duration &out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v < 0)
+        return false;
+    out = milliseconds(v);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    PollConfig dbma;
+    bool dump = false, verbose = false;
+    std::vector<std::string> files;
+    Logger::shared().setLevel(LogLevel::Warn);
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = true;
+        if (!strcmp(arg, "--dump")) {
+            dump = true;
+        } else if (!strcmp(arg, "--dbma-poll-ms")) {
+            ok = ParseMs(val, dbma.initial), ++i;
+        } else if (!strcmp(arg, "--dbma-poll-max-ms")) {
+            ok = ParseMs(val, dbma.max), ++i;
+        } else if (!strcmp(arg, "--dbma-reissue-ms")) {
+            ok = ParseMs(val, dbma.reissue), ++i;
+        } else if (!strcmp(arg, "--dbma-deadline-ms")) {
+            ok = ParseMs(val, dbma.deadline), ++i;
+        } else if (!strcmp(arg, "--verbose")) {
+            verbose = true;
+            Logger::shared().setLevel(LogLevel::Info);
+        } else if (arg[0] == '-') {
+            ok = false;
+        } else {
+            files.push_back(arg);
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (files.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    Logger::shared().start();
+
+    std::vector<AttemptStats> recorded, replayed;
+    size_t unknownVdm = 0;
+    for (auto &file : files) {
+        std::vector<TraceSegment> segments;
+        if (!LoadTrace(file, segments)) {
+            fprintf(stderr, "%s: not a readable HPM trace\n", file.c_str());
+            return 1;
+        }
+        for (auto &seg : segments) {
+            if (dump) {
+                Dump(seg);
+                continue;
+            }
+            for (auto &attempt : SplitAttempts(seg.records)) {
+                const VdmProfile *vdm = RecordedVdm(attempt);
+                AttemptStats before = Recorded(attempt), after = Replay(attempt, seg.label, dbma, vdm);
+                if (!vdm && before.vdmMs >= 0) {
+                    before.vdmMs = -1; // can't send the same payload again, so don't compare it
+                    ++unknownVdm;
+                }
+                recorded.push_back(before);
+                replayed.push_back(after);
+                if (verbose)
+                    printf("%s: recorded DBMa %.1f ms (%d cmd, %llu calls), replayed DBMa %.1f ms (%llu calls), "
+                           "vdm %s\n",
+                           seg.label.c_str(), before.dbmaMs, before.commands,
+                           (unsigned long long)before.transactions, after.dbmaMs,
+                           (unsigned long long)after.transactions, vdm ? vdm->name : "unknown");
+            }
+        }
+    }
+    if (dump)
+        return 0;
+    printf("\U0001F501 %-9s %11s %9s %9s %9s %9s %10s\n", "", "vdm sent", "dbma p50", "dbma p95", "vdm p50",
+           "vdm p95", "calls/try");
+    PrintRow("recorded", recorded);
+    PrintRow("replayed", replayed);
+    if (unknownVdm)
+        printf("\U0001F501 %zu attempt%s sent a VDM that matches no profile; left out of the vdm columns.\n",
+               unknownVdm, unknownVdm == 1 ? "" : "s");
+    return 0;
+}
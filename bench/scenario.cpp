@@ -0,0 +1,1078 @@
+// Whole-station throughput benchmark driven by scenario files. A scenario
+// describes the station (ports, restore slots, controller behaviour), the
+// units that arrive at it (rate, model mix, how each model behaves) and what
+// goes wrong (I2C errors, dropped 'DBMa' commands, failed restores). The
+// station is the real one from station.h: its Scheduler and PortWorkers on
+// the PortExecutor, with a MockController behind every port, and restores
+// going through RestoreBatcher and RestoreSupervisor to a stand-in restore
+// tool (this binary again). Arrivals, re-enumeration and the operator who
+// plugs and pulls units are simulated around it. All of it, the station's
+// own intervals included, runs `speedup` times faster than real time, and
+// every figure is given in simulated time. The report gives units/hour, port
+// utilization, queueing delay and p50/p95/p99 for every phase of a unit's
+// way through the station; --results appends the same as one NDJSON line,
+// so runs of the same scenario can be compared across commits.
+//
+//   clang++ -std=c++17 -O2 bench/scenario.cpp -o auto_dfu_scenario -framework CoreFoundation -framework IOKit -framework CoreServices -lz
+//   ./auto_dfu_scenario bench/scenarios/*.json --results results.ndjson --label "$(git rev-parse --short HEAD)"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../station.h"
+#include "mock_hpm.h"
+
+// Just enough JSON for scenario files.
+struct Json {
+    enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> items;
+    std::vector<std::pair<std::string, Json>> fields;
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string &text) : begin(text.c_str()), p(begin) {}
+
+    bool parse(Json &out, std::string &err) {
+        if (value(out) && (ws(), *p == '\0'))
+            return true;
+        err = "bad JSON at offset " + std::to_string(p - begin);
+        return false;
+    }
+
+private:
+    void ws() {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') ++p;
+    }
+
+    bool literal(const char *word) {
+        size_t n = strlen(word);
+        if (strncmp(p, word, n) != 0)
+            return false;
+        p += n;
+        return true;
+    }
+
+    bool value(Json &out) {
+        ws();
+        if (*p == '{')
+            return object(out);
+        if (*p == '[')
+            return array(out);
+        if (*p == '"') {
+            out.type = Json::String;
+            return string(out.string);
+        }
+        if (literal("true")) {
+            out.type = Json::Bool;
+            out.boolean = true;
+            return true;
+        }
+        if (literal("false")) {
+            out.type = Json::Bool;
+            return true;
+        }
+        if (literal("null"))
+            return true;
+        char *end;
+        out.number = strtod(p, &end);
+        if (end == p)
+            return false;
+        out.type = Json::Number;
+        p = end;
+        return true;
+    }
+
+    bool string(std::string &out) {
+        for (++p; *p && *p != '"'; ++p) {
+            if (*p != '\\') {
+                out += *p;
+                continue;
+            }
+            switch (*++p) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case '"': case '\\': case '/': out += *p; break;
+            default: return false;
+            }
+        }
+        if (*p != '"')
+            return false;
+        ++p;
+        return true;
+    }
+
+    bool array(Json &out) {
+        out.type = Json::Array;
+        ++p;
+        ws();
+        if (*p == ']')
+            return ++p, true;
+        while (true) {
+            out.items.emplace_back();
+            if (!value(out.items.back()))
+                return false;
+            ws();
+            if (*p == ']')
+                return ++p, true;
+            if (*p != ',')
+                return false;
+            ++p;
+        }
+    }
+
+    bool object(Json &out) {
+        out.type = Json::Object;
+        ++p;
+        ws();
+        if (*p == '}')
+            return ++p, true;
+        while (true) {
+            ws();
+            out.fields.emplace_back();
+            if (*p != '"' || !string(out.fields.back().first))
+                return false;
+            ws();
+            if (*p != ':')
+                return false;
+            ++p;
+            if (!value(out.fields.back().second))
+                return false;
+            ws();
+            if (*p == '}')
+                return ++p, true;
+            if (*p != ',')
+                return false;
+            ++p;
+        }
+    }
+
+    const char *begin, *p;
+};
+
+// Reads the members of one JSON object and complains about any it wasn't
+// asked for, so a misspelt key doesn't quietly leave the default in place.
+class Fields {
+public:
+    Fields(const Json &obj, std::string where) : obj(obj), where(std::move(where)), used(obj.fields.size()) {
+        if (obj.type != Json::Object)
+            fail("not an object");
+    }
+
+    const Json *get(const char *key) {
+        for (size_t i = 0; i < obj.fields.size(); ++i)
+            if (obj.fields[i].first == key) {
+                used[i] = true;
+                return &obj.fields[i].second;
+            }
+        return nullptr;
+    }
+
+    void number(const char *key, double &out, double min, double max) {
+        const Json *v = get(key);
+        if (!v)
+            return;
+        if (v->type != Json::Number || v->number < min || v->number > max)
+            return fail(std::string(key) + " must be a number from " + Num(min) + " to " + Num(max));
+        out = v->number;
+    }
+
+    void integer(const char *key, int &out, int min) {
+        double d = out;
+        number(key, d, min, 1e9);
+        out = (int)d;
+    }
+
+    template <class Duration> void ms(const char *key, Duration &out) {
+        double d = std::chrono::duration<double, std::milli>(out).count();
+        number(key, d, 0, 1e12);
+        out = std::chrono::duration_cast<Duration>(std::chrono::duration<double, std::milli>(d));
+    }
+
+    void text(const char *key, std::string &out) {
+        const Json *v = get(key);
+        if (!v)
+            return;
+        if (v->type != Json::String)
+            return fail(std::string(key) + " must be a string");
+        out = v->string;
+    }
+
+    bool finish(std::string &err) {
+        for (size_t i = 0; i < obj.fields.size() && error.empty(); ++i)
+            if (!used[i])
+                fail("unknown key \"" + obj.fields[i].first + "\"");
+        err = error;
+        return error.empty();
+    }
+
+    void fail(const std::string &what) {
+        if (error.empty())
+            error = where + ": " + what;
+    }
+
+private:
+    static std::string Num(double v) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%g", v);
+        return buf;
+    }
+
+    const Json &obj;
+    std::string where;
+    std::vector<bool> used;
+    std::string error;
+};
+
+enum class Strategy { Poll, Notify };
+
+// One kind of unit and how it behaves.
+struct ModelSpec {
+    std::string name;
+    double weight = 1;               // share of arrivals, relative to the other models
+    MockProfile target;              // dbma* fields only
+    milliseconds reenumerate{3000};  // VDM until the target is in DFU on USB
+    milliseconds restore{600000};    // one restore tool run
+    milliseconds restoreJitter{0};   // plus uniform 0..jitter
+    double restoreFailRate = 0;      // fraction of runs that fail
+};
+
+struct Scenario {
+    std::string name;
+    unsigned seed = 1;
+    int ports = 4;
+    double minutes = 60;           // simulated run time
+    double speedup = 1;            // simulated time per real time
+    double arrivalsPerHour = 0;    // Poisson; 0 keeps a unit waiting for every free port
+    int maxRestores = 0;           // restores the host runs at once, 0 for no limit
+    int restoreRetries = 0;        // extra runs after a failed restore
+    milliseconds batchWindow{0};   // --batch-window-ms
+    milliseconds unplug{30000};    // operator takes a finished unit off the port
+    Strategy strategy = Strategy::Notify;
+    milliseconds scan{1000};         // poll: re-scan interval for idle ports
+    milliseconds fallbackPoll{2000}; // register 0x3f re-check without messages
+    int disconnectErrors = 3;
+    MockProfile station;             // i2c* fields only
+    PollConfig dbma;
+    std::vector<ModelSpec> models;
+};
+
+static bool LoadScenario(const std::string &path, Scenario &sc, std::string &err) {
+    std::ifstream in(path);
+    if (!in) {
+        err = path + ": can't read";
+        return false;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    Json root;
+    if (!JsonParser(text.str()).parse(root, err)) {
+        err = path + ": " + err;
+        return false;
+    }
+    sc.name = path.substr(path.find_last_of('/') + 1);
+    sc.name = sc.name.substr(0, sc.name.rfind('.'));
+
+    Fields f(root, path);
+    double seed = sc.seed, us = (double)sc.station.i2cLatency.count();
+    std::string strategy = "notify";
+    f.text("name", sc.name);
+    f.number("seed", seed, 0, 4294967295.0);
+    f.integer("ports", sc.ports, 1);
+    f.number("duration_min", sc.minutes, 0.1, 1e6);
+    f.number("speedup", sc.speedup, 1, 1e6);
+    f.number("arrivals_per_hour", sc.arrivalsPerHour, 0, 1e6);
+    f.integer("max_restores", sc.maxRestores, 0);
+    f.integer("restore_retries", sc.restoreRetries, 0);
+    f.ms("batch_window_ms", sc.batchWindow);
+    f.ms("unplug_ms", sc.unplug);
+    f.text("strategy", strategy);
+    f.ms("scan_ms", sc.scan);
+    f.ms("fallback_poll_ms", sc.fallbackPoll);
+    f.integer("disconnect_errors", sc.disconnectErrors, 1);
+    f.number("i2c_latency_us", us, 0, 1e6);
+    f.number("i2c_error_rate", sc.station.i2cErrorRate, 0, 1);
+    sc.seed = (unsigned)seed;
+    sc.station.i2cLatency = microseconds((long long)us);
+    if (strategy == "poll" || strategy == "notify")
+        sc.strategy = strategy == "poll" ? Strategy::Poll : Strategy::Notify;
+    else
+        f.fail("strategy must be \"poll\" or \"notify\"");
+    if (sc.scan.count() == 0)
+        f.fail("scan_ms must be positive");
+
+    if (const Json *dbma = f.get("dbma")) {
+        Fields d(*dbma, path + ": dbma");
+        d.ms("poll_ms", sc.dbma.initial);
+        d.ms("poll_max_ms", sc.dbma.max);
+        d.ms("reissue_ms", sc.dbma.reissue);
+        d.ms("deadline_ms", sc.dbma.deadline);
+        if (!d.finish(err))
+            return false;
+    }
+
+    const Json *models = f.get("models");
+    if (!models || models->type != Json::Array || models->items.empty())
+        f.fail("models must be a non-empty array");
+    else
+        for (size_t i = 0; i < models->items.size(); ++i) {
+            ModelSpec m;
+            m.name = "model" + std::to_string(i);
+            Fields mf(models->items[i], path + ": models[" + std::to_string(i) + "]");
+            mf.text("name", m.name);
+            mf.number("weight", m.weight, 0, 1e6);
+            mf.ms("dbma_ms", m.target.dbmaDelay);
+            mf.ms("dbma_jitter_ms", m.target.dbmaJitter);
+            mf.number("dbma_ignore_rate", m.target.dbmaIgnoreRate, 0, 1);
+            mf.ms("reenumerate_ms", m.reenumerate);
+            mf.ms("restore_ms", m.restore);
+            mf.ms("restore_jitter_ms", m.restoreJitter);
+            mf.number("restore_fail_rate", m.restoreFailRate, 0, 1);
+            if (!mf.finish(err))
+                return false;
+            sc.models.push_back(m);
+        }
+    return f.finish(err);
+}
+
+// A unit and everything random about it, drawn when it arrives so the same
+// scenario and seed give every run the same units.
+struct Unit {
+    int id = 0;
+    const ModelSpec *model = nullptr;
+    size_t modelIndex = 0;
+    unsigned seed = 0;              // for the mock controller while it's plugged in
+    std::string serial;             // its USB serial in DFU; the ECID comes from the id
+    std::string ecid;               // as ParseDfuSerial() reads it off `serial`
+    double arriveMs = 0;            // simulated clock, as below
+    double queuedMs = 0;            // joined the queue, on arrival or for another restore
+    std::vector<std::pair<milliseconds, bool>> restores; // each run: how long, and whether it works
+    size_t attempt = 0;             // the run in `restores` that's next or under way
+    double finishMs = -1;
+    bool ok = false;
+    bool again = false;             // back in the queue for its next run once it's off the port
+};
+
+class UnitSource {
+public:
+    explicit UnitSource(const Scenario &sc) : sc(sc), rng(sc.seed) {
+        std::vector<double> weights;
+        for (auto &m : sc.models) weights.push_back(m.weight);
+        pick = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+        advance();
+    }
+
+    // When the next unit arrives, if there is an arrival rate.
+    double nextArrivalMs() const { return nextMs; }
+
+    // The next unit. Without an arrival rate it turns up when it's asked
+    // for, at `nowMs`.
+    std::unique_ptr<Unit> take(double nowMs) {
+        auto u = std::make_unique<Unit>();
+        u->id = count++;
+        u->arriveMs = sc.arrivalsPerHour > 0 ? nextMs : nowMs;
+        u->modelIndex = pick(rng);
+        u->model = &sc.models[u->modelIndex];
+        u->seed = (unsigned)rng();
+        u->queuedMs = u->arriveMs;
+        char serial[96];
+        snprintf(serial, sizeof(serial), "CPID:%04zX BDID:0C ECID:%016X", 0x8100 + u->modelIndex,
+                 (unsigned)(0x100000 + u->id));
+        u->serial = serial;
+        u->ecid = "0x" + DfuSerialField(u->serial, "ECID");
+        std::uniform_real_distribution<double> unit(0, 1);
+        for (int i = 0; i <= sc.restoreRetries; ++i) {
+            std::uniform_int_distribution<long long> jitter(0, u->model->restoreJitter.count());
+            milliseconds run = u->model->restore + milliseconds(jitter(rng));
+            bool works = unit(rng) >= u->model->restoreFailRate;
+            u->restores.emplace_back(run, works);
+            if (works)
+                break;
+        }
+        advance();
+        return u;
+    }
+
+private:
+    void advance() {
+        if (sc.arrivalsPerHour > 0)
+            nextMs += std::exponential_distribution<double>(sc.arrivalsPerHour / 3600000.0)(rng);
+    }
+
+    const Scenario &sc;
+    std::mt19937 rng;
+    std::discrete_distribution<size_t> pick;
+    double nextMs = 0;
+    int count = 0;
+};
+
+
+// A station interval of `sim` in real time, in the same unit: milliseconds
+// for most, microseconds for the DBMa schedule. An interval that isn't
+// zero doesn't become zero.
+template <class Duration> static Duration Scaled(Duration sim, double speedup) {
+    if (sim.count() == 0)
+        return sim;
+    return Duration(std::max(1LL, (long long)std::llround(sim.count() / speedup)));
+}
+
+// Stands in for cfgutil. Every run is this binary again (see FakeRestore()),
+// told how long to take and how to exit; `plan` works that out from the
+// ECIDs. It batches like cfgutil does.
+class FakeRestoreTool : public RestoreBackend {
+public:
+    std::string self;    // how to run this binary
+    std::string slotDir; // one lock file per restore the host runs at once
+    int slots = 0;       // 0 for no limit
+    double speedup = 1;
+    std::function<void(const std::vector<std::string> &ecids, milliseconds &run, bool &works)> plan;
+
+    const char *name() const override { return "fake-restore"; }
+    bool batches() const override { return true; }
+    std::vector<std::string> command(const std::string &, const std::vector<std::string> &ecids,
+                                     const std::string &) const override {
+        milliseconds run{0};
+        bool works = false;
+        plan(ecids, run, works);
+        long long us = std::llround(run.count() * 1000 / speedup);
+        return {self, "--restore-tool", std::to_string(us), works ? "0" : "1", slotDir, std::to_string(slots),
+                std::to_string(ecids.size())};
+    }
+};
+
+// The restore tool's side, `--restore-tool US CODE DIR SLOTS TARGETS`: takes
+// a slot per target (all of them or, with fewer free, none), sleeps US
+// microseconds and exits with CODE. A slot is a lock file in DIR, which the
+// kernel lets go of however the process ends.
+static int FakeRestore(int argc, char **argv) {
+    if (argc != 7)
+        return 2;
+    long long us = atoll(argv[2]);
+    int code = atoi(argv[3]), slots = atoi(argv[5]);
+    std::string dir = argv[4];
+    int need = std::min(std::max(atoi(argv[6]), 1), slots);
+    for (std::vector<int> held;;) {
+        for (int i = 0; i < slots && (int)held.size() < need; ++i) {
+            int fd = open((dir + "/slot" + std::to_string(i)).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0)
+                held.push_back(fd);
+            else if (fd >= 0)
+                close(fd);
+        }
+        if ((int)held.size() == need)
+            break; // held until exit
+        for (int fd : held) close(fd);
+        held.clear();
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    std::this_thread::sleep_for(microseconds(us));
+    return code;
+}
+
+struct SimPort {
+    int index = 0;
+    HPMNode node; // as the topology would list it, labelled hpmN
+    std::unique_ptr<MockController> mock;
+    // Station lock:
+    Unit *unit = nullptr;   // from plug-in until the station has seen it leave
+    bool detected = false;  // the station has picked the unit up
+    bool finished = false;  // the station is done with it, the operator is on the way
+    bool unplugged = false;
+    double plugMs = 0, finishedMs = 0, unplugAtMs = 0, pulledMs = 0;
+    double bindAtMs = -1;       // the unit shows up in DFU, after a VDM
+    double restoreStartMs = -1; // a restore run is under way
+    double busyMs = 0, restoringMs = 0;
+};
+
+// The station, its surroundings and its operator. Times called ...Ms are on
+// the simulated clock, which runs `speedup` times faster than real time;
+// configure() scales the station's own intervals to it.
+class Station {
+public:
+    Station(const Scenario &sc, std::string self) : sc(sc), source(sc) { tool.self = std::move(self); }
+
+    ~Station() {
+        if (dir.empty())
+            return;
+        for (auto &path : ipsws) unlink(path.c_str());
+        for (int i = 0; i < sc.maxRestores; ++i) unlink((dir + "/slot" + std::to_string(i)).c_str());
+        rmdir(dir.c_str());
+    }
+
+    // Sets the station up, runs the scenario and takes the station down
+    // again. False with `err` if it couldn't be set up.
+    bool run(std::string &err) {
+        TimingLog::shared().reset();
+        char tmpl[] = "/tmp/auto_dfu_scenario.XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            err = std::string("mkdtemp: ") + strerror(errno);
+            return false;
+        }
+        dir = tmpl;
+        // A firmware file per model, so that restores of one model can share a batch.
+        for (size_t i = 0; i < sc.models.size(); ++i) {
+            std::string path = dir + "/model" + std::to_string(i) + ".ipsw";
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                err = path + ": " + strerror(errno);
+                return false;
+            }
+            close(fd);
+            ipsws.push_back(path);
+        }
+        catalog = std::make_unique<IpswCatalog>(dir); // never loaded: every restore names its IPSW
+        tool.slotDir = dir;
+        tool.slots = sc.maxRestores;
+        tool.speedup = sc.speedup;
+        tool.plan = [this](const std::vector<std::string> &ecids, milliseconds &run, bool &works) {
+            plan(ecids, run, works);
+        };
+        configure();
+
+        MockProfile station = sc.station;
+        station.speedup = sc.speedup;
+        for (int i = 0; i < sc.ports; ++i) {
+            auto p = std::make_unique<SimPort>();
+            p->index = i;
+            p->node.entryID = (uint64_t)i + 1;
+            p->node.rid = 0;
+            p->node.label = "hpm" + std::to_string(i);
+            p->mock = std::make_unique<MockController>(p->node.label, station, sc.seed + i);
+            nodes.push_back(p->node);
+            ports.push_back(std::move(p));
+        }
+        sched = std::make_unique<Scheduler>(cfg);
+        sched->plugins.open = [this](const HPMNode &node) { return ports[node.entryID - 1]->mock->backend(); };
+        try {
+            sched->restores.start();
+        } catch (const std::exception &e) {
+            err = e.what();
+            return false;
+        }
+        // The station's event stream, read the way a control client reads it.
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            err = std::string("socketpair: ") + strerror(errno);
+            return false;
+        }
+        publisher = fds[0];
+        feed = fds[1];
+        int size = 1 << 20; // the bus drops a subscriber it can't write to at once
+        setsockopt(publisher, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        sched->events.subscribe(publisher);
+        observer = std::thread([this] { observe(); });
+        sched->executor.start();
+        for (auto &p : ports) {
+            SimPort *sp = p.get();
+            p->mock->attach([this, sp] { changed(*sp); });
+        }
+        epochNs = MonotonicNs();
+        operate();
+        drain();
+        return true;
+    }
+
+    void report(FILE *to, FILE *results, const std::string &label);
+
+private:
+    double nowMs() const { return (MonotonicNs() - epochNs) / 1e6 * sc.speedup; }
+
+    std::chrono::microseconds real(double simMs) const {
+        return std::chrono::microseconds((long long)std::max(0.0, simMs * 1000 / sc.speedup));
+    }
+
+    // The station as the scenario describes it, with every interval it
+    // waits out or polls at scaled to the simulated clock. The per-minute
+    // restore limits are off: they can't be made shorter than a minute,
+    // and the stand-in tool never hangs.
+    void configure() {
+        double s = sc.speedup;
+        cfg.catalog = catalog.get();
+        cfg.restoreTool = &tool;
+        cfg.daemon = true;
+        cfg.dbma.initial = Scaled(sc.dbma.initial, s);
+        cfg.dbma.max = Scaled(sc.dbma.max, s);
+        cfg.dbma.reissue = Scaled(sc.dbma.reissue, s);
+        cfg.dbma.deadline = Scaled(sc.dbma.deadline, s);
+        cfg.reenumerateWindow = Scaled(cfg.reenumerateWindow, s);
+        cfg.fallbackPoll = Scaled(sc.fallbackPoll, s);
+        cfg.disconnectErrors = sc.disconnectErrors;
+        cfg.errorRecheck = Scaled(cfg.errorRecheck, s);
+        cfg.failedHold = Scaled(cfg.failedHold, s);
+        cfg.batchWindow = Scaled(sc.batchWindow, s);
+        cfg.restoreLimits = {std::chrono::minutes(0), std::chrono::minutes(0)};
+    }
+
+    void record(const char *phase, double ms) { samples[phase].push_back(std::max(0.0, ms)); }
+
+    SimPort *find(const std::string &label) {
+        int i = RegistryNameIndex(label.c_str(), "hpm");
+        return i >= 0 && i < (int)ports.size() ? ports[i].get() : nullptr;
+    }
+
+    // Whether a session is under way on the port.
+    bool inSession(const SimPort &p) {
+        std::lock_guard<std::mutex> guard(sched->lock);
+        auto it = sched->workers.find(p.node.entryID);
+        if (it == sched->workers.end())
+            return false;
+        PortState state = it->second->state;
+        return !it->second->done && state != PortState::Done && state != PortState::Failed;
+    }
+
+    // Whether the port's last session has wound down, so that the station
+    // takes up a unit plugged in now. It says "disconnected" a moment before.
+    bool letGo(const SimPort &p) {
+        std::lock_guard<std::mutex> guard(sched->lock);
+        auto it = sched->workers.find(p.node.entryID);
+        return it == sched->workers.end() || it->second->done;
+    }
+
+    // What IOKit does when a partner comes or goes: the port's worker gets
+    // an interest message, and in notification mode the watcher probes the
+    // port (NotifyWatcher::probe). Mock thread, station lock not held.
+    void changed(SimPort &p) {
+        {
+            std::lock_guard<std::mutex> guard(sched->lock);
+            auto it = sched->workers.find(p.node.entryID);
+            if (it != sched->workers.end())
+                it->second->conn->post();
+        }
+        if (sc.strategy == Strategy::Notify)
+            sched->probe(p.node);
+    }
+
+    // The unit turns up in DFU: what DfuUSBWatcher hands the scheduler, then
+    // the restore request a script on the control socket would send for it.
+    // Returns the error, if any.
+    std::string enumerate(SimPort &p, const Unit &u) {
+        DfuTarget t;
+        ParseDfuSerial(u.serial, t);
+        t.portIndex = p.index;
+        sched->bindDfuTarget(t);
+        {
+            std::lock_guard<std::mutex> guard(sched->lock);
+            PortWorker *w = sched->findWorker(p.node.label);
+            if (!w || !w->hasTarget())
+                return "target not bound to the port";
+        }
+        std::string reply;
+        return sched->control({"restore", p.node.label, ipsws[u.modelIndex]}, reply);
+    }
+
+    // What a run of the restore tool for these targets does: it takes as
+    // long as the slowest of their current attempts and works if they all do.
+    void plan(const std::vector<std::string> &ecids, milliseconds &run, bool &works) {
+        std::lock_guard<std::mutex> guard(lock);
+        works = !ecids.empty();
+        for (auto &ecid : ecids) {
+            auto it = byEcid.find(ecid);
+            if (it == byEcid.end() || it->second->attempt >= it->second->restores.size()) {
+                works = false;
+                continue;
+            }
+            auto &attempt = it->second->restores[it->second->attempt];
+            run = std::max(run, attempt.first);
+            works = works && attempt.second;
+        }
+    }
+
+    void observe() {
+        std::string buf;
+        char chunk[4096];
+        ssize_t n;
+        while ((n = read(feed, chunk, sizeof(chunk))) > 0) {
+            buf.append(chunk, (size_t)n);
+            for (size_t nl; (nl = buf.find('\n')) != std::string::npos; buf.erase(0, nl + 1))
+                onEvent(buf.substr(0, nl));
+        }
+    }
+
+    // Moves the port's unit along on an "event <port> <what> [key=value...]"
+    // line from the station.
+    void onEvent(const std::string &line) {
+        std::istringstream in(line);
+        std::string kind, label, what;
+        in >> kind >> label >> what;
+        std::map<std::string, std::string> args;
+        for (std::string word; in >> word;) {
+            size_t eq = word.find('=');
+            if (eq != std::string::npos)
+                args[word.substr(0, eq)] = word.substr(eq + 1);
+        }
+        SimPort *p = find(label);
+        if (kind != "event" || !p)
+            return;
+        std::lock_guard<std::mutex> guard(lock);
+        Unit *u = p->unit;
+        if (!running || !u)
+            return;
+        double now = nowMs();
+        if (what == "detected") {
+            if (!p->detected)
+                record("detect", now - p->plugMs);
+            p->detected = true;
+        } else if (what == "vdm-sent") {
+            const VdmProfile *vdm = FindVdmProfile(args["profile"]);
+            if (!p->finished && vdm && vdm->entersDfu)
+                p->bindAtMs = now + u->model->reenumerate.count();
+        } else if (what == "dfu-failed") {
+            if (!p->finished)
+                finish(*p, false, false);
+        } else if (what == "restore-start") {
+            p->restoreStartMs = now;
+        } else if (what == "restore-done") {
+            if (p->restoreStartMs >= 0)
+                p->restoringMs += now - p->restoreStartMs;
+            p->restoreStartMs = -1;
+            bool ok = args["code"] == "0";
+            // A run the tool itself failed is worth another; one the station stopped isn't.
+            bool again = !ok && !args.count("reason") && u->attempt + 1 < u->restores.size();
+            if (!p->finished)
+                finish(*p, ok, again);
+        } else if (what == "disconnected") {
+            // Only once the operator pulled the unit; a session that a run of
+            // I2C errors ended leaves it on the port.
+            if (p->unplugged)
+                release(*p);
+        }
+        cv.notify_all();
+    }
+
+    // The station is done with the port's unit for now: restored, failed, or
+    // (`again`) to be restored once more after a replug. The operator comes
+    // for it.
+    void finish(SimPort &p, bool ok, bool again) {
+        double now = nowMs();
+        Unit *u = p.unit;
+        p.finished = true;
+        p.finishedMs = now;
+        p.unplugAtMs = now + sc.unplug.count();
+        p.bindAtMs = -1;
+        u->again = again;
+        if (!again) {
+            u->ok = ok;
+            u->finishMs = now;
+        }
+    }
+
+    // The station has seen the unit leave; the port is free again.
+    void release(SimPort &p) {
+        double now = nowMs();
+        Unit *u = p.unit;
+        record("disconnect", now - p.pulledMs);
+        p.busyMs += now - p.plugMs;
+        if (u->again) {
+            u->again = false;
+            ++u->attempt;
+            u->queuedMs = now;
+            waiting.push_front(u);
+        } else {
+            record("unit", now - u->arriveMs);
+        }
+        p.unit = nullptr;
+        p.detected = p.finished = p.unplugged = false;
+        p.bindAtMs = p.restoreStartMs = -1;
+    }
+
+    // Everything but the station: arrivals go onto free ports in order,
+    // targets show up in DFU after their VDM, the operator pulls finished
+    // units, and in polling mode the scans run.
+    void operate() {
+        double endMs = sc.minutes * 60000, nextScanMs = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            double now = nowMs();
+            if (now >= endMs)
+                break;
+            size_t free = 0;
+            for (auto &p : ports) free += !p->unit;
+            if (sc.arrivalsPerHour > 0)
+                while (source.nextArrivalMs() <= now) arrive(source.take(now));
+            else
+                while (waiting.size() < free) arrive(source.take(now));
+            for (auto &pp : ports) {
+                SimPort &p = *pp;
+                if (p.unit && p.bindAtMs >= 0 && p.bindAtMs <= now) {
+                    p.bindAtMs = -1;
+                    Unit *u = p.unit;
+                    guard.unlock();
+                    std::string err = enumerate(p, *u);
+                    guard.lock();
+                    if (!err.empty()) {
+                        LogWarn(p.node.label.c_str(), "Restore request failed: %s", err.c_str());
+                        if (p.unit == u && !p.finished)
+                            finish(p, false, false);
+                    }
+                }
+                if (p.unit && p.finished && !p.unplugged && p.unplugAtMs <= now) {
+                    p.unplugged = true;
+                    p.pulledMs = now;
+                    record("pickup", now - p.finishedMs);
+                    guard.unlock();
+                    p.mock->unplug();
+                    bool live = inSession(p);
+                    guard.lock();
+                    // Nothing will report a session that had already ended.
+                    if (!live && p.unit && p.unplugged)
+                        release(p);
+                }
+                if (!p.unit && !waiting.empty() && letGo(p)) {
+                    Unit *u = waiting.front();
+                    waiting.pop_front();
+                    p.unit = u;
+                    p.plugMs = now;
+                    record("queue", now - u->queuedMs);
+                    guard.unlock();
+                    p.mock->plug(u->model->target, u->seed + (unsigned)u->attempt);
+                    guard.lock();
+                }
+                // Without polling nothing looks at a port again until IOKit
+                // says it changed, so a unit whose session ended early (a
+                // controller error, or a missed first read) just sits there
+                // until the operator gives up on it.
+                if (sc.strategy == Strategy::Notify && p.unit && !p.finished && !inSession(p))
+                    finish(p, false, false);
+            }
+            if (sc.strategy == Strategy::Poll && now >= nextScanMs) {
+                nextScanMs = now + sc.scan.count();
+                guard.unlock();
+                sched->scan(nodes);
+                guard.lock();
+            }
+            double next = std::min(endMs, sc.strategy == Strategy::Poll ? nextScanMs : now + sc.scan.count());
+            if (sc.arrivalsPerHour > 0)
+                next = std::min(next, source.nextArrivalMs());
+            for (auto &p : ports) {
+                if (!p->unit && !waiting.empty())
+                    next = std::min(next, now + sc.speedup); // look again for letGo() in a real millisecond
+                if (p->bindAtMs >= 0)
+                    next = std::min(next, p->bindAtMs);
+                if (p->unit && p->finished && !p->unplugged)
+                    next = std::min(next, p->unplugAtMs);
+            }
+            cv.wait_for(guard, real(next - now) + std::chrono::microseconds(100));
+        }
+        running = false;
+        endedMs = endMs;
+        for (auto &p : ports)
+            if (p->restoreStartMs >= 0)
+                p->restoringMs += endMs - p->restoreStartMs;
+    }
+
+    void arrive(std::unique_ptr<Unit> u) {
+        waiting.push_back(u.get());
+        byEcid[u->ecid] = u.get();
+        units.push_back(std::move(u));
+    }
+
+    bool idle() {
+        std::lock_guard<std::mutex> guard(sched->lock);
+        for (auto &kv : sched->workers)
+            if (!kv.second->done)
+                return false;
+        return true;
+    }
+
+    // Takes every unit away and waits for the sessions to end, so that
+    // nothing is left on the executor when the Scheduler goes.
+    void drain() {
+        {
+            std::lock_guard<std::mutex> guard(sched->lock);
+            for (auto &kv : sched->workers) kv.second->cancelRestore();
+        }
+        for (auto &p : ports) p->mock->unplug();
+        for (int i = 0; i < 3000 && !idle(); ++i) std::this_thread::sleep_for(milliseconds(10));
+        sched->events.unsubscribe(publisher);
+        shutdown(publisher, SHUT_RDWR);
+        observer.join();
+        close(publisher);
+        close(feed);
+        sched.reset();
+    }
+
+    const Scenario &sc;
+    UnitSource source;
+    std::string dir;                 // scratch: the firmware files and restore slots
+    std::vector<std::string> ipsws;  // by model
+    std::unique_ptr<IpswCatalog> catalog;
+    FakeRestoreTool tool;
+    Config cfg;
+    std::vector<std::unique_ptr<SimPort>> ports;
+    std::vector<HPMNode> nodes;
+    std::unique_ptr<Scheduler> sched; // goes before the ports its workers talk to
+    int publisher = -1, feed = -1;
+    std::thread observer;
+    uint64_t epochNs = 0;
+
+    std::mutex lock; // guards everything below and SimPort's station fields
+    std::condition_variable cv;
+    bool running = true;
+    double endedMs = 0;
+    std::vector<std::unique_ptr<Unit>> units;
+    std::map<std::string, Unit *> byEcid;
+    std::deque<Unit *> waiting;
+    std::map<std::string, std::vector<double>> samples; // the bench's own phases
+};
+
+// The phases of a unit's way through the station, in order. dbma, vdm,
+// reenumerate and restore are the station's own spans from TimingLog, taken
+// in real time and scaled up; the bench times the rest on the simulated clock.
+static const struct {
+    const char *name;
+    bool station;
+} kPhases[] = {{"queue", false}, {"detect", false},  {"dbma", true},        {"vdm", true}, {"reenumerate", true},
+               {"restore", true}, {"pickup", false}, {"disconnect", false}, {"unit", false}};
+
+void Station::report(FILE *to, FILE *results, const std::string &label) {
+    int arrived = (int)units.size(), restored = 0, failed = 0;
+    double busy = 0, restoringMs = 0;
+    for (auto &u : units) {
+        if (u->finishMs >= 0)
+            ++(u->ok ? restored : failed);
+    }
+    for (auto &p : ports) {
+        busy += p->busyMs + (p->unit ? endedMs - p->plugMs : 0);
+        restoringMs += p->restoringMs;
+    }
+    double hours = endedMs / 3600000.0, capacity = endedMs * ports.size();
+    double perHour = restored / hours, utilization = busy / capacity, restoreShare = restoringMs / capacity;
+
+    fprintf(to, "\n\U0001F3C1 %s: %d port%s, %.0f simulated min at %gx\n", sc.name.c_str(), sc.ports,
+            sc.ports == 1 ? "" : "s", sc.minutes, sc.speedup);
+    fprintf(to, "\U0001F3C1 %d units arrived, %d restored, %d failed, %zu still waiting\n", arrived, restored, failed,
+            waiting.size());
+    fprintf(to, "\U0001F3C1 %.1f units/hour (%.2f per port), ports occupied %.0f%%, restoring %.0f%%\n", perHour,
+            perHour / sc.ports, utilization * 100, restoreShare * 100);
+
+    auto spans = TimingLog::shared().snapshot();
+    fprintf(to, "\U0001F4CA %-12s %7s %12s %12s %12s %12s\n", "phase", "n", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    std::string phases;
+    for (auto &phase : kPhases) {
+        std::vector<double> v = phase.station ? spans[phase.name] : samples[phase.name];
+        if (phase.station)
+            for (double &ms : v) ms *= sc.speedup;
+        std::sort(v.begin(), v.end());
+        double p50 = TimingLog::Percentile(v, 50), p95 = TimingLog::Percentile(v, 95),
+               p99 = TimingLog::Percentile(v, 99), max = v.empty() ? 0 : v.back();
+        fprintf(to, "\U0001F4CA %-12s %7zu %12.1f %12.1f %12.1f %12.1f\n", phase.name, v.size(), p50, p95, p99, max);
+        char buf[160];
+        snprintf(buf, sizeof(buf), "%s\"%s\":{\"n\":%zu,\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+                 phases.empty() ? "" : ",", phase.name, v.size(), p50, p95, p99, max);
+        phases += buf;
+    }
+    if (!results)
+        return;
+    fprintf(results,
+            "{\"label\":\"%s\",\"scenario\":\"%s\",\"seed\":%u,\"ports\":%d,\"minutes\":%g,\"speedup\":%g,"
+            "\"arrived\":%d,\"restored\":%d,\"failed\":%d,\"waiting\":%zu,\"units_per_hour\":%.3f,"
+            "\"utilization\":%.4f,\"restoring\":%.4f,\"phases\":{%s}}\n",
+            label.c_str(), sc.name.c_str(), sc.seed, sc.ports, sc.minutes, sc.speedup, arrived, restored, failed,
+            waiting.size(), perHour, utilization, restoreShare, phases.c_str());
+    fflush(results);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] SCENARIO.json...\n"
+                    "  --speedup N          override the scenario's simulated-time speedup\n"
+                    "  --seed N             override the scenario's random seed\n"
+                    "  --results FILE       append one NDJSON line of results per scenario\n"
+                    "  --label TEXT         recorded with the results, e.g. the commit\n"
+                    "  --timing-log FILE    append the station's phases as NDJSON, in real time\n"
+                    "  --verbose            show the station's log\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "--restore-tool"))
+        return FakeRestore(argc, argv);
+    double speedup = 0;
+    long seed = -1;
+    std::string label;
+    FILE *results = nullptr;
+    std::vector<std::string> files;
+    Logger::shared().setLevel(LogLevel::Error);
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = true;
+        if (!strcmp(arg, "--speedup")) {
+            speedup = atof(val), ok = speedup >= 1, ++i;
+        } else if (!strcmp(arg, "--seed")) {
+            seed = (long)strtoul(val, nullptr, 10), ok = *val, ++i;
+        } else if (!strcmp(arg, "--results")) {
+            ok = *val && (results = fopen(val, "a")) != nullptr, ++i;
+        } else if (!strcmp(arg, "--label")) {
+            label = val, ++i;
+        } else if (!strcmp(arg, "--timing-log")) {
+            ok = *val && TimingLog::shared().open(val), ++i;
+        } else if (!strcmp(arg, "--verbose")) {
+            Logger::shared().setLevel(LogLevel::Info);
+        } else if (arg[0] == '-') {
+            ok = false;
+        } else {
+            files.push_back(arg);
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (files.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Scenario> scenarios(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        std::string err;
+        if (!LoadScenario(files[i], scenarios[i], err)) {
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+        }
+        if (speedup > 0)
+            scenarios[i].speedup = speedup;
+        if (seed >= 0)
+            scenarios[i].seed = (unsigned)seed;
+    }
+    // The stand-in restore tool is this binary, run again.
+    char path[PATH_MAX];
+    std::string self = strchr(argv[0], '/') && realpath(argv[0], path) ? path : argv[0];
+    Logger::shared().start();
+    for (auto &sc : scenarios) {
+        Station station(sc, self);
+        std::string err;
+        if (!station.run(err)) {
+            fprintf(stderr, "%s: %s\n", sc.name.c_str(), err.c_str());
+            return 1;
+        }
+        station.report(stdout, results, label);
+    }
+    if (results)
+        fclose(results);
+    return 0;
+}
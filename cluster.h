@@ -0,0 +1,678 @@
+#ifndef cluster_h
+#define cluster_h
+
+// Optional coordination between stations. One host runs the coordinator: a
+// queue of restore jobs, plus a directory of the IPSWs each station has
+// staged. It speaks the control socket's line protocol over TCP:
+//
+//   hello <host> free=<n> peer=<addr:port>|- [file=<name>:<size>:<sha256>]...
+//   submit <ipsw> [ecid=<ecid>] [count=<n>]   -> job <id>...
+//   claim <host> <ecid> [<ipsw>...]           -> job <id> <ipsw>, or nothing
+//   done <id> <code>
+//   peers <host> <ipsw> <size>                -> peer <addr:port> <sha256>...
+//   status                                    -> host/queued/claimed lines
+//
+// A station that joins sends a heartbeat every few seconds. When a target
+// shows up in DFU, the station claims a job for it: a job for that ECID, or
+// a job for any IPSW that supports the target. It reports the job done once
+// the restore is over. A job that failed is queued again, up to three
+// tries. The jobs a station holds go back in the queue when its heartbeat
+// stops. Stations that have --peer-port serve their staged IPSWs to each
+// other over HTTP, so a new IPSW is copied from the shared storage once and
+// staged from peers after that.
+//
+// Both servers listen on --bind (loopback unless told otherwise). With
+// --token-file, every coordinator connection starts with "auth <token>"
+// and every peer request carries "Authorization: Bearer <token>".
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "log.h"
+#include "qos.h"
+
+struct ClusterFile {
+    std::string name;
+    uint64_t size = 0;
+    std::string sha256;
+};
+
+struct ClusterJob {
+    uint64_t id = 0;
+    std::string ipsw; // file name, as in the catalog
+};
+
+namespace clusterdetail {
+
+// "0x001A2B" and "1a2b" are the same ECID.
+inline std::string NormalizeEcid(std::string e) {
+    if (e.size() > 2 && e[0] == '0' && (e[1] == 'x' || e[1] == 'X'))
+        e.erase(0, 2);
+    size_t digits = e.find_first_not_of('0');
+    if (digits == std::string::npos)
+        digits = e.empty() ? 0 : e.size() - 1; // all zeros: keep one
+    e.erase(0, digits);
+    for (auto &c : e) c = (char)tolower((unsigned char)c);
+    return e;
+}
+
+inline void SetTimeout(int fd, int ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Connects to "host:port" within `timeoutMs`; -1 on failure.
+inline int Connect(const std::string &hostPort, int timeoutMs) {
+    size_t colon = hostPort.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return -1;
+    std::string host = hostPort.substr(0, colon), port = hostPort.substr(colon + 1);
+    struct addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        bool ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        if (!ok && errno == EINPROGRESS) {
+            struct pollfd p = {fd, POLLOUT, 0};
+            int soerr = 0;
+            socklen_t len = sizeof(soerr);
+            ok = poll(&p, 1, timeoutMs) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == 0 && !soerr;
+        }
+        if (!ok) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        fcntl(fd, F_SETFL, flags);
+        SetTimeout(fd, timeoutMs);
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+inline bool WriteAll(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+} // namespace clusterdetail
+
+// Sends one request line, after the "auth" line if there is a `token`, and
+// collects the data lines of the reply. Returns false if the coordinator
+// couldn't be reached; `err` is the reason it gave for an "err" reply
+// ("auth" for a wrong token), or "" for "ok".
+inline bool ClusterRequest(const std::string &coordinator, const std::string &token, const std::string &line,
+                           std::vector<std::string> &out, std::string &err, int timeoutMs = 2000) {
+    out.clear();
+    err.clear();
+    int fd = clusterdetail::Connect(coordinator, timeoutMs);
+    if (fd < 0)
+        return false;
+    std::string msg = (token.empty() ? "" : "auth " + token + "\n") + line + "\n", buf;
+    bool ok = clusterdetail::WriteAll(fd, msg.data(), msg.size()), finished = false, authPending = !token.empty();
+    char chunk[4096];
+    ssize_t n;
+    while (ok && !finished && (n = read(fd, chunk, sizeof(chunk))) > 0) {
+        buf.append(chunk, n);
+        size_t pos;
+        while (!finished && (pos = buf.find('\n')) != std::string::npos) {
+            std::string l = buf.substr(0, pos);
+            buf.erase(0, pos + 1);
+            if (l == "ok" && authPending) {
+                authPending = false;
+            } else if (l == "ok") {
+                finished = true;
+            } else if (l.compare(0, 4, "err ") == 0) {
+                err = l.substr(4);
+                finished = true;
+            } else {
+                out.push_back(l);
+            }
+        }
+    }
+    close(fd);
+    return finished;
+}
+
+// The coordinator's state, served through a TCP ControlServer.
+class ClusterQueue {
+public:
+    static constexpr std::chrono::seconds kHostTimeout{30};
+    static constexpr int kAttempts = 3;
+
+    explicit ClusterQueue(EventBus &events) : events(events) {}
+
+    std::string handle(const std::vector<std::string> &args, std::string &reply) {
+        const std::string &cmd = args[0];
+        std::lock_guard<std::mutex> guard(lock);
+        expire();
+        if (cmd == "hello" && args.size() >= 2) {
+            Host &h = hosts[args[1]];
+            bool fresh = h.seen == Clock::time_point();
+            h.seen = Clock::now();
+            h.files.clear();
+            for (size_t i = 2; i < args.size(); ++i) {
+                std::string v;
+                if (Value(args[i], "free", v))
+                    h.freePorts = atoi(v.c_str());
+                else if (Value(args[i], "peer", v))
+                    h.peer = v == "-" ? "" : v;
+                else if (Value(args[i], "file", v))
+                    h.files.push_back(ParseFile(v));
+            }
+            if (fresh)
+                LogInfo("", "\U0001F310 %s joined (%d free port%s, %zu IPSW%s)", args[1].c_str(), h.freePorts,
+                        h.freePorts == 1 ? "" : "s", h.files.size(), h.files.size() == 1 ? "" : "s");
+            return "";
+        }
+        if (cmd == "submit" && args.size() >= 2) {
+            Order o;
+            o.ipsw = args[1];
+            int count = 1;
+            for (size_t i = 2; i < args.size(); ++i) {
+                std::string v;
+                if (Value(args[i], "ecid", v))
+                    o.ecid = clusterdetail::NormalizeEcid(v);
+                else if (Value(args[i], "count", v))
+                    count = atoi(v.c_str());
+                else
+                    return "unknown option " + args[i];
+            }
+            if (count < 1 || (count > 1 && !o.ecid.empty()))
+                return "bad count";
+            for (int i = 0; i < count; ++i) {
+                o.id = nextId++;
+                queue.push_back(o);
+                reply += "job " + std::to_string(o.id) + "\n";
+            }
+            events.publish("event cluster queued " + std::to_string(count) + " ipsw=" + o.ipsw);
+            return "";
+        }
+        if (cmd == "claim" && args.size() >= 3) {
+            std::string ecid = clusterdetail::NormalizeEcid(args[2]);
+            auto it = std::find_if(queue.begin(), queue.end(), [&](const Order &o) { return o.ecid == ecid; });
+            if (it == queue.end())
+                it = std::find_if(queue.begin(), queue.end(), [&](const Order &o) {
+                    return o.ecid.empty() && std::find(args.begin() + 3, args.end(), o.ipsw) != args.end();
+                });
+            if (it == queue.end())
+                return "";
+            claimed[it->id] = Claim{*it, args[1]};
+            reply += "job " + std::to_string(it->id) + " " + it->ipsw + "\n";
+            events.publish("event cluster claimed " + std::to_string(it->id) + " host=" + args[1] + " ecid=" + args[2]);
+            queue.erase(it);
+            return "";
+        }
+        if (cmd == "done" && args.size() >= 3) {
+            auto it = claimed.find(strtoull(args[1].c_str(), nullptr, 10));
+            if (it == claimed.end())
+                return "unknown job";
+            Order o = it->second.order;
+            claimed.erase(it);
+            int code = atoi(args[2].c_str());
+            events.publish("event cluster done " + std::to_string(o.id) + " code=" + args[2]);
+            if (code != 0 && ++o.attempts < kAttempts)
+                queue.push_front(o);
+            else if (code != 0)
+                LogWarn("", "\U0001F310 Job %llu (%s) failed %d times; dropped.", (unsigned long long)o.id,
+                        o.ipsw.c_str(), o.attempts);
+            return "";
+        }
+        if (cmd == "peers" && args.size() >= 4) {
+            uint64_t size = strtoull(args[3].c_str(), nullptr, 10);
+            for (auto &kv : hosts) {
+                if (kv.first == args[1] || kv.second.peer.empty())
+                    continue;
+                for (auto &f : kv.second.files)
+                    if (f.name == args[2] && f.size == size)
+                        reply += "peer " + kv.second.peer + " " + f.sha256 + "\n";
+            }
+            return "";
+        }
+        if (cmd == "status") {
+            char line[512];
+            for (auto &kv : hosts) {
+                snprintf(line, sizeof(line), "host %s free=%d files=%zu seen=%llds peer=%s\n", kv.first.c_str(),
+                         kv.second.freePorts, kv.second.files.size(),
+                         (long long)std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - kv.second.seen)
+                             .count(),
+                         kv.second.peer.empty() ? "-" : kv.second.peer.c_str());
+                reply += line;
+            }
+            for (auto &o : queue)
+                reply += "queued " + std::to_string(o.id) + " " + o.ipsw + " ecid=" + (o.ecid.empty() ? "-" : o.ecid) +
+                         "\n";
+            for (auto &kv : claimed)
+                reply += "claimed " + std::to_string(kv.first) + " " + kv.second.order.ipsw + " host=" + kv.second.host +
+                         "\n";
+            return "";
+        }
+        return "unknown command";
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Host {
+        std::string peer; // "" if it doesn't serve files
+        int freePorts = 0;
+        std::vector<ClusterFile> files;
+        Clock::time_point seen;
+    };
+    struct Order {
+        uint64_t id = 0;
+        std::string ipsw;
+        std::string ecid; // normalized, "" for any target
+        int attempts = 0;
+    };
+    struct Claim {
+        Order order;
+        std::string host;
+    };
+
+    static bool Value(const std::string &arg, const char *key, std::string &out) {
+        size_t n = strlen(key);
+        if (arg.compare(0, n, key) != 0 || arg.size() <= n || arg[n] != '=')
+            return false;
+        out = arg.substr(n + 1);
+        return true;
+    }
+
+    // "<name>:<size>:<sha256>"; the name may itself contain colons.
+    static ClusterFile ParseFile(const std::string &v) {
+        ClusterFile f;
+        size_t b = v.rfind(':'), a = b == std::string::npos || b == 0 ? std::string::npos : v.rfind(':', b - 1);
+        if (a == std::string::npos) {
+            f.name = v;
+            return f;
+        }
+        f.name = v.substr(0, a);
+        f.size = strtoull(v.c_str() + a + 1, nullptr, 10);
+        f.sha256 = v.substr(b + 1);
+        return f;
+    }
+
+    // Forgets hosts that stopped sending heartbeats and queues their jobs
+    // again. Caller holds `lock`.
+    void expire() {
+        auto now = Clock::now();
+        for (auto it = hosts.begin(); it != hosts.end();) {
+            if (now - it->second.seen < kHostTimeout) {
+                ++it;
+                continue;
+            }
+            LogWarn("", "\U0001F310 %s stopped responding.", it->first.c_str());
+            for (auto c = claimed.begin(); c != claimed.end();) {
+                if (c->second.host == it->first) {
+                    queue.push_front(c->second.order);
+                    c = claimed.erase(c);
+                } else {
+                    ++c;
+                }
+            }
+            it = hosts.erase(it);
+        }
+    }
+
+    EventBus &events;
+    std::mutex lock; // guards everything below
+    std::map<std::string, Host> hosts;
+    std::deque<Order> queue;
+    std::map<uint64_t, Claim> claimed;
+    uint64_t nextId = 1;
+};
+
+// A station's side of the cluster. Everything that talks to the
+// coordinator runs on one thread, so a coordinator that is slow or gone
+// never holds up a port; heartbeats go out every kHeartbeat, and "done"
+// reports that didn't get through are sent again with the next one.
+class ClusterClient {
+public:
+    static constexpr std::chrono::seconds kHeartbeat{10};
+
+    // `peer` is how other stations reach this one's file server, "" if it
+    // doesn't run one.
+    ClusterClient(std::string coordinator, std::string token, std::string host, std::string peer)
+        : coordinator(std::move(coordinator)), authToken(std::move(token)), host(std::move(host)),
+          peer(std::move(peer)) {}
+
+    ~ClusterClient() { stop(); }
+
+    // Set before start(); called on the client thread for each heartbeat.
+    std::function<int()> freePorts;
+    std::function<std::vector<ClusterFile>()> files;
+
+    const std::string &name() const { return host; }
+    const std::string &token() const { return authToken; }
+
+    void start() {
+        thread = std::thread([this] {
+            SetThreadQos(QOS_CLASS_UTILITY);
+            loop();
+        });
+    }
+
+    // Waits for the request in flight; what's still queued is dropped.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) thread.join();
+    }
+
+    // Asks for a job for a target that just showed up in DFU. `ipsws` are
+    // the catalog files that support it. `done` runs on the client thread,
+    // with false if there is no job or the coordinator couldn't be reached.
+    void claim(const std::string &ecid, const std::vector<std::string> &ipsws,
+               std::function<void(bool, const ClusterJob &)> done) {
+        std::string line = "claim " + host + " " + (ecid.empty() ? "-" : ecid);
+        for (auto &n : ipsws) line += " " + n;
+        post([this, line, done] {
+            std::vector<std::string> reply;
+            std::string err;
+            ClusterJob job;
+            bool ok = request(line, reply, err) && err.empty() && !reply.empty();
+            if (ok) {
+                char name[1024] = {};
+                unsigned long long id = 0;
+                ok = sscanf(reply[0].c_str(), "job %llu %1023s", &id, name) == 2;
+                job.id = id;
+                job.ipsw = name;
+            }
+            done(ok, job);
+        });
+    }
+
+    void finish(uint64_t id, int code) {
+        std::lock_guard<std::mutex> guard(lock);
+        unreported.push_back({id, code});
+        tasks.push_back([this] { report(); });
+        cv.notify_all();
+    }
+
+    // Stations with `name` staged, with the sha256 each one advertises.
+    // Blocking; for the stager thread.
+    std::vector<std::pair<std::string, std::string>> peers(const std::string &name, uint64_t size) {
+        std::vector<std::pair<std::string, std::string>> out;
+        std::vector<std::string> reply;
+        std::string err;
+        if (!ClusterRequest(coordinator, authToken, "peers " + host + " " + name + " " + std::to_string(size), reply, err))
+            return out;
+        for (auto &l : reply) {
+            char addr[512] = {}, sha[65] = {};
+            if (sscanf(l.c_str(), "peer %511s %64s", addr, sha) == 2)
+                out.push_back({addr, sha});
+        }
+        return out;
+    }
+
+private:
+    void post(std::function<void()> task) {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(std::move(task));
+        cv.notify_all();
+    }
+
+    // Remembers whether the coordinator answered, and logs the changes.
+    bool request(const std::string &line, std::vector<std::string> &reply, std::string &err) {
+        bool ok = ClusterRequest(coordinator, authToken, line, reply, err);
+        if (ok && err == "auth" && !rejected)
+            LogError("", "\U0001F310 Coordinator %s rejected the cluster token.", coordinator.c_str());
+        rejected = ok && err == "auth";
+        if (ok && !reachable)
+            LogInfo("", "\U0001F310 Coordinator %s reachable again.", coordinator.c_str());
+        else if (!ok && reachable)
+            LogWarn("", "\U0001F310 Coordinator %s not reachable.", coordinator.c_str());
+        reachable = ok;
+        return ok;
+    }
+
+    void heartbeat() {
+        std::string line = "hello " + host + " free=" + std::to_string(freePorts ? freePorts() : 0) +
+                           " peer=" + (peer.empty() ? "-" : peer);
+        if (files)
+            for (auto &f : files())
+                line += " file=" + f.name + ":" + std::to_string(f.size) + ":" + f.sha256;
+        std::vector<std::string> reply;
+        std::string err;
+        request(line, reply, err);
+        report();
+    }
+
+    // Sends the "done" reports still owed, oldest first.
+    void report() {
+        while (true) {
+            std::pair<uint64_t, int> next;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (unreported.empty())
+                    return;
+                next = unreported.front();
+            }
+            std::vector<std::string> reply;
+            std::string err;
+            if (!request("done " + std::to_string(next.first) + " " + std::to_string(next.second), reply, err))
+                return; // try again with the next heartbeat
+            std::lock_guard<std::mutex> guard(lock);
+            unreported.pop_front();
+        }
+    }
+
+    void loop() {
+        auto next = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping) {
+            if (std::chrono::steady_clock::now() >= next) {
+                guard.unlock();
+                heartbeat();
+                guard.lock();
+                next = std::chrono::steady_clock::now() + kHeartbeat;
+                continue;
+            }
+            if (tasks.empty()) {
+                cv.wait_until(guard, next, [this] { return stopping || !tasks.empty(); });
+                continue;
+            }
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+    }
+
+    std::string coordinator, authToken, host, peer;
+    bool reachable = true, rejected = false; // client thread only
+    std::mutex lock;       // guards everything below
+    std::condition_variable cv;
+    bool stopping = false;
+    std::deque<std::function<void()>> tasks;
+    std::deque<std::pair<uint64_t, int>> unreported; // job id, exit code
+    std::thread thread;
+};
+
+// Serves staged IPSWs to other stations: GET /ipsw/<name>, the whole file.
+// `lookup` maps a file name to its staged path ("" if it isn't staged), so
+// nothing outside the stage directory is ever served. With a `token`, a
+// request without "Authorization: Bearer <token>" gets 403.
+class PeerFileServer {
+public:
+    using Lookup = std::function<std::string(const std::string &name)>;
+
+    PeerFileServer(std::string bindAddress, uint16_t port, std::string token, Lookup lookup)
+        : bindAddress(std::move(bindAddress)), port(port), token(std::move(token)), lookup(std::move(lookup)) {}
+
+    ~PeerFileServer() {
+        if (listenFd >= 0) close(listenFd);
+    }
+
+    bool start() {
+        signal(SIGPIPE, SIG_IGN);
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            return false;
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1) {
+            errno = EADDRNOTAVAIL;
+            return false;
+        }
+        if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 8) != 0)
+            return false;
+        std::thread([this] {
+            SetThreadQos(QOS_CLASS_UTILITY);
+            acceptLoop();
+        }).detach();
+        return true;
+    }
+
+private:
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            clusterdetail::SetTimeout(fd, 30000);
+            std::thread([this, fd] {
+                SetThreadQos(QOS_CLASS_UTILITY);
+                serve(fd);
+                close(fd);
+            }).detach();
+        }
+    }
+
+    void serve(int fd) {
+        std::string req;
+        char chunk[1024];
+        ssize_t n;
+        while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192 &&
+               (n = read(fd, chunk, sizeof(chunk))) > 0)
+            req.append(chunk, n);
+        if (!token.empty() && !authorized(req)) {
+            const char *denied = "HTTP/1.0 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            clusterdetail::WriteAll(fd, denied, strlen(denied));
+            return;
+        }
+        std::string path;
+        const char *prefix = "GET /ipsw/";
+        size_t sp = req.find(' ', strlen(prefix));
+        if (req.compare(0, strlen(prefix), prefix) == 0 && sp != std::string::npos)
+            path = lookup(req.substr(strlen(prefix), sp - strlen(prefix)));
+        int file = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (file < 0 || fstat(file, &st) != 0) {
+            const char *missing = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            clusterdetail::WriteAll(fd, missing, strlen(missing));
+            if (file >= 0) close(file);
+            return;
+        }
+        std::string head = "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                           std::to_string((unsigned long long)st.st_size) + "\r\nConnection: close\r\n\r\n";
+        std::vector<char> buf(1 << 20);
+        bool ok = clusterdetail::WriteAll(fd, head.data(), head.size());
+        while (ok && (n = read(file, buf.data(), buf.size())) > 0)
+            ok = clusterdetail::WriteAll(fd, buf.data(), n);
+        close(file);
+    }
+
+    bool authorized(const std::string &req) const {
+        const char *header = "\r\nAuthorization: Bearer ";
+        size_t at = req.find(header), end = at == std::string::npos ? at : req.find("\r\n", at + strlen(header));
+        if (end == std::string::npos)
+            return false;
+        at += strlen(header);
+        return SameToken(req.substr(at, end - at), token);
+    }
+
+    std::string bindAddress;
+    uint16_t port;
+    std::string token;
+    Lookup lookup;
+    int listenFd = -1;
+};
+
+// Downloads `name` from the station at `peer`, handing the body to `sink`
+// as it arrives. Returns true if exactly `size` bytes came and `sink`
+// accepted all of them.
+inline bool FetchFromPeer(const std::string &peer, const std::string &token, const std::string &name, uint64_t size,
+                          const std::function<bool(const char *, size_t)> &sink) {
+    int fd = clusterdetail::Connect(peer, 5000);
+    if (fd < 0)
+        return false;
+    clusterdetail::SetTimeout(fd, 30000);
+    std::string req = "GET /ipsw/" + name + " HTTP/1.0\r\n" +
+                      (token.empty() ? "" : "Authorization: Bearer " + token + "\r\n") + "\r\n",
+                head;
+    bool ok = clusterdetail::WriteAll(fd, req.data(), req.size());
+    std::vector<char> buf(1 << 20);
+    uint64_t got = 0;
+    ssize_t n;
+    size_t end = std::string::npos;
+    while (ok && end == std::string::npos && head.size() < 8192 && (n = read(fd, buf.data(), buf.size())) > 0) {
+        head.append(buf.data(), n);
+        end = head.find("\r\n\r\n");
+    }
+    size_t status = head.find(' ');
+    ok = ok && end != std::string::npos && head.compare(0, 5, "HTTP/") == 0 && status < end &&
+         head.compare(status + 1, 3, "200") == 0;
+    if (ok && head.size() > end + 4) {
+        got = head.size() - end - 4;
+        ok = got <= size && sink(head.data() + end + 4, got);
+    }
+    while (ok && got < size && (n = read(fd, buf.data(), buf.size())) > 0) {
+        got += n;
+        ok = got <= size && sink(buf.data(), n);
+    }
+    close(fd);
+    return ok && got == size;
+}
+
+#endif /* cluster_h */
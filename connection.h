@@ -0,0 +1,135 @@
+#ifndef connection_h
+#define connection_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOMessage.h>
+#include <dispatch/dispatch.h>
+
+#include "qos.h"
+
+// Connection state hints for one port. IOKit callbacks post() when the
+// controller reports something; the port worker sleeps in wait() (or is
+// woken through `onWake` and checks with a zero timeout) and only touches
+// I2C when woken or when the fallback interval runs out.
+class ConnectionTracker {
+public:
+    enum Wake { Event, Terminated, Timeout, Interrupted };
+
+    // Called after every post()/interrupt(); set before anyone can post.
+    std::function<void()> onWake;
+
+    void post(bool terminated = false) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++pending;
+            gone |= terminated;
+        }
+        cv.notify_all();
+        if (onWake) onWake();
+    }
+
+    // Wakes a waiter without an IOKit event, e.g. because a restore was requested.
+    void interrupt() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            interrupted = true;
+        }
+        cv.notify_all();
+        if (onWake) onWake();
+    }
+
+    Wake wait(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait_for(guard, timeout, [this] { return gone || pending || interrupted; });
+        if (gone)
+            return Terminated;
+        if (interrupted) {
+            interrupted = false;
+            return Interrupted;
+        }
+        if (pending) {
+            pending = 0;
+            return Event;
+        }
+        return Timeout;
+    }
+
+    bool terminated() {
+        std::lock_guard<std::mutex> guard(lock);
+        return gone;
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    unsigned pending = 0;
+    bool gone = false;
+    bool interrupted = false;
+};
+
+// Forwards general-interest messages of AppleHPM services to their
+// trackers. All callbacks run on one private dispatch queue.
+class ServiceInterestWatcher {
+public:
+    class Subscription {
+    public:
+        ~Subscription() {
+            // Release on the callback queue so no message is in flight for us.
+            dispatch_sync_f(owner->queue, this, [](void *ctx) {
+                auto *self = static_cast<Subscription *>(ctx);
+                if (self->notification) IOObjectRelease(self->notification);
+            });
+        }
+
+    private:
+        friend class ServiceInterestWatcher;
+        ServiceInterestWatcher *owner = nullptr;
+        std::shared_ptr<ConnectionTracker> tracker;
+        io_object_t notification = 0;
+    };
+
+    ~ServiceInterestWatcher() {
+        if (notifyPort) IONotificationPortDestroy(notifyPort);
+        if (queue) dispatch_release(queue);
+    }
+
+    void start() {
+        queue = MakeSerialQueue("auto_dfu.hpm-interest", QOS_CLASS_USER_INTERACTIVE);
+        notifyPort = IONotificationPortCreate(kIOMainPortDefault);
+        if (!notifyPort)
+            throw std::runtime_error("IONotificationPortCreate failed");
+        IONotificationPortSetDispatchQueue(notifyPort, queue);
+    }
+
+    // Returns nullptr if IOKit refused the registration; the caller then
+    // relies on the fallback poll alone.
+    std::unique_ptr<Subscription> subscribe(io_service_t service, std::shared_ptr<ConnectionTracker> tracker) {
+        std::unique_ptr<Subscription> sub(new Subscription);
+        sub->owner = this;
+        sub->tracker = std::move(tracker);
+        if (IOServiceAddInterestNotification(notifyPort, service, kIOGeneralInterest,
+                                             &ServiceInterestWatcher::onMessage, sub.get(),
+                                             &sub->notification) != kIOReturnSuccess)
+            return nullptr;
+        return sub;
+    }
+
+private:
+    static void onMessage(void *refcon, io_service_t, natural_t messageType, void *) {
+        auto *sub = static_cast<Subscription *>(refcon);
+        sub->tracker->post(messageType == kIOMessageServiceIsTerminated);
+    }
+
+    dispatch_queue_t queue = nullptr;
+    IONotificationPortRef notifyPort = nullptr;
+};
+
+#endif /* connection_h */
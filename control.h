@@ -0,0 +1,263 @@
+#ifndef control_h
+#define control_h
+
+// Line-based control socket for daemon mode, also used over TCP by the
+// cluster coordinator.
+//
+// A request is one line of space-separated words. The reply is zero or more
+// data lines followed by "ok" or "err <reason>". "events" is special: the
+// server replies "ok" and then streams one line per event until the client
+// hangs up.
+//
+// Over TCP the server can require a shared token: the first line of every
+// connection must be "auth <token>", and a connection that gets it wrong
+// is answered "err auth" and closed. Until a TCP client has authenticated
+// (or, without a token, sent its first line) it has kGreetingTimeout per
+// read, kMaxGreeting bytes and one of kMaxUnauthenticated slots, so one
+// that connects and says nothing can't pile up threads or memory.
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "qos.h"
+
+// Compares a token without stopping at the first wrong byte, so the time
+// it takes doesn't tell a client how much of its guess was right.
+inline bool SameToken(const std::string &given, const std::string &token) {
+    if (given.size() != token.size())
+        return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < given.size(); ++i) diff |= (unsigned char)(given[i] ^ token[i]);
+    return diff == 0;
+}
+
+// Fan-out of event lines to every client that asked for them. Writes never
+// block the publisher: a client that can't keep up is dropped.
+class EventBus {
+public:
+    void subscribe(int fd) {
+        std::lock_guard<std::mutex> guard(lock);
+        fds.insert(fd);
+    }
+
+    void unsubscribe(int fd) {
+        std::lock_guard<std::mutex> guard(lock);
+        fds.erase(fd);
+    }
+
+    void publish(const std::string &line) {
+        std::string msg = line + "\n";
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = fds.begin(); it != fds.end();) {
+            ssize_t n = send(*it, msg.data(), msg.size(), MSG_DONTWAIT);
+            if (n != (ssize_t)msg.size()) {
+                shutdown(*it, SHUT_RDWR); // the client thread notices and cleans up
+                it = fds.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    std::mutex lock;
+    std::set<int> fds;
+};
+
+class ControlServer {
+public:
+    static constexpr int kGreetingTimeout = 5; // seconds
+    static constexpr size_t kMaxGreeting = 4096;
+    static constexpr int kMaxUnauthenticated = 8;
+    static constexpr size_t kMaxLine = 64 * 1024; // a hello listing many staged IPSWs still fits
+
+    // Fills `reply` with data lines and returns "" for ok or an error reason.
+    using Handler = std::function<std::string(const std::vector<std::string> &args, std::string &reply)>;
+
+    ControlServer(std::string path, Handler handler, EventBus &events)
+        : path(std::move(path)), handler(std::move(handler)), events(events) {}
+
+    // Listens on TCP `port` at the IPv4 address `bindAddress` instead of a
+    // socket file. An empty `token` lets any client in.
+    ControlServer(std::string bindAddress, uint16_t port, std::string token, Handler handler, EventBus &events)
+        : handler(std::move(handler)), events(events), port(port), bindAddress(std::move(bindAddress)),
+          token(std::move(token)) {}
+
+    ~ControlServer() {
+        if (listenFd >= 0) {
+            close(listenFd);
+            if (!port)
+                unlink(path.c_str());
+        }
+    }
+
+    bool start() {
+        signal(SIGPIPE, SIG_IGN);
+        if (port)
+            return startTcp();
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            return false;
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            return false;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str()); // stale socket from a previous run
+        if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0)
+            return false;
+        chmod(path.c_str(), 0660);
+        std::thread([this] {
+            SetThreadQos(QOS_CLASS_USER_INITIATED);
+            acceptLoop();
+        }).detach();
+        return true;
+    }
+
+private:
+    bool startTcp() {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            return false;
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1) {
+            errno = EADDRNOTAVAIL;
+            return false;
+        }
+        if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0)
+            return false;
+        std::thread([this] {
+            SetThreadQos(QOS_CLASS_USER_INITIATED);
+            acceptLoop();
+        }).detach();
+        return true;
+    }
+
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            if (port) {
+                // Only this thread adds to `unauthenticated`, so the check holds.
+                if (unauthenticated >= kMaxUnauthenticated) {
+                    close(fd);
+                    continue;
+                }
+                ++unauthenticated;
+                SetTimeout(fd, kGreetingTimeout);
+            }
+            std::thread([this, fd] {
+                SetThreadQos(QOS_CLASS_USER_INITIATED);
+                serve(fd);
+            }).detach();
+        }
+    }
+
+    static void SetTimeout(int fd, int seconds) {
+        struct timeval tv = {seconds, 0}; // 0: block for as long as it takes
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    static bool WriteAll(int fd, const std::string &s) {
+        size_t off = 0;
+        while (off < s.size()) {
+            ssize_t n = write(fd, s.data() + off, s.size() - off);
+            if (n <= 0)
+                return false;
+            off += n;
+        }
+        return true;
+    }
+
+    void serve(int fd) {
+        std::string buf;
+        char chunk[512];
+        bool streaming = false, admitted = !port, open = true;
+        ssize_t n;
+        while (open && (n = read(fd, chunk, sizeof(chunk))) > 0) {
+            if (streaming)
+                continue; // event clients only talk to hang up
+            buf.append(chunk, n);
+            size_t pos;
+            while (open && (pos = buf.find('\n')) != std::string::npos) {
+                std::string line = buf.substr(0, pos);
+                buf.erase(0, pos + 1);
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                std::vector<std::string> args;
+                std::istringstream words(line);
+                for (std::string w; words >> w;) args.push_back(w);
+                if (args.empty())
+                    continue;
+                if (!admitted) {
+                    if (!token.empty()) {
+                        bool ok = args.size() == 2 && args[0] == "auth" && SameToken(args[1], token);
+                        open = WriteAll(fd, ok ? "ok\n" : "err auth\n") && ok;
+                        if (!open)
+                            break;
+                    }
+                    admitted = true;
+                    --unauthenticated;
+                    SetTimeout(fd, 0); // "events" clients sit quietly for hours
+                    if (!token.empty())
+                        continue; // the auth line isn't a request
+                }
+                if (args[0] == "events") {
+                    WriteAll(fd, "ok\n");
+                    events.subscribe(fd);
+                    streaming = true;
+                    break;
+                }
+                std::string reply;
+                std::string err = handler(args, reply);
+                reply += err.empty() ? "ok\n" : "err " + err + "\n";
+                open = WriteAll(fd, reply);
+            }
+            if (buf.size() > (admitted ? kMaxLine : kMaxGreeting))
+                break; // no newline coming
+        }
+        if (streaming)
+            events.unsubscribe(fd);
+        if (!admitted)
+            --unauthenticated;
+        close(fd);
+    }
+
+    std::string path;
+    Handler handler;
+    EventBus &events;
+    uint16_t port = 0;
+    std::string bindAddress;
+    std::string token; // TCP only
+    int listenFd = -1;
+    std::atomic<int> unauthenticated{0}; // TCP connections that haven't authenticated yet
+};
+
+#endif /* control_h */
@@ -0,0 +1,167 @@
+#ifndef dfu_usb_h
+#define dfu_usb_h
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <dispatch/dispatch.h>
+
+#include "qos.h"
+
+// Product IDs an Apple target uses while sitting in DFU: the classic DFU
+// mode ID and the port-DFU ID that Apple Silicon/T2 Macs enumerate with.
+static const uint16_t kAppleVendorID = 0x05ac;
+static const uint16_t kAppleDFUProductIDs[] = {0x1227, 0xf014};
+
+// What we learn about a target once it shows up as a DFU USB device.
+struct DfuTarget {
+    std::string ecid;   // "0x..." as cfgutil --ecid expects it
+    std::string cpid;   // chip ID, hex without prefix
+    std::string bdid;   // board ID, hex without prefix
+    std::string serial; // raw USB serial string
+    uint32_t locationID = 0;
+    int portIndex = -1; // host port number read off the USB ancestry, -1 if unknown
+};
+
+// The iBoot serial string looks like
+// "CPID:8103 CPRV:11 CPFM:03 SCEP:01 BDID:26 ECID:001A2B3C4D5E6F70 IBFL:3C SRTG:[iBoot-...]".
+inline std::string DfuSerialField(const std::string &serial, const char *key) {
+    std::string needle = std::string(key) + ":";
+    size_t pos = 0;
+    while ((pos = serial.find(needle, pos)) != std::string::npos) {
+        if (pos == 0 || serial[pos - 1] == ' ') {
+            size_t start = pos + needle.size();
+            size_t end = serial.find(' ', start);
+            return serial.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        }
+        pos += needle.size();
+    }
+    return "";
+}
+
+inline bool ParseDfuSerial(const std::string &serial, DfuTarget &target) {
+    std::string ecid = DfuSerialField(serial, "ECID");
+    if (ecid.empty())
+        return false;
+    target.serial = serial;
+    target.ecid = "0x" + ecid;
+    target.cpid = DfuSerialField(serial, "CPID");
+    target.bdid = DfuSerialField(serial, "BDID");
+    return true;
+}
+
+// Trailing number of a registry name like "usb-drd1" or "hpm1", -1 if none.
+inline int RegistryNameIndex(const char *name, const char *prefix) {
+    size_t n = strlen(prefix);
+    if (strncmp(name, prefix, n) != 0 || name[n] < '0' || name[n] > '9')
+        return -1;
+    return atoi(name + n);
+}
+
+// Walks up the service plane from a USB device looking for the per-port
+// USB-C nubs ("usb-drdN"/"atcN"). On Apple Silicon hosts N matches the
+// "hpmN" controller of the same physical port.
+inline int UsbPortIndex(io_registry_entry_t entry) {
+    io_registry_entry_t cur = entry;
+    IOObjectRetain(cur);
+    int index = -1;
+    for (int depth = 0; depth < 32 && index < 0; ++depth) {
+        io_name_t name;
+        if (IORegistryEntryGetName(cur, name) == kIOReturnSuccess) {
+            index = RegistryNameIndex(name, "usb-drd");
+            if (index < 0)
+                index = RegistryNameIndex(name, "atc");
+        }
+        io_registry_entry_t parent = 0;
+        kern_return_t kr = IORegistryEntryGetParentEntry(cur, kIOServicePlane, &parent);
+        IOObjectRelease(cur);
+        if (kr != kIOReturnSuccess)
+            return index;
+        cur = parent;
+    }
+    IOObjectRelease(cur);
+    return index;
+}
+
+// Watches IOKit for Apple DFU devices and reports each arrival. Callbacks run
+// on a private dispatch queue.
+class DfuUSBWatcher {
+public:
+    explicit DfuUSBWatcher(std::function<void(const DfuTarget &)> onArrival) : onArrival(std::move(onArrival)) {}
+
+    ~DfuUSBWatcher() {
+        for (io_iterator_t it : iters)
+            if (it) IOObjectRelease(it);
+        if (notifyPort) IONotificationPortDestroy(notifyPort);
+        if (queue) dispatch_release(queue);
+    }
+
+    void start() {
+        queue = MakeSerialQueue("auto_dfu.dfu-usb", QOS_CLASS_USER_INTERACTIVE);
+        notifyPort = IONotificationPortCreate(kIOMainPortDefault);
+        if (!notifyPort)
+            throw std::runtime_error("IONotificationPortCreate failed");
+        IONotificationPortSetDispatchQueue(notifyPort, queue);
+
+        size_t i = 0;
+        for (uint16_t pid : kAppleDFUProductIDs) {
+            CFMutableDictionaryRef matching = IOServiceMatching("IOUSBHostDevice");
+            if (!matching)
+                throw std::runtime_error("IOServiceMatching failed");
+            SetNumber(matching, CFSTR("idVendor"), kAppleVendorID);
+            SetNumber(matching, CFSTR("idProduct"), pid);
+            if (IOServiceAddMatchingNotification(notifyPort, kIOFirstMatchNotification, matching,
+                                                 &DfuUSBWatcher::onMatched, this, &iters[i]) != kIOReturnSuccess)
+                throw std::runtime_error("IOServiceAddMatchingNotification failed");
+            onMatched(this, iters[i]); // arm; also reports targets already in DFU
+            ++i;
+        }
+    }
+
+private:
+    static void SetNumber(CFMutableDictionaryRef dict, CFStringRef key, int32_t value) {
+        CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+        CFDictionarySetValue(dict, key, num);
+        CFRelease(num);
+    }
+
+    static void onMatched(void *refcon, io_iterator_t iter) {
+        auto *self = static_cast<DfuUSBWatcher *>(refcon);
+        io_service_t device;
+        while ((device = IOIteratorNext(iter))) {
+            DfuTarget target;
+            bool ok = false;
+            CFStringRef str = (CFStringRef)IORegistryEntryCreateCFProperty(device, CFSTR("USB Serial Number"),
+                                                                          kCFAllocatorDefault, 0);
+            if (str) {
+                char buf[256];
+                if (CFGetTypeID(str) == CFStringGetTypeID() &&
+                    CFStringGetCString(str, buf, sizeof(buf), kCFStringEncodingUTF8))
+                    ok = ParseDfuSerial(buf, target);
+                CFRelease(str);
+            }
+            CFNumberRef loc = (CFNumberRef)IORegistryEntryCreateCFProperty(device, CFSTR("locationID"),
+                                                                          kCFAllocatorDefault, 0);
+            if (loc) {
+                CFNumberGetValue(loc, kCFNumberSInt32Type, &target.locationID);
+                CFRelease(loc);
+            }
+            target.portIndex = UsbPortIndex(device);
+            IOObjectRelease(device);
+            if (ok)
+                self->onArrival(target);
+        }
+    }
+
+    std::function<void(const DfuTarget &)> onArrival;
+    dispatch_queue_t queue = nullptr;
+    IONotificationPortRef notifyPort = nullptr;
+    io_iterator_t iters[sizeof(kAppleDFUProductIDs) / sizeof(kAppleDFUProductIDs[0])] = {};
+};
+
+#endif /* dfu_usb_h */
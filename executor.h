@@ -0,0 +1,120 @@
+#ifndef executor_h
+#define executor_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include <dispatch/dispatch.h>
+
+#include "qos.h"
+
+class PortExecutor;
+
+// A per-port state machine. step() does a bounded amount of work (at most a
+// controller transaction or two) and says when it wants to run again, so
+// one thread can drive every port on the station without sleeping.
+class PortMachine : public std::enable_shared_from_this<PortMachine> {
+public:
+    static constexpr std::chrono::microseconds kUntilKicked{-1};
+
+    virtual ~PortMachine() {
+        if (timer) {
+            dispatch_source_cancel(timer);
+            dispatch_release(timer);
+        }
+    }
+
+    // Runs on the executor queue. Returns the delay before the next step, or
+    // kUntilKicked to wait for kick() alone.
+    virtual std::chrono::microseconds step() = 0;
+
+    // Runs step() as soon as possible, from any thread. Kicks that arrive
+    // before the step runs are folded into one.
+    inline void kick();
+
+private:
+    friend class PortExecutor;
+    PortExecutor *executor = nullptr;
+    std::atomic<bool> kicked{false};
+    dispatch_source_t timer = nullptr; // one-shot, re-armed after every step
+    std::chrono::steady_clock::time_point due = std::chrono::steady_clock::time_point::max(); // executor queue only
+};
+
+// Drives PortMachines on one serial user-interactive dispatch queue. Each
+// machine has a one-shot timer source that every step re-arms (with leeway,
+// see qos.h) or disarms. The timer only holds a weak reference; kicks hold
+// a strong one until they've run.
+class PortExecutor {
+public:
+    ~PortExecutor() {
+        if (queue) dispatch_release(queue);
+    }
+
+    void start() { queue = MakeSerialQueue("auto_dfu.ports", QOS_CLASS_USER_INTERACTIVE); }
+
+    void add(const std::shared_ptr<PortMachine> &m) {
+        m->executor = this;
+        m->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+        dispatch_set_context(m->timer, new std::weak_ptr<PortMachine>(m));
+        dispatch_set_finalizer_f(m->timer, [](void *ctx) { delete static_cast<std::weak_ptr<PortMachine> *>(ctx); });
+        dispatch_source_set_event_handler_f(m->timer, &PortExecutor::timerFired);
+        dispatch_resume(m->timer);
+        kick(*m);
+    }
+
+    void kick(PortMachine &m) {
+        if (m.kicked.exchange(true))
+            return;
+        auto self = m.weak_from_this().lock();
+        if (!self)
+            return; // being destroyed
+        dispatch_async_f(queue, new std::shared_ptr<PortMachine>(std::move(self)), &PortExecutor::kickFired);
+    }
+
+private:
+    static void kickFired(void *ctx) {
+        std::unique_ptr<std::shared_ptr<PortMachine>> m(static_cast<std::shared_ptr<PortMachine> *>(ctx));
+        (*m)->kicked = false; // a kick from inside step() schedules another run
+        run(**m);
+    }
+
+    static void timerFired(void *ctx) {
+        std::shared_ptr<PortMachine> m = static_cast<std::weak_ptr<PortMachine> *>(ctx)->lock();
+        if (!m || m->due == std::chrono::steady_clock::time_point::max())
+            return; // being destroyed, or waiting for a kick
+        auto now = std::chrono::steady_clock::now();
+        if (now < m->due) {
+            // Queued before a kick re-armed the timer, or a hair early.
+            arm(*m, std::chrono::ceil<std::chrono::microseconds>(m->due - now));
+            return;
+        }
+        run(*m);
+    }
+
+    static void run(PortMachine &m) {
+        m.due = std::chrono::steady_clock::time_point::max();
+        std::chrono::microseconds next = m.step();
+        if (next < std::chrono::microseconds(0)) {
+            dispatch_source_set_timer(m.timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+            return;
+        }
+        m.due = std::chrono::steady_clock::now() + next;
+        arm(m, next);
+    }
+
+    static void arm(PortMachine &m, std::chrono::microseconds delay) {
+        dispatch_source_set_timer(m.timer, dispatch_time(DISPATCH_TIME_NOW, delay.count() * NSEC_PER_USEC),
+                                  DISPATCH_TIME_FOREVER, TimerLeeway(delay));
+    }
+
+    dispatch_queue_t queue = nullptr;
+};
+
+inline void PortMachine::kick() {
+    if (executor)
+        executor->kick(*this);
+}
+
+#endif /* executor_h */
@@ -0,0 +1,462 @@
+#ifndef hpm_h
+#define hpm_h
+
+// Talking to one HPM controller: register I/O, the DFU VDM and the DBMa /
+// VDMs sequence. Nothing here depends on IOKit, so the same code drives the
+// real AppleHPMLib plugin and the simulated controllers in bench/.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "log.h"
+#include "metrics.h"
+#include "qos.h"
+#include "timing.h"
+
+struct failure : public std::runtime_error {
+    failure(const char *x) : std::runtime_error(x) {}
+};
+
+// A controller call ran past its deadline; the handle is unusable.
+struct hung_controller : public failure {
+    hung_controller() : failure("controller call timed out") {}
+};
+
+// One HPM register as the controller returns it.
+using HPMRegister = std::array<uint8_t, 64>;
+
+// Which SOP* class a VDM is addressed to; goes in the high nibble of the
+// VDMs header byte.
+enum class VdmTarget : uint8_t {
+    Sop = 3,      // the port partner
+    SopDebug = 5, // SOP'' debug accessory, used by the serial/debug routes
+};
+
+// VDMs argument block: header byte (target << 4) | word count, then the VDM
+// words little-endian. Built at compile time so sending a VDM is a single
+// write of a prebuilt buffer.
+template <size_t N>
+constexpr std::array<uint8_t, 1 + 4 * N> MakeVdm(const uint32_t (&words)[N], VdmTarget target = VdmTarget::Sop) {
+    static_assert(N > 0 && N <= 7, "a VDM carries 1-7 words");
+    std::array<uint8_t, 1 + 4 * N> out{};
+    out[0] = (uint8_t)(((uint8_t)target << 4) | N);
+    for (size_t i = 0; i < N; ++i) {
+        out[1 + 4 * i] = words[i] & 0xFF;
+        out[2 + 4 * i] = (words[i] >> 8) & 0xFF;
+        out[3 + 4 * i] = (words[i] >> 16) & 0xFF;
+        out[4 + 4 * i] = (words[i] >> 24) & 0xFF;
+    }
+    return out;
+}
+
+static constexpr auto kDfuVdm = MakeVdm({0x5ac8012, 0x106, 0x80010000});
+static constexpr auto kRebootVdm = MakeVdm({0x5ac8012, 0x105, 0x80000000});
+static constexpr auto kSerialVdm = MakeVdm({0x5ac8012, 0x1840306}, VdmTarget::SopDebug);
+static constexpr auto kDebugUsbVdm = MakeVdm({0x5ac8012, 0x1840606}, VdmTarget::SopDebug);
+static_assert(kDfuVdm[0] == 0x33 && kDfuVdm[1] == 0x12 && kDfuVdm[12] == 0x80, "DFU VDM encoding");
+static_assert(kSerialVdm[0] == 0x52 && kSerialVdm.size() == 9, "serial VDM encoding");
+
+// A named VDM the DBMa sequence can send. `data` points at one of the
+// prebuilt blocks above.
+struct VdmProfile {
+    const char *name;
+    const char *description;
+    const uint8_t *data;
+    size_t size;
+    bool entersDfu; // the target re-enumerates as a DFU device afterwards
+};
+
+static constexpr VdmProfile kVdmProfiles[] = {
+    {"dfu", "reboot the target into DFU", kDfuVdm.data(), kDfuVdm.size(), true},
+    {"reboot", "plain reboot", kRebootVdm.data(), kRebootVdm.size(), false},
+    {"serial", "route the debug UART to SBU1/2", kSerialVdm.data(), kSerialVdm.size(), false},
+    {"debug-usb", "route the debug USB port to the data pins", kDebugUsbVdm.data(), kDebugUsbVdm.size(), false},
+};
+static_assert(kVdmProfiles[0].entersDfu, "dfu must stay the first (default) profile");
+
+inline const VdmProfile *FindVdmProfile(const std::string &name) {
+    for (auto &p : kVdmProfiles)
+        if (name == p.name)
+            return &p;
+    return nullptr;
+}
+
+// The three AppleHPMLib vtable calls. Return 0 on success, like IOReturn.
+// Implemented by the IOKit plugin in main.cpp and by the simulator in bench/.
+class HPMBackend {
+public:
+    virtual ~HPMBackend() = default;
+    virtual int read(uint64_t chipAddr, uint8_t dataAddr, void *buf, uint64_t maxLen, uint32_t flags,
+                     uint64_t *readLen) = 0;
+    virtual int write(uint64_t chipAddr, uint8_t dataAddr, const void *buf, uint64_t len, uint32_t flags) = 0;
+    virtual int command(uint64_t chipAddr, uint32_t cmd, uint32_t flags) = 0;
+    // Writes out anything buffered. May be called from any thread, even
+    // while a call is stuck.
+    virtual void flush() {}
+};
+
+// Runs every call of an inner backend on a dedicated thread and gives up on
+// it after `timeout`. AppleHPMLib calls can't be cancelled, so a call that
+// overruns is abandoned: the I/O thread (and the plugin it owns) is left to
+// finish or hang on its own, and every later call fails fast with kTimeout.
+// The owner is expected to throw the port away and build a fresh one.
+// Reads and writes go through a buffer owned by the I/O thread so a late
+// completion never touches the caller's stack.
+class DeadlineBackend : public HPMBackend {
+public:
+    static constexpr int kTimeout = (int)0xe00002d6; // kIOReturnTimeout
+
+    DeadlineBackend(std::unique_ptr<HPMBackend> inner, std::chrono::milliseconds timeout)
+        : sh(std::make_shared<Shared>()), timeout(timeout) {
+        sh->inner = std::move(inner);
+        std::shared_ptr<Shared> shared = sh;
+        thread = std::thread([shared] {
+            SetThreadQos(QOS_CLASS_USER_INTERACTIVE);
+            Run(*shared);
+        });
+    }
+
+    ~DeadlineBackend() override {
+        bool stuck;
+        {
+            std::lock_guard<std::mutex> guard(sh->lock);
+            sh->stop = true;
+            stuck = sh->hung;
+        }
+        sh->cv.notify_all();
+        if (stuck)
+            thread.detach(); // keeps `sh` alive for as long as the call takes
+        else
+            thread.join();
+    }
+
+    bool hung() {
+        std::lock_guard<std::mutex> guard(sh->lock);
+        return sh->hung;
+    }
+
+    int read(uint64_t chipAddr, uint8_t dataAddr, void *buf, uint64_t maxLen, uint32_t flags,
+             uint64_t *readLen) override {
+        std::lock_guard<std::mutex> serial(callLock);
+        std::unique_lock<std::mutex> guard(sh->lock);
+        maxLen = std::min<uint64_t>(maxLen, sizeof(sh->buf));
+        int ret = call(guard, Op::Read, chipAddr, dataAddr, maxLen, flags, 0);
+        if (ret != kTimeout) {
+            memcpy(buf, sh->buf, maxLen);
+            *readLen = sh->readLen;
+        }
+        return ret;
+    }
+
+    int write(uint64_t chipAddr, uint8_t dataAddr, const void *buf, uint64_t len, uint32_t flags) override {
+        std::lock_guard<std::mutex> serial(callLock);
+        std::unique_lock<std::mutex> guard(sh->lock);
+        if (sh->hung)
+            return kTimeout;
+        len = std::min<uint64_t>(len, sizeof(sh->buf));
+        memcpy(sh->buf, buf, len);
+        return call(guard, Op::Write, chipAddr, dataAddr, len, flags, 0);
+    }
+
+    int command(uint64_t chipAddr, uint32_t cmd, uint32_t flags) override {
+        std::lock_guard<std::mutex> serial(callLock);
+        std::unique_lock<std::mutex> guard(sh->lock);
+        return call(guard, Op::Command, chipAddr, 0, 0, flags, cmd);
+    }
+
+private:
+    enum class Op { None, Read, Write, Command };
+
+    struct Shared {
+        std::mutex lock;
+        std::condition_variable cv;
+        std::unique_ptr<HPMBackend> inner;
+        Op op = Op::None; // pending request, None when idle
+        uint64_t chipAddr = 0, len = 0, readLen = 0;
+        uint8_t dataAddr = 0;
+        uint32_t flags = 0, cmd = 0;
+        uint8_t buf[256];
+        int result = 0;
+        bool done = false, hung = false, stop = false;
+    };
+
+    // Hands one request to the I/O thread and waits for it, up to the deadline.
+    int call(std::unique_lock<std::mutex> &guard, Op op, uint64_t chipAddr, uint8_t dataAddr, uint64_t len,
+             uint32_t flags, uint32_t cmd) {
+        if (sh->hung)
+            return kTimeout;
+        sh->op = op;
+        sh->chipAddr = chipAddr;
+        sh->dataAddr = dataAddr;
+        sh->len = len;
+        sh->flags = flags;
+        sh->cmd = cmd;
+        sh->done = false;
+        sh->cv.notify_all();
+        if (!sh->cv.wait_for(guard, timeout, [this] { return sh->done; })) {
+            sh->hung = true;
+            sh->inner->flush(); // the I/O thread and everything it owns are abandoned
+            return kTimeout;
+        }
+        return sh->result;
+    }
+
+    static void Run(Shared &sh) {
+        std::unique_lock<std::mutex> guard(sh.lock);
+        while (true) {
+            sh.cv.wait(guard, [&sh] { return sh.stop || sh.op != Op::None; });
+            if (sh.op == Op::None)
+                return; // stop requested and nothing in flight
+            Op op = sh.op;
+            guard.unlock();
+            int ret = 0;
+            switch (op) {
+            case Op::Read: ret = sh.inner->read(sh.chipAddr, sh.dataAddr, sh.buf, sh.len, sh.flags, &sh.readLen); break;
+            case Op::Write: ret = sh.inner->write(sh.chipAddr, sh.dataAddr, sh.buf, sh.len, sh.flags); break;
+            case Op::Command: ret = sh.inner->command(sh.chipAddr, sh.cmd, sh.flags); break;
+            case Op::None: break;
+            }
+            guard.lock();
+            sh.result = ret;
+            sh.op = Op::None;
+            sh.done = true;
+            sh.cv.notify_all();
+        }
+    }
+
+    std::shared_ptr<Shared> sh;
+    std::chrono::milliseconds timeout;
+    std::thread thread;
+    // Held for a whole call. The request lives in `sh` and sh->lock is let go
+    // while the I/O thread works, so without it a second caller (the port's
+    // executor and a scheduler-side register read, say) could overwrite a
+    // request in flight or take its result.
+    std::mutex callLock;
+};
+
+// How much of register 9 a command needs back. Every byte is I2C time.
+enum class CommandReply {
+    None,   // fire-and-forget
+    Status, // the result byte only
+    Full,   // all of register 9, for commands that return data
+};
+
+// Register and command helpers for one controller on top of a backend.
+struct HPMPort {
+    std::unique_ptr<HPMBackend> io;
+    std::string label = "hpm"; // log prefix, set once the port is identified
+
+    explicit HPMPort(std::unique_ptr<HPMBackend> io) : io(std::move(io)) {}
+    virtual ~HPMPort() = default;
+
+    // Reads up to `len` bytes into a caller-provided buffer; returns the
+    // length the controller reported. Nothing here allocates, so the
+    // monitor loops can poll as often as they like.
+    uint64_t readRegister(uint64_t chipAddr, uint8_t dataAddr, uint8_t *buf, uint64_t len, int flags = 0) {
+        uint64_t rlen = 0;
+        int ret = io->read(chipAddr, dataAddr, buf, len, flags, &rlen);
+        check(ret);
+        if (ret != 0)
+            throw failure("readRegister failed");
+        return rlen;
+    }
+
+    void readRegister(uint64_t chipAddr, uint8_t dataAddr, HPMRegister &out, int flags = 0) {
+        out.fill(0);
+        readRegister(chipAddr, dataAddr, out.data(), out.size(), flags);
+    }
+
+    void writeRegister(uint64_t chipAddr, uint8_t dataAddr, const uint8_t *data, size_t len) {
+        int ret = io->write(chipAddr, dataAddr, data, len, 0);
+        check(ret);
+        if (ret != 0)
+            throw failure("writeRegister failed");
+    }
+
+    // Issues `cmd` after writing `args` to register 9 and returns the result
+    // code (low nibble of register 9), or -1 if the command wasn't accepted.
+    // `reply` says how much of register 9 to read back: nothing at all, only
+    // the status byte, or the full register into `out`.
+    int command(uint64_t chipAddr, uint32_t cmd, const uint8_t *args = nullptr, size_t argsLen = 0,
+                CommandReply reply = CommandReply::Status, HPMRegister *out = nullptr) {
+        if (argsLen)
+            check(io->write(chipAddr, 9, args, argsLen, 0));
+        int ret = io->command(chipAddr, cmd, 0);
+        check(ret);
+        if (ret)
+            return -1;
+        if (reply == CommandReply::None)
+            return 0;
+        HPMRegister local;
+        HPMRegister &res = out ? *out : local;
+        res.fill(0);
+        size_t len = reply == CommandReply::Full ? res.size() : 1;
+        readRegister(chipAddr, 9, res.data(), len);
+        if (Logger::shared().enabled(LogLevel::Debug)) {
+            char hex[8 * 3 + 1];
+            for (size_t i = 0; i < 8 && i < len; ++i) snprintf(hex + i * 3, 4, "%02x ", res[i]);
+            LogDebug(label.c_str(), "Command 0x%08x result: %s", cmd, hex);
+        }
+        return res[0] & 0xfu;
+    }
+
+private:
+    // Counts a failed call and turns a missed deadline into hung_controller.
+    static void check(int ret) {
+        if (ret == 0)
+            return;
+        if (ret == DeadlineBackend::kTimeout) {
+            Metrics::shared().hpmTimeouts.fetch_add(1, std::memory_order_relaxed);
+            throw hung_controller();
+        }
+        Metrics::shared().hpmErrors.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+inline long long ElapsedMs(Clock::time_point since) {
+    return std::chrono::duration_cast<milliseconds>(Clock::now() - since).count();
+}
+
+// Status polling schedule: re-read starts at `initial` and doubles up to
+// `max`. The command is re-issued if nothing changed after `reissue`, and
+// the whole thing gives up at `deadline`. Kept in microseconds so that the
+// scenario benchmark can run it many times faster than real time.
+struct PollConfig {
+    microseconds initial{milliseconds(5)};
+    microseconds max{milliseconds(80)};
+    microseconds reissue{milliseconds(300)};
+    microseconds deadline{milliseconds(3000)};
+};
+
+// Issues 'DBMa' and polls register 0x03 until the controller reports the mode
+// or the deadline passes, one controller transaction per step() so a caller
+// that multiplexes ports never has to sleep. step() says how long to wait
+// before the next call.
+class DBMaSequence {
+public:
+    enum Result { Pending, Reached, TimedOut };
+
+    DBMaSequence(HPMPort &inst, const PollConfig &cfg)
+        : inst(inst), cfg(cfg), start(Clock::now()), deadline(start + cfg.deadline) {}
+
+    Result step(Clock::duration &wait) {
+        const char *tag = inst.label.c_str();
+        auto now = Clock::now();
+        if (now >= deadline) {
+            Metrics::shared().dbmaCommands.observe(commands);
+            LogInfo(tag, "⏱  DBMa not reached after %lld ms (%d commands, %d reads)", ElapsedMs(start), commands,
+                    reads);
+            return TimedOut;
+        }
+        if (reissue) {
+            inst.command(0, 'DBMa', nullptr, 0, CommandReply::None); // success shows up in register 0x03
+            ++commands;
+            issued = Clock::now();
+            delay = cfg.initial;
+            reissue = false;
+            wait = std::min<Clock::duration>(delay, deadline - issued);
+            return Pending;
+        }
+        HPMRegister mode;
+        inst.readRegister(0, 3, mode);
+        ++reads;
+        if (memcmp(mode.data(), "DBMa", 4) == 0) {
+            Metrics::shared().dbmaCommands.observe(commands);
+            LogInfo(tag, "⏱  DBMa after %lld ms (%d command%s, %d reads)", ElapsedMs(start), commands,
+                    commands == 1 ? "" : "s", reads);
+            return Reached;
+        }
+        now = Clock::now();
+        if (now - issued >= cfg.reissue) {
+            reissue = true;
+            wait = Clock::duration::zero();
+        } else {
+            delay = std::min(delay * 2, cfg.max);
+            wait = std::min<Clock::duration>(delay, std::max<Clock::duration>(deadline - now, Clock::duration::zero()));
+        }
+        return Pending;
+    }
+
+private:
+    HPMPort &inst;
+    const PollConfig &cfg;
+    Clock::time_point start, deadline, issued;
+    microseconds delay{0};
+    bool reissue = true;
+    int commands = 0, reads = 0;
+};
+
+// Blocking form of DBMaSequence. Returns true once in DBMa.
+inline bool WaitForDBMa(HPMPort &inst, const PollConfig &cfg) {
+    DBMaSequence seq(inst, cfg);
+    Clock::duration wait;
+    DBMaSequence::Result r;
+    while ((r = seq.step(wait)) == DBMaSequence::Pending)
+        std::this_thread::sleep_for(wait);
+    return r == DBMaSequence::Reached;
+}
+
+// Logs what register 0x03 holds after DBMa wasn't reached.
+inline void ReportNoDBMa(HPMPort &inst) {
+    HPMRegister mode;
+    inst.readRegister(0, 3, mode);
+    LogWarn(inst.label.c_str(), "❌ Failed to enter DBMa mode after retries. 0x03 = %02x %02x %02x %02x", mode[0],
+            mode[1], mode[2], mode[3]);
+}
+
+// Sends `vdm` to a controller that is in DBMa. Returns true if accepted.
+inline bool SendVdm(HPMPort &inst, const VdmProfile &vdm) {
+    const char *tag = inst.label.c_str();
+    LogInfo(tag, "📤 Sending %s VDM...", vdm.name);
+    PhaseSpan vdmSpan("vdm", inst.label);
+    int res = inst.command(0, 'VDMs', vdm.data, vdm.size);
+    vdmSpan.finish(res == 0);
+    Metrics::shared().vdmResult(res);
+
+    if (Logger::shared().enabled(LogLevel::Debug)) { // costs an extra I2C read
+        HPMRegister reply;
+        inst.readRegister(0, 0x4d, reply);
+        char hex[8 * 3 + 1];
+        for (int i = 0; i < 8; ++i) snprintf(hex + i * 3, 4, "%02x ", reply[i]);
+        LogDebug(tag, "📩 VDM reply (0x4d): %s", hex);
+    }
+
+    if (res == 0 && vdm.entersDfu)
+        LogInfo(tag, "✅ DFU command sent. Device should re-enumerate.");
+    else if (res == 0)
+        LogInfo(tag, "✅ %s VDM sent.", vdm.name);
+    else
+        LogWarn(tag, "❌ %s VDM failed with result code: %d", vdm.name, res);
+    return res == 0;
+}
+
+// Puts the controller in DBMa and sends `vdm` (DFU unless told otherwise).
+// Returns true if the VDM was accepted.
+inline bool EnterDFUMode(HPMPort &inst, const PollConfig &dbma, const VdmProfile &vdm = kVdmProfiles[0]) {
+    LogInfo(inst.label.c_str(), "🔐 Entering DBMa...");
+    PhaseSpan dbmaSpan("dbma", inst.label);
+    bool inDBMa = WaitForDBMa(inst, dbma);
+    dbmaSpan.finish(inDBMa);
+    if (!inDBMa) {
+        ReportNoDBMa(inst);
+        return false;
+    }
+    LogInfo(inst.label.c_str(), "✅ Entered DBMa mode.");
+    return SendVdm(inst, vdm);
+}
+
+#endif /* hpm_h */
@@ -0,0 +1,218 @@
+#ifndef hpm_trace_h
+#define hpm_trace_h
+
+// Binary trace of every AppleHPMLib call a port makes: start time, how long
+// the controller took, the return code and the first bytes moved. Records
+// are fixed-size and go into a buffer allocated up front, which is written
+// out with a single write() when it fills up and by a once-a-second timer,
+// so tracing costs a clock read, an uncontended lock and a memcpy per call.
+// bench/replay.cpp plays a trace back against the DBMa sequence.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hpm.h"
+#include "log.h"
+#include "qos.h"
+#include "timing.h"
+
+enum class TraceOp : uint8_t { Read = 1, Write = 2, Command = 3 };
+
+struct TraceRecord {
+    uint64_t startNs;    // MonotonicNs() when the call was made
+    uint32_t durationNs; // clamped to ~4.3 s
+    int32_t ret;
+    uint32_t cmd;        // Command only
+    uint8_t op;          // TraceOp
+    uint8_t dataAddr;    // Read/Write register
+    uint8_t len;         // bytes read back or written, clamped to 255
+    uint8_t reserved;
+    uint8_t data[16];    // first bytes of the transfer
+};
+static_assert(sizeof(TraceRecord) == 40, "trace record layout");
+
+// Starts every segment of a trace file. A file gets a new segment each time
+// the port's plugin is rebuilt, e.g. after a quarantine.
+struct TraceHeader {
+    char magic[8];    // "HPMTRACE"
+    uint32_t version;
+    uint32_t recordSize;
+    char label[32];
+};
+static_assert(sizeof(TraceHeader) == 48, "trace header layout");
+
+static constexpr char kTraceMagic[8] = {'H', 'P', 'M', 'T', 'R', 'A', 'C', 'E'};
+static constexpr uint32_t kTraceVersion = 1;
+
+// Records the calls of an inner backend into `path`, appending. Sits under
+// DeadlineBackend, so calls only ever come from the I/O thread and are
+// timed at the controller rather than the queueing in front of it. A call
+// that never returns is not recorded, but everything before it is: the
+// timer flushes a port that went quiet, and DeadlineBackend flushes when it
+// gives up on the thread, whose TraceBackend is then never destroyed.
+class TraceBackend : public HPMBackend {
+public:
+    static constexpr size_t kRecords = 512;
+
+    TraceBackend(std::unique_ptr<HPMBackend> inner, const std::string &path, const std::string &label)
+        : inner(std::move(inner)), sink(std::make_shared<Sink>()) {
+        sink->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (sink->fd < 0) {
+            LogWarn(label.c_str(), "\U0001F4DD Could not open trace %s: %s", path.c_str(), strerror(errno));
+            return;
+        }
+        TraceHeader h = {};
+        memcpy(h.magic, kTraceMagic, sizeof(h.magic));
+        h.version = kTraceVersion;
+        h.recordSize = sizeof(TraceRecord);
+        strncpy(h.label, label.c_str(), sizeof(h.label) - 1);
+        if (::write(sink->fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+            close(sink->fd);
+            sink->fd = -1;
+            return;
+        }
+        // The timer holds the sink, not the backend, so a tick that races
+        // the destructor still has somewhere to write.
+        timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                       dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+        dispatch_set_context(timer, new std::shared_ptr<Sink>(sink));
+        dispatch_set_finalizer_f(timer, [](void *ctx) { delete static_cast<std::shared_ptr<Sink> *>(ctx); });
+        dispatch_source_set_event_handler_f(timer,
+                                            [](void *ctx) { (*static_cast<std::shared_ptr<Sink> *>(ctx))->flush(); });
+        dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC), NSEC_PER_SEC,
+                                  TimerLeeway(std::chrono::milliseconds(1000)));
+        dispatch_resume(timer);
+    }
+
+    ~TraceBackend() override {
+        if (timer) {
+            dispatch_source_cancel(timer);
+            dispatch_release(timer);
+        }
+        sink->flush();
+    }
+
+    int read(uint64_t chipAddr, uint8_t dataAddr, void *buf, uint64_t maxLen, uint32_t flags,
+             uint64_t *readLen) override {
+        uint64_t start = MonotonicNs();
+        int ret = inner->read(chipAddr, dataAddr, buf, maxLen, flags, readLen);
+        append(TraceOp::Read, start, ret, 0, dataAddr, buf, ret == 0 ? *readLen : 0);
+        return ret;
+    }
+
+    int write(uint64_t chipAddr, uint8_t dataAddr, const void *buf, uint64_t len, uint32_t flags) override {
+        uint64_t start = MonotonicNs();
+        int ret = inner->write(chipAddr, dataAddr, buf, len, flags);
+        append(TraceOp::Write, start, ret, 0, dataAddr, buf, len);
+        return ret;
+    }
+
+    int command(uint64_t chipAddr, uint32_t cmd, uint32_t flags) override {
+        uint64_t start = MonotonicNs();
+        int ret = inner->command(chipAddr, cmd, flags);
+        append(TraceOp::Command, start, ret, cmd, 0, nullptr, 0);
+        return ret;
+    }
+
+    void flush() override { sink->flush(); }
+
+private:
+    struct Sink {
+        std::mutex lock; // the I/O thread, the timer and DeadlineBackend
+        std::unique_ptr<TraceRecord[]> ring{new TraceRecord[kRecords]};
+        size_t used = 0;
+        int fd = -1;
+
+        ~Sink() {
+            if (fd >= 0)
+                close(fd);
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> guard(lock);
+            flushLocked();
+        }
+
+        void flushLocked() {
+            if (fd >= 0 && used)
+                (void)!::write(fd, ring.get(), used * sizeof(TraceRecord));
+            used = 0;
+        }
+    };
+
+    void append(TraceOp op, uint64_t start, int ret, uint32_t cmd, uint8_t dataAddr, const void *data,
+                uint64_t len) {
+        if (sink->fd < 0)
+            return;
+        uint64_t now = MonotonicNs();
+        std::lock_guard<std::mutex> guard(sink->lock);
+        TraceRecord &r = sink->ring[sink->used++];
+        r.startNs = start;
+        r.durationNs = (uint32_t)std::min<uint64_t>(now - start, UINT32_MAX);
+        r.ret = ret;
+        r.cmd = cmd;
+        r.op = (uint8_t)op;
+        r.dataAddr = dataAddr;
+        r.len = (uint8_t)std::min<uint64_t>(len, 255);
+        r.reserved = 0;
+        memset(r.data, 0, sizeof(r.data));
+        if (data)
+            memcpy(r.data, data, std::min<uint64_t>(len, sizeof(r.data)));
+        if (sink->used == kRecords)
+            sink->flushLocked();
+    }
+
+    std::unique_ptr<HPMBackend> inner;
+    std::shared_ptr<Sink> sink;
+    dispatch_source_t timer = nullptr;
+};
+
+// One segment of a trace file.
+struct TraceSegment {
+    std::string label;
+    std::vector<TraceRecord> records;
+};
+
+// Reads every segment of a trace file. Returns false if the file can't be
+// read or isn't a trace; a truncated last record is dropped.
+inline bool LoadTrace(const std::string &path, std::vector<TraceSegment> &out) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    bool ok = true;
+    TraceHeader h;
+    while (fread(&h, sizeof(h), 1, f) == 1) {
+        if (memcmp(h.magic, kTraceMagic, sizeof(h.magic)) != 0 || h.version != kTraceVersion ||
+            h.recordSize != sizeof(TraceRecord)) {
+            ok = !out.empty(); // garbage after good segments is a torn write
+            break;
+        }
+        out.emplace_back();
+        out.back().label.assign(h.label, strnlen(h.label, sizeof(h.label)));
+        TraceRecord r;
+        while (true) {
+            long at = ftell(f);
+            if (fread(&r, sizeof(r), 1, f) != 1)
+                break;
+            if (memcmp(&r, kTraceMagic, sizeof(kTraceMagic)) == 0) {
+                fseek(f, at, SEEK_SET); // next segment
+                break;
+            }
+            out.back().records.push_back(r);
+        }
+    }
+    fclose(f);
+    return ok && !out.empty();
+}
+
+#endif /* hpm_trace_h */
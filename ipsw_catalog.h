@@ -0,0 +1,334 @@
+#ifndef ipsw_catalog_h
+#define ipsw_catalog_h
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>
+#include <dirent.h>
+#include <dispatch/dispatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "qos.h"
+#include "zip.h"
+
+struct IpswInfo {
+    std::string path;
+    std::string name;
+    std::string productVersion;
+    std::string buildVersion;
+    std::vector<std::string> productTypes;
+    std::vector<std::pair<uint32_t, uint32_t>> boards; // (ApChipID, ApBoardID)
+    uint64_t size = 0;
+    time_t mtime = 0;
+};
+
+namespace ipswdetail {
+
+inline std::string CFString(CFTypeRef v) {
+    if (!v || CFGetTypeID(v) != CFStringGetTypeID())
+        return "";
+    char buf[256];
+    if (!CFStringGetCString((CFStringRef)v, buf, sizeof(buf), kCFStringEncodingUTF8))
+        return "";
+    return buf;
+}
+
+inline bool CFHex(CFTypeRef v, uint32_t &out) {
+    std::string s = CFString(v);
+    if (s.empty())
+        return false;
+    out = (uint32_t)strtoul(s.c_str(), nullptr, 16);
+    return true;
+}
+
+} // namespace ipswdetail
+
+// Reads BuildManifest.plist straight out of the IPSW's central directory and
+// collects every (chip, board) pair it can restore.
+inline bool ParseIpsw(const std::string &path, IpswInfo &info, std::string &err) {
+    using namespace ipswdetail;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        err = "open failed";
+        return false;
+    }
+    std::vector<ZipEntry> entries;
+    std::string manifest;
+    bool ok = ZipReadDirectory(fd, entries, err);
+    if (ok) {
+        ok = false;
+        for (auto &e : entries) {
+            if (e.name == "BuildManifest.plist") {
+                ok = ZipExtract(fd, e, manifest, err);
+                break;
+            }
+        }
+        if (!ok && err.empty())
+            err = "no BuildManifest.plist";
+    }
+    close(fd);
+    if (!ok)
+        return false;
+
+    CFDataRef data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, (const UInt8 *)manifest.data(),
+                                                 manifest.size(), kCFAllocatorNull);
+    CFPropertyListRef plist = CFPropertyListCreateWithData(kCFAllocatorDefault, data, kCFPropertyListImmutable,
+                                                           nullptr, nullptr);
+    CFRelease(data);
+    if (!plist || CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+        if (plist) CFRelease(plist);
+        err = "BuildManifest.plist is not a dictionary";
+        return false;
+    }
+    CFDictionaryRef dict = (CFDictionaryRef)plist;
+    info.productVersion = CFString(CFDictionaryGetValue(dict, CFSTR("ProductVersion")));
+    info.buildVersion = CFString(CFDictionaryGetValue(dict, CFSTR("ProductBuildVersion")));
+
+    CFArrayRef types = (CFArrayRef)CFDictionaryGetValue(dict, CFSTR("SupportedProductTypes"));
+    if (types && CFGetTypeID(types) == CFArrayGetTypeID())
+        for (CFIndex i = 0; i < CFArrayGetCount(types); ++i)
+            info.productTypes.push_back(CFString(CFArrayGetValueAtIndex(types, i)));
+
+    CFArrayRef ids = (CFArrayRef)CFDictionaryGetValue(dict, CFSTR("BuildIdentities"));
+    if (ids && CFGetTypeID(ids) == CFArrayGetTypeID()) {
+        for (CFIndex i = 0; i < CFArrayGetCount(ids); ++i) {
+            CFDictionaryRef id = (CFDictionaryRef)CFArrayGetValueAtIndex(ids, i);
+            if (!id || CFGetTypeID(id) != CFDictionaryGetTypeID())
+                continue;
+            uint32_t chip, board;
+            if (!CFHex(CFDictionaryGetValue(id, CFSTR("ApChipID")), chip) ||
+                !CFHex(CFDictionaryGetValue(id, CFSTR("ApBoardID")), board))
+                continue;
+            std::pair<uint32_t, uint32_t> key(chip, board);
+            bool seen = false;
+            for (auto &b : info.boards) seen |= b == key;
+            if (!seen)
+                info.boards.push_back(key);
+        }
+    }
+    CFRelease(plist);
+    if (info.boards.empty()) {
+        err = "manifest lists no build identities";
+        return false;
+    }
+    return true;
+}
+
+// Every IPSW in a directory, indexed by the (chip, board) pairs it supports,
+// so a restore can pick firmware for the target in front of it. The
+// directory is scanned once; after that FSEvents triggers a rescan that only
+// re-parses files whose size or mtime changed.
+class IpswCatalog {
+public:
+    explicit IpswCatalog(std::string dir) : dir(std::move(dir)) {}
+
+    ~IpswCatalog() {
+        if (stream) {
+            FSEventStreamStop(stream);
+            FSEventStreamInvalidate(stream);
+            FSEventStreamRelease(stream);
+        }
+        if (queue) dispatch_release(queue);
+    }
+
+    const std::string &directory() const { return dir; }
+
+    // Called after a rescan that changed the set of files.
+    std::function<void()> onChange;
+
+    // Brings the catalog in line with the directory. Returns false if the
+    // directory can't be read.
+    bool refresh() {
+        std::lock_guard<std::mutex> serial(refreshLock);
+        DIR *d = opendir(dir.c_str());
+        if (!d)
+            return false;
+        std::map<std::string, IpswInfo> next;
+        struct dirent *entry;
+        while ((entry = readdir(d)) != nullptr) {
+            std::string name = entry->d_name;
+            if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".ipsw") != 0 || name[0] == '.')
+                continue;
+            std::string path = dir + "/" + name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = files.find(path);
+                if (it != files.end() && it->second.size == (uint64_t)st.st_size &&
+                    it->second.mtime == st.st_mtime) {
+                    next[path] = it->second;
+                    continue;
+                }
+            }
+            IpswInfo info;
+            std::string err;
+            if (!ParseIpsw(path, info, err)) {
+                LogWarn("", "\U0001F4E6 Skipping %s: %s", name.c_str(), err.c_str());
+                continue;
+            }
+            info.path = path;
+            info.name = name;
+            info.size = st.st_size;
+            info.mtime = st.st_mtime;
+            LogInfo("", "\U0001F4E6 %s: %s (%s), %zu board%s", name.c_str(), info.productVersion.c_str(),
+                    info.buildVersion.c_str(), info.boards.size(), info.boards.size() == 1 ? "" : "s");
+            next[path] = std::move(info);
+        }
+        closedir(d);
+
+        // When two files cover the same board the newer file wins.
+        std::map<uint64_t, std::string> idx;
+        for (auto &kv : next) {
+            for (auto &b : kv.second.boards) {
+                uint64_t key = Key(b.first, b.second);
+                auto it = idx.find(key);
+                if (it == idx.end() || next[it->second].mtime < kv.second.mtime)
+                    idx[key] = kv.first;
+            }
+        }
+
+        bool changed;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            changed = next.size() != files.size();
+            for (auto &kv : files) {
+                auto it = next.find(kv.first);
+                if (it == next.end())
+                    LogInfo("", "\U0001F4E6 %s removed from catalog", kv.second.name.c_str());
+                if (it == next.end() || it->second.mtime != kv.second.mtime || it->second.size != kv.second.size)
+                    changed = true;
+            }
+            files = std::move(next);
+            index = std::move(idx);
+        }
+        if (changed && onChange)
+            onChange();
+        return true;
+    }
+
+    // First scan and then watch() on the catalog queue, so startup doesn't
+    // wait for every manifest to be parsed. `done` runs there afterwards
+    // with refresh()'s result; until then ready() is false. If the
+    // directory can't be read yet (a share that isn't mounted, say), the
+    // scan is retried every kRetrySeconds until it can.
+    static constexpr int kRetrySeconds = 10;
+
+    void load(std::function<void(bool ok)> done) {
+        makeQueue();
+        struct Load {
+            IpswCatalog *self;
+            std::function<void(bool)> done;
+        };
+        dispatch_async_f(queue, new Load{this, std::move(done)}, [](void *ctx) {
+            std::unique_ptr<Load> l(static_cast<Load *>(ctx));
+            bool ok = l->self->refresh();
+            l->self->loaded = true;
+            l->self->watch();
+            if (!ok)
+                l->self->retryLater();
+            if (l->done)
+                l->done(ok);
+        });
+    }
+
+    bool ready() const { return loaded; }
+
+    size_t size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return files.size();
+    }
+
+    // IPSW for a target identified by its DFU serial (CPID/BDID).
+    bool lookup(uint32_t chip, uint32_t board, IpswInfo &out) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(Key(chip, board));
+        if (it == index.end())
+            return false;
+        out = files[it->second];
+        return true;
+    }
+
+    // For targets we couldn't identify: only unambiguous if there's one file.
+    bool single(IpswInfo &out) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (files.size() != 1)
+            return false;
+        out = files.begin()->second;
+        return true;
+    }
+
+    std::vector<IpswInfo> all() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<IpswInfo> v;
+        for (auto &kv : files) v.push_back(kv.second);
+        return v;
+    }
+
+    // Rescans on FSEvents for the directory. Events are coalesced over a
+    // couple of seconds so a file that is still being copied isn't parsed
+    // once per write.
+    void watch() {
+        makeQueue();
+        CFStringRef path = CFStringCreateWithCString(kCFAllocatorDefault, dir.c_str(), kCFStringEncodingUTF8);
+        CFArrayRef paths = CFArrayCreate(kCFAllocatorDefault, (const void **)&path, 1, &kCFTypeArrayCallBacks);
+        FSEventStreamContext ctx = {0, this, nullptr, nullptr, nullptr};
+        stream = FSEventStreamCreate(kCFAllocatorDefault, &IpswCatalog::onEvents, &ctx, paths,
+                                     kFSEventStreamEventIdSinceNow, 2.0, kFSEventStreamCreateFlagNone);
+        CFRelease(paths);
+        CFRelease(path);
+        if (!stream)
+            return;
+        FSEventStreamSetDispatchQueue(stream, queue);
+        FSEventStreamStart(stream);
+    }
+
+private:
+    static uint64_t Key(uint32_t chip, uint32_t board) { return ((uint64_t)chip << 32) | board; }
+
+    void makeQueue() {
+        if (!queue)
+            queue = MakeSerialQueue("auto_dfu.ipsw-catalog", QOS_CLASS_UTILITY);
+    }
+
+    // FSEvents says nothing about a share being mounted, so an unreadable
+    // directory is polled. Catalog queue only.
+    void retryLater() {
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, kRetrySeconds * NSEC_PER_SEC), queue, this, [](void *ctx) {
+            auto *self = static_cast<IpswCatalog *>(ctx);
+            if (!self->refresh())
+                return self->retryLater();
+            LogInfo("", "\U0001F4E6 %s is readable now: %zu IPSW%s.", self->dir.c_str(), self->size(),
+                    self->size() == 1 ? "" : "s");
+        });
+    }
+
+    static void onEvents(ConstFSEventStreamRef, void *info, size_t, void *, const FSEventStreamEventFlags *,
+                         const FSEventStreamEventId *) {
+        static_cast<IpswCatalog *>(info)->refresh();
+    }
+
+    std::string dir;
+    std::mutex refreshLock; // one rescan at a time
+    std::mutex lock;        // guards files/index
+    std::map<std::string, IpswInfo> files;
+    std::map<uint64_t, std::string> index;
+    std::atomic<bool> loaded{false};
+    dispatch_queue_t queue = nullptr;
+    FSEventStreamRef stream = nullptr;
+};
+
+#endif /* ipsw_catalog_h */
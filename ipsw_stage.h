@@ -0,0 +1,372 @@
+#ifndef ipsw_stage_h
+#define ipsw_stage_h
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CommonCrypto/CommonDigest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/clonefile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cluster.h"
+#include "ipsw_catalog.h"
+#include "log.h"
+#include "qos.h"
+
+// Keeps a local copy of every catalog IPSW so a restore never streams
+// firmware off the network share. Copies are made on a background thread
+// (clone or hardlink when the stage directory allows it, otherwise a
+// streamed copy), hashed with SHA-256 and recorded in a ".sha256" sidecar so
+// a restart doesn't redo the work. Optionally the staged file is pre-read
+// into the page cache. In a cluster, a file another station has staged is
+// copied from that station rather than the share.
+class IpswStager {
+public:
+    IpswStager(std::string dir, bool warm) : dir(std::move(dir)), warm(warm) {}
+
+    ClusterClient *cluster = nullptr; // set before start()
+
+    ~IpswStager() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) thread.join();
+    }
+
+    void start() {
+        mkdir(dir.c_str(), 0755);
+        thread = std::thread([this] {
+            SetThreadQos(QOS_CLASS_BACKGROUND);
+            loop();
+        });
+    }
+
+    // Queues every IPSW that isn't staged yet.
+    void sync(const std::vector<IpswInfo> &ipsws) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &info : ipsws) {
+            auto it = staged.find(info.path);
+            if (it != staged.end() && it->second.size == info.size && it->second.mtime == info.mtime)
+                continue;
+            staged.erase(info.path);
+            bool queued = false;
+            for (auto &q : pending) queued |= q.path == info.path;
+            if (!queued)
+                pending.push_back(info);
+        }
+        cv.notify_all();
+    }
+
+    // Local copy of `source` if it has been staged and verified, otherwise
+    // the source path itself; a restore never waits on staging.
+    std::string pathFor(const IpswInfo &source) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = staged.find(source.path);
+        if (it == staged.end() || it->second.size != source.size || it->second.mtime != source.mtime)
+            return source.path;
+        return it->second.local;
+    }
+
+    // What this station can serve to its peers.
+    std::vector<ClusterFile> files() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<ClusterFile> out;
+        for (auto &kv : staged) out.push_back({Basename(kv.second.local), kv.second.size, kv.second.sha256});
+        return out;
+    }
+
+    // The staged copy called `name`, "" if there is none.
+    std::string localPath(const std::string &name) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &kv : staged)
+            if (Basename(kv.second.local) == name)
+                return kv.second.local;
+        return "";
+    }
+
+private:
+    struct Staged {
+        std::string local;
+        std::string sha256;
+        uint64_t size = 0;
+        time_t mtime = 0;
+    };
+
+    void loop() {
+        while (true) {
+            IpswInfo info;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cv.wait(guard, [this] { return stopping || !pending.empty(); });
+                if (stopping)
+                    return;
+                info = pending.front();
+                pending.pop_front();
+            }
+            Staged s;
+            if (stage(info, s)) {
+                std::lock_guard<std::mutex> guard(lock);
+                staged[info.path] = s;
+            }
+        }
+    }
+
+    static std::string Basename(const std::string &path) {
+        size_t slash = path.rfind('/');
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    static std::string Hex(const unsigned char *d, size_t n) {
+        std::string out;
+        char buf[3];
+        for (size_t i = 0; i < n; ++i) {
+            snprintf(buf, sizeof(buf), "%02x", d[i]);
+            out += buf;
+        }
+        return out;
+    }
+
+    static bool ReadSidecar(const std::string &path, std::string &hash) {
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f)
+            return false;
+        char buf[65] = {};
+        bool ok = fread(buf, 1, 64, f) == 64;
+        fclose(f);
+        if (ok) hash = buf;
+        return ok;
+    }
+
+    static void WriteSidecar(const std::string &path, const std::string &hash) {
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f) {
+            LogWarn("", "\U0001F4E5 Could not write %s: %s", path.c_str(), strerror(errno));
+            return;
+        }
+        fprintf(f, "%s\n", hash.c_str());
+        fclose(f);
+    }
+
+    static bool HashFile(const std::string &path, std::string &hash) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        fcntl(fd, F_NOCACHE, 1); // don't evict the cache for a verify pass
+        CC_SHA256_CTX ctx;
+        CC_SHA256_Init(&ctx);
+        std::vector<char> buf(8 << 20);
+        ssize_t n;
+        while ((n = read(fd, buf.data(), buf.size())) > 0)
+            CC_SHA256_Update(&ctx, buf.data(), (CC_LONG)n);
+        close(fd);
+        if (n < 0)
+            return false;
+        unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+        CC_SHA256_Final(digest, &ctx);
+        hash = Hex(digest, sizeof(digest));
+        return true;
+    }
+
+    // Streamed copy that hashes what it reads from the source, so the
+    // share is read exactly once. `err` is the errno of the step that
+    // failed.
+    static bool CopyFile(const std::string &from, const std::string &to, std::string &hash, int &err) {
+        int in = open(from.c_str(), O_RDONLY);
+        if (in < 0) {
+            err = errno;
+            return false;
+        }
+        int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            err = errno;
+            close(in);
+            return false;
+        }
+        CC_SHA256_CTX ctx;
+        CC_SHA256_Init(&ctx);
+        std::vector<char> buf(8 << 20);
+        bool ok = true;
+        ssize_t n;
+        while (ok && (n = read(in, buf.data(), buf.size())) > 0) {
+            CC_SHA256_Update(&ctx, buf.data(), (CC_LONG)n);
+            for (ssize_t off = 0; off < n;) {
+                ssize_t w = write(out, buf.data() + off, n - off);
+                if (w <= 0) {
+                    err = w < 0 ? errno : EIO;
+                    ok = false;
+                    break;
+                }
+                off += w;
+            }
+        }
+        if (ok && n < 0)
+            err = errno, ok = false;
+        if (ok && fsync(out) != 0)
+            err = errno, ok = false;
+        close(in);
+        close(out);
+        unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+        CC_SHA256_Final(digest, &ctx);
+        hash = Hex(digest, sizeof(digest));
+        return ok;
+    }
+
+    // Copies `info` from the first station that has it staged and whose
+    // copy hashes to what that station advertised.
+    bool CopyFromPeer(const IpswInfo &info, const std::string &to, std::string &hash) {
+        for (auto &peer : cluster->peers(info.name, info.size)) {
+            int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out < 0)
+                return false;
+            CC_SHA256_CTX ctx;
+            CC_SHA256_Init(&ctx);
+            bool ok = FetchFromPeer(peer.first, cluster->token(), info.name, info.size, [&](const char *data, size_t n) {
+                CC_SHA256_Update(&ctx, data, (CC_LONG)n);
+                for (size_t off = 0; off < n;) {
+                    ssize_t w = write(out, data + off, n - off);
+                    if (w <= 0)
+                        return false;
+                    off += w;
+                }
+                return true;
+            });
+            ok = ok && fsync(out) == 0;
+            close(out);
+            unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+            CC_SHA256_Final(digest, &ctx);
+            hash = Hex(digest, sizeof(digest));
+            if (ok && hash == peer.second) {
+                LogInfo("", "\U0001F4E5 Copied %s from %s", info.name.c_str(), peer.first.c_str());
+                return true;
+            }
+            LogWarn("", "\U0001F4E5 Copy of %s from %s %s", info.name.c_str(), peer.first.c_str(),
+                    ok ? "doesn't match its checksum" : "failed");
+        }
+        hash.clear();
+        return false;
+    }
+
+    // Asks the kernel to read the whole file ahead of the restore.
+    static void Warm(const std::string &path, uint64_t size) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        const uint64_t chunk = 1ull << 30;
+        for (uint64_t off = 0; off < size; off += chunk) {
+            struct radvisory ra;
+            ra.ra_offset = (off_t)off;
+            ra.ra_count = (int)(size - off < chunk ? size - off : chunk);
+            if (fcntl(fd, F_RDADVISE, &ra) != 0) {
+                // Not every filesystem takes F_RDADVISE; fall back to madvise.
+                void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED) {
+                    madvise(p, size, MADV_WILLNEED);
+                    munmap(p, size);
+                }
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    bool stage(const IpswInfo &info, Staged &s) {
+        s.local = dir + "/" + info.name;
+        s.size = info.size;
+        s.mtime = info.mtime;
+        std::string sidecar = s.local + ".sha256";
+
+        struct stat st;
+        bool present = stat(s.local.c_str(), &st) == 0 && (uint64_t)st.st_size == info.size &&
+                       st.st_mtime == info.mtime;
+        if (present && ReadSidecar(sidecar, s.sha256)) {
+            LogInfo("", "\U0001F4E5 %s already staged (sha256 %.12s)", info.name.c_str(), s.sha256.c_str());
+        } else if (present) {
+            // Staged, but the checksum was lost (a crash right after the
+            // rename, say): hash the local copy rather than fetch it again.
+            LogInfo("", "\U0001F4E5 %s already staged; re-hashing it for the missing checksum...", info.name.c_str());
+            if (!HashFile(s.local, s.sha256)) {
+                LogWarn("", "\U0001F4E5 Could not read staged %s: %s", s.local.c_str(), strerror(errno));
+                return false;
+            }
+            WriteSidecar(sidecar, s.sha256);
+            LogInfo("", "\U0001F4E5 Staged %s (sha256 %.12s)", info.name.c_str(), s.sha256.c_str());
+        } else {
+            LogInfo("", "\U0001F4E5 Staging %s to %s...", info.name.c_str(), dir.c_str());
+            std::string tmp = s.local + ".partial";
+            unlink(tmp.c_str());
+            std::string copyHash, why; // why: what each way of copying ran into
+            auto failed = [&why](const char *how, const char *reason) {
+                why += (why.empty() ? "" : "; ") + std::string(how) + ": " + reason;
+            };
+            bool copied = false;
+            int err = 0;
+            if (clonefile(info.path.c_str(), tmp.c_str(), 0) == 0) {
+                copied = true; // same volume: no data moved, the hash pass below covers it
+            } else {
+                failed("clone", strerror(errno));
+                if (link(info.path.c_str(), tmp.c_str()) == 0)
+                    copied = true;
+                else
+                    failed("link", strerror(errno));
+            }
+            if (!copied && cluster) {
+                copied = CopyFromPeer(info, tmp, copyHash);
+                if (!copied)
+                    failed("peers", "no good copy");
+            }
+            if (!copied) {
+                copied = CopyFile(info.path, tmp, copyHash, err);
+                if (!copied)
+                    failed("copy", strerror(err));
+            }
+            if (!copied) {
+                LogWarn("", "\U0001F4E5 Staging %s failed (%s)", info.name.c_str(), why.c_str());
+                unlink(tmp.c_str());
+                return false;
+            }
+            struct timespec times[2] = {{0, UTIME_OMIT}, {info.mtime, 0}};
+            utimensat(AT_FDCWD, tmp.c_str(), times, 0);
+
+            // Re-read the local file and compare against what came off the share.
+            if (!HashFile(tmp, s.sha256) || (!copyHash.empty() && copyHash != s.sha256)) {
+                LogWarn("", "\U0001F4E5 Checksum mismatch staging %s, discarding copy", info.name.c_str());
+                unlink(tmp.c_str());
+                return false;
+            }
+            if (rename(tmp.c_str(), s.local.c_str()) != 0) {
+                LogWarn("", "\U0001F4E5 Staging %s failed: %s", info.name.c_str(), strerror(errno));
+                unlink(tmp.c_str());
+                return false;
+            }
+            WriteSidecar(sidecar, s.sha256);
+            LogInfo("", "\U0001F4E5 Staged %s (sha256 %.12s)", info.name.c_str(), s.sha256.c_str());
+        }
+        if (warm)
+            Warm(s.local, info.size);
+        return true;
+    }
+
+    std::string dir;
+    bool warm;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::deque<IpswInfo> pending;
+    std::map<std::string, Staged> staged; // by source path
+    std::thread thread;
+};
+
+#endif /* ipsw_stage_h */
@@ -0,0 +1,239 @@
+#ifndef log_h
+#define log_h
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <dispatch/dispatch.h>
+#include <sys/time.h>
+
+#include "qos.h"
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+// Asynchronous logger. Port workers format into a fixed-size record and push
+// it onto a bounded lock-free ring (Vyukov's MPMC queue, used here with one
+// consumer); a background thread does the actual writes. Nothing on the
+// producer side takes a lock or touches stdout, and a full ring drops the
+// record rather than waiting. Text goes to stdout (Warn/Error to stderr);
+// with a JSON sink every record is also appended as NDJSON.
+class Logger {
+public:
+    static constexpr size_t kSlots = 1024;  // power of two
+    static constexpr size_t kTagLen = 16;
+    static constexpr size_t kTextLen = 472; // keeps a record at 512 bytes
+
+    static Logger &shared() {
+        static Logger log;
+        return log;
+    }
+
+    void setLevel(LogLevel l) { level = l; }
+    bool enabled(LogLevel l) const { return l >= level; }
+
+    bool openJson(const char *path) {
+        json = fopen(path, "a");
+        return json != nullptr;
+    }
+
+    void start() {
+        if (running.exchange(true))
+            return;
+        wake = dispatch_semaphore_create(0);
+        thread = std::thread([this] {
+            SetThreadQos(QOS_CLASS_UTILITY);
+            loop();
+        });
+        atexit([] { Logger::shared().stop(); });
+    }
+
+    // Drains what's queued and stops the flush thread. Records logged after
+    // this are written synchronously.
+    void stop() {
+        if (!running.exchange(false))
+            return;
+        dispatch_semaphore_signal(wake);
+        if (thread.joinable()) thread.join();
+    }
+
+    void write(LogLevel l, const char *tag, const char *fmt, va_list ap) {
+        if (!enabled(l))
+            return;
+        Record tmp;
+        size_t pos = 0;
+        Record *r = running ? claim(pos) : &tmp;
+        if (!r) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        struct timeval tv;
+        gettimeofday(&tv, nullptr);
+        r->sec = tv.tv_sec;
+        r->usec = tv.tv_usec;
+        r->level = l;
+        strncpy(r->tag, tag ? tag : "", kTagLen - 1);
+        r->tag[kTagLen - 1] = '\0';
+        vsnprintf(r->text, kTextLen, fmt, ap);
+        size_t n = strlen(r->text);
+        if (n && r->text[n - 1] == '\n') // callers may still end lines like printf
+            r->text[n - 1] = '\0';
+        if (r == &tmp) {
+            emit(tmp);
+            return;
+        }
+        r->seq.store(pos + 1); // seq_cst, pairs with the consumer's sleeping/peek()
+        if (sleeping.load())
+            dispatch_semaphore_signal(wake);
+    }
+
+private:
+    struct Record {
+        std::atomic<size_t> seq;
+        int64_t sec;
+        int32_t usec;
+        LogLevel level;
+        char tag[kTagLen];
+        char text[kTextLen];
+    };
+
+    Logger() {
+        for (size_t i = 0; i < kSlots; ++i) ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Reserves the next slot, or returns nullptr when the ring is full.
+    Record *claim(size_t &pos) {
+        pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Record *r = &ring[pos & (kSlots - 1)];
+            size_t seq = r->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return r;
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(Record &out) {
+        Record *r = &ring[tail & (kSlots - 1)];
+        if (r->seq.load(std::memory_order_acquire) != tail + 1)
+            return false;
+        out.sec = r->sec;
+        out.usec = r->usec;
+        out.level = r->level;
+        memcpy(out.tag, r->tag, kTagLen);
+        memcpy(out.text, r->text, kTextLen);
+        r->seq.store(tail + kSlots, std::memory_order_release);
+        ++tail;
+        return true;
+    }
+
+    // Writes everything queued so far. Returns false if there was nothing.
+    bool drain() {
+        Record r;
+        bool any = false;
+        while (pop(r)) {
+            emit(r);
+            any = true;
+        }
+        if (size_t n = dropped.exchange(0, std::memory_order_relaxed)) {
+            Record note = {};
+            struct timeval tv;
+            gettimeofday(&tv, nullptr);
+            note.sec = tv.tv_sec;
+            note.usec = tv.tv_usec;
+            note.level = LogLevel::Warn;
+            snprintf(note.text, kTextLen, "log ring full, dropped %zu message%s", n, n == 1 ? "" : "s");
+            emit(note);
+        }
+        if (any) {
+            fflush(stdout);
+            if (json) fflush(json);
+        }
+        return any;
+    }
+
+    void loop() {
+        while (running) {
+            if (drain())
+                continue;
+            sleeping.store(true);
+            // Re-check after announcing we sleep so a publish isn't missed.
+            if (!peek())
+                dispatch_semaphore_wait(wake, DISPATCH_TIME_FOREVER);
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+        drain();
+    }
+
+    bool peek() { return ring[tail & (kSlots - 1)].seq.load() == tail + 1; }
+
+    static const char *Name(LogLevel l) {
+        switch (l) {
+        case LogLevel::Debug: return "debug";
+        case LogLevel::Info: return "info";
+        case LogLevel::Warn: return "warn";
+        case LogLevel::Error: return "error";
+        }
+        return "?";
+    }
+
+    void emit(const Record &r) {
+        FILE *to = r.level >= LogLevel::Warn ? stderr : stdout;
+        if (r.tag[0])
+            fprintf(to, "[%s] %s\n", r.tag, r.text);
+        else
+            fprintf(to, "%s\n", r.text);
+        if (!json)
+            return;
+        fprintf(json, "{\"ts\":%lld.%06d,\"level\":\"%s\",\"port\":\"%s\",\"msg\":\"", (long long)r.sec, (int)r.usec,
+                Name(r.level), r.tag);
+        for (const char *p = r.text; *p; ++p) {
+            unsigned char c = *p;
+            if (c == '"' || c == '\\')
+                fprintf(json, "\\%c", c);
+            else if (c < 0x20)
+                fprintf(json, "\\u%04x", c);
+            else
+                fputc(c, json);
+        }
+        fputs("\"}\n", json);
+    }
+
+    Record ring[kSlots];
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) size_t tail = 0; // consumer only
+    std::atomic<size_t> dropped{0};
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> running{false};
+    std::atomic<LogLevel> level{LogLevel::Info};
+    dispatch_semaphore_t wake = nullptr;
+    FILE *json = nullptr;
+    std::thread thread;
+};
+
+// `tag` is the port label, or "" for messages that aren't about one port.
+#define LOG_FN(name, lvl)                                                                                  \
+    inline void name(const char *tag, const char *fmt, ...) __attribute__((format(printf, 2, 3)));        \
+    inline void name(const char *tag, const char *fmt, ...) {                                              \
+        va_list ap;                                                                                        \
+        va_start(ap, fmt);                                                                                 \
+        Logger::shared().write(lvl, tag, fmt, ap);                                                         \
+        va_end(ap);                                                                                        \
+    }
+LOG_FN(LogDebug, LogLevel::Debug)
+LOG_FN(LogInfo, LogLevel::Info)
+LOG_FN(LogWarn, LogLevel::Warn)
+LOG_FN(LogError, LogLevel::Error)
+#undef LOG_FN
+
+#endif /* log_h */
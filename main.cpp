@@ -1,8 +1,26 @@
 #include "AppleHPMLib.h"
+#include "cluster.h"
+#include "connection.h"
+#include "control.h"
+#include "dfu_usb.h"
+#include "executor.h"
+#include "hpm.h"
+#include "hpm_trace.h"
+#include "ipsw_catalog.h"
+#include "ipsw_stage.h"
+#include "log.h"
+#include "metrics.h"
+#include "profiles.h"
+#include "progress.h"
+#include "restore.h"
+#include "station.h"
+#include "timing.h"
+#include "topology.h"
+#include "tss_cache.h"
 #include <cstdio>
 #include <iostream>
 #include <string>
-#include <sstream>
+#include <array>
 #include <unistd.h>
 #include <vector>
 #include <memory>
@@ -10,285 +28,568 @@
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/IOMessage.h>
 #include <IOKit/IOKitLib.h>
+#include <dispatch/dispatch.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
-#include <dirent.h>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 
-struct failure : public std::runtime_error {
-    failure(const char *x) : std::runtime_error(x) {}
-};
-
-struct IOObjectDeleter {
-    io_object_t arg;
-    IOObjectDeleter(io_object_t arg) : arg(arg) {}
-    ~IOObjectDeleter() { if (arg) IOObjectRelease(arg); }
-};
-
-inline void put(std::ostream &out, uint32_t val) {
-    out.put(val & 0xFF);
-    out.put((val >> 8) & 0xFF);
-    out.put((val >> 16) & 0xFF);
-    out.put((val >> 24) & 0xFF);
-}
-
-inline void put(std::ostream &out, uint8_t val) {
-    out.put(val);
+void set_nonblocking_terminal(bool enable) {
+    static struct termios oldt;
+    static bool is_set = false;
+    if (enable && !is_set) {
+        struct termios newt;
+        tcgetattr(STDIN_FILENO, &oldt);
+        newt = oldt;
+        newt.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+        fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+        is_set = true;
+    } else if (!enable && is_set) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+        fcntl(STDIN_FILENO, F_SETFL, 0);
+        is_set = false;
+    }
 }
 
-struct HPMPluginInstance {
-    IOCFPlugInInterface **plugin = nullptr;
-    AppleHPMLib **device;
+// Polling mode: a timer on the main queue scans every controller once a
+// second and stdin is only read when it has input, so the process sleeps in
+// between. FindDevices skips ports that already have a worker.
+struct Poller {
+    Scheduler &sched;
+    dispatch_source_t scan = nullptr, input = nullptr;
 
-    HPMPluginInstance(io_service_t service) {
-        SInt32 score;
-        IOReturn ret = IOCreatePlugInInterfaceForService(service, kAppleHPMLibType,
-                                                         kIOCFPlugInInterfaceID, &plugin, &score);
-        if (ret != kIOReturnSuccess)
-            throw failure("IOCreatePlugInInterfaceForService failed");
+    explicit Poller(Scheduler &sched) : sched(sched) {}
 
-        HRESULT res = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kAppleHPMLibInterface),
-                                                (LPVOID *)&device);
-        if (res != S_OK)
-            throw failure("QueryInterface failed");
+    ~Poller() {
+        if (input) {
+            dispatch_source_cancel(input);
+            dispatch_release(input);
+        }
+        if (scan) {
+            dispatch_source_cancel(scan);
+            dispatch_release(scan);
+        }
     }
 
-    ~HPMPluginInstance() {
-        if (plugin) {
-            IODestroyPlugInInterface(plugin);
-        }
+    void schedule(milliseconds first) {
+        dispatch_source_set_timer(scan, dispatch_time(DISPATCH_TIME_NOW, first.count() * NSEC_PER_MSEC),
+                                  NSEC_PER_SEC, TimerLeeway(milliseconds(1000)));
     }
 
-    std::string readRegister(uint64_t chipAddr, uint8_t dataAddr, int flags = 0) {
-        std::string ret(64, '\0');
-        uint64_t rlen = 0;
-        IOReturn x = (*device)->Read(device, chipAddr, dataAddr, &ret[0], 64, flags, &rlen);
-        if (x != 0)
-            throw failure("readRegister failed");
-        return ret;
+    static void onScan(void *ctx) {
+        auto *self = static_cast<Poller *>(ctx);
+        Scheduler &sched = self->sched;
+        try {
+            sched.scan(sched.topology.ports(sched.cfg.rids));
+        } catch (const std::exception &e) {
+            LogError("", "Error: %s", e.what());
+            self->schedule(milliseconds(2000));
+        }
+        sched.showWaiting();
     }
 
-    void writeRegister(uint64_t chipAddr, uint8_t dataAddr, std::string value) {
-        IOReturn x = (*device)->Write(device, chipAddr, dataAddr, &value[0], value.length(), 0);
-        if (x != 0)
-            throw failure("writeRegister failed");
+    static void onStdin(void *ctx) {
+        auto *self = static_cast<Poller *>(ctx);
+        char ch = 0;
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, &ch, 1)) > 0)
+            self->sched.handleKey(ch);
+        if (n == 0)
+            dispatch_source_cancel(self->input); // EOF would keep the source firing
     }
 
-    int command(uint64_t chipAddr, uint32_t cmd, std::string args = "") {
-        if (!args.empty())
-            (*device)->Write(device, chipAddr, 9, args.data(), args.length(), 0);
-        auto ret = (*device)->Command(device, chipAddr, cmd, 0);
-        if (ret)
-            return -1;
-        auto res = this->readRegister(chipAddr, 9);
-        printf("Command 0x%08x result: ", cmd);
-        for (int i = 0; i < 8; ++i) printf("%02x ", res[i]);
-        printf("\n");
-        return res[0] & 0xfu;
+    void run() {
+        scan = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+        dispatch_set_context(scan, this);
+        dispatch_source_set_event_handler_f(scan, &Poller::onScan);
+        schedule(milliseconds(0));
+        dispatch_resume(scan);
+        if (!sched.cfg.daemon) {
+            input = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, STDIN_FILENO, 0, dispatch_get_main_queue());
+            dispatch_set_context(input, this);
+            dispatch_source_set_event_handler_f(input, &Poller::onStdin);
+            dispatch_resume(input);
+        }
+        CFRunLoopRun();
     }
 };
 
-std::unique_ptr<HPMPluginInstance> FindDevice() {
-    CFMutableDictionaryRef matching = IOServiceMatching("AppleHPM");
-    if (!matching)
-        throw failure("IOServiceMatching failed");
-
-    io_iterator_t iter = 0;
-    IOObjectDeleter iterDel(iter);
-    if (IOServiceGetMatchingServices(kIOMainPortDefault, matching, &iter) != kIOReturnSuccess)
-        throw failure("IOServiceGetMatchingServices failed");
+// Notification mode: AppleHPM controllers are picked up through a matching
+// notification and then watched with a general-interest notification. A
+// controller is only probed over I2C when IOKit tells us something changed,
+// so idle ports see no traffic at all.
+struct NotifyWatcher {
+    Scheduler &sched;
+    IONotificationPortRef notifyPort = nullptr;
+    io_iterator_t matchIter = 0;
 
-    io_service_t device;
-    while ((device = IOIteratorNext(iter))) {
-        IOObjectDeleter deviceDel(device);
+    struct Watched {
+        NotifyWatcher *owner = nullptr;
+        HPMNode node; // keeps the service reference
+        io_object_t interest = 0;
+    };
+    std::map<uint64_t, std::unique_ptr<Watched>> watched;
+    std::set<uint64_t> pendingRetries;
 
-        CFNumberRef data;
-        int32_t rid;
-        data = (CFNumberRef)IORegistryEntryCreateCFProperty(device, CFSTR("RID"), kCFAllocatorDefault, 0);
-        if (!data)
-            continue;
-        CFNumberGetValue(data, kCFNumberSInt32Type, &rid);
-        CFRelease(data);
+    explicit NotifyWatcher(Scheduler &sched) : sched(sched) {}
 
-        if (rid != 0)
-            continue;
+    ~NotifyWatcher() {
+        for (auto &kv : watched)
+            if (kv.second->interest) IOObjectRelease(kv.second->interest);
+        if (matchIter) IOObjectRelease(matchIter);
+        if (notifyPort) IONotificationPortDestroy(notifyPort);
+    }
 
-        try {
-            auto inst = std::make_unique<HPMPluginInstance>(device);
-            auto reg = inst->readRegister(0, 0x3f);
-            if (!(reg[0] & 1)) continue; // not connected
+    void probe(const HPMNode &node) {
+        if (!sched.probe(node))
+            retryAfterQuarantine(node.entryID);
+        sched.showWaiting();
+    }
 
-            io_string_t pathName;
-            if (IORegistryEntryGetPath(device, kIOServicePlane, pathName) == kIOReturnSuccess)
-                printf("Apple Thunderbolt Controller: %s\n", pathName);
+    // Nothing else would look at a quarantined port again until IOKit
+    // posts a message, so come back when its back-off runs out. Runs on the
+    // main queue, which CFRunLoopRun services.
+    void retryAfterQuarantine(uint64_t entryID) {
+        milliseconds left = sched.plugins.quarantined(entryID);
+        if (!left.count() || pendingRetries.count(entryID))
+            return;
+        pendingRetries.insert(entryID);
+        struct Retry {
+            NotifyWatcher *self;
+            uint64_t entryID;
+        };
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, (left.count() + 10) * NSEC_PER_MSEC),
+                         dispatch_get_main_queue(), new Retry{this, entryID}, [](void *ctx) {
+                             std::unique_ptr<Retry> r(static_cast<Retry *>(ctx));
+                             r->self->pendingRetries.erase(r->entryID);
+                             auto it = r->self->watched.find(r->entryID);
+                             if (it != r->self->watched.end())
+                                 r->self->probe(it->second->node);
+                         });
+    }
 
-            return inst;
-        } catch (...) {
-            continue;
+    static void onMatched(void *refcon, io_iterator_t iter) {
+        auto *self = static_cast<NotifyWatcher *>(refcon);
+        const std::set<int32_t> &rids = self->sched.cfg.rids;
+        io_service_t service;
+        while ((service = IOIteratorNext(iter))) {
+            auto w = std::make_unique<Watched>();
+            w->owner = self;
+            uint64_t entryID = 0;
+            bool usable = IORegistryEntryGetRegistryEntryID(service, &entryID) == kIOReturnSuccess &&
+                          !self->watched.count(entryID);
+            // The topology has the node already unless this is a brand new
+            // controller; then it's described here.
+            if (usable && !self->sched.topology.find(entryID, w->node))
+                usable = DescribeHPM(service, w->node);
+            if (!usable || (!rids.empty() && !rids.count(w->node.rid))) {
+                IOObjectRelease(service);
+                continue;
+            }
+            if (IOServiceAddInterestNotification(self->notifyPort, service, kIOGeneralInterest,
+                                                 &NotifyWatcher::onInterest, w.get(),
+                                                 &w->interest) != kIOReturnSuccess)
+                w->interest = 0;
+            IOObjectRelease(service);
+            Watched *added = w.get();
+            self->watched[entryID] = std::move(w);
+            // A partner may already be plugged in when the controller shows up.
+            self->probe(added->node);
         }
     }
-    return nullptr;
-}
 
-void EnterDFUMode(HPMPluginInstance &inst) {
-    printf("🔐 Entering DBMa...\n");
-    bool entered = false;
-    for (int attempt = 0; attempt < 10; ++attempt) {
-        inst.command(0, 'DBMa');
-        usleep(300000); // 300ms
-        auto mode = inst.readRegister(0, 3);
-        if (mode.substr(0, 4) == "DBMa") {
-            printf("✅ Entered DBMa mode.\n");
-            entered = true;
-            break;
+    static void onInterest(void *refcon, io_service_t, natural_t messageType, void *) {
+        auto *w = static_cast<Watched *>(refcon);
+        NotifyWatcher *self = w->owner;
+        if (messageType == kIOMessageServiceIsTerminated) {
+            self->sched.plugins.invalidate(w->node.entryID);
+            if (w->interest) IOObjectRelease(w->interest);
+            self->watched.erase(w->node.entryID); // frees w
+            return;
         }
+        // Anything else (plug/unplug, property change) means the connection
+        // state may have changed: look at register 0x3f once.
+        self->probe(w->node);
     }
 
-    if (!entered) {
-        auto mode = inst.readRegister(0, 3);
-        printf("❌ Failed to enter DBMa mode after retries. 0x03 = %02x %02x %02x %02x\n",
-               mode[0], mode[1], mode[2], mode[3]);
-        return;
+    static void onStdin(CFFileDescriptorRef fdref, CFOptionFlags, void *info) {
+        auto *self = static_cast<NotifyWatcher *>(info);
+        char ch = 0;
+        while (read(STDIN_FILENO, &ch, 1) > 0)
+            self->sched.handleKey(ch);
+        CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
     }
 
-    std::vector<uint32_t> dfu{0x5ac8012, 0x106, 0x80010000};
-    std::stringstream args;
-    put(args, (uint8_t)((3 << 4) | dfu.size()));
-    for (auto val : dfu) put(args, val);
+    void run() {
+        notifyPort = IONotificationPortCreate(kIOMainPortDefault);
+        if (!notifyPort)
+            throw failure("IONotificationPortCreate failed");
+        CFRunLoopAddSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(notifyPort),
+                           kCFRunLoopDefaultMode);
 
-    printf("📤 Sending DFU VDM...\n");
-    int res = inst.command(0, 'VDMs', args.str());
+        CFMutableDictionaryRef matching = IOServiceMatching("AppleHPM");
+        if (!matching)
+            throw failure("IOServiceMatching failed");
+        if (IOServiceAddMatchingNotification(notifyPort, kIOFirstMatchNotification, matching,
+                                             &NotifyWatcher::onMatched, this, &matchIter) != kIOReturnSuccess)
+            throw failure("IOServiceAddMatchingNotification failed");
+        onMatched(this, matchIter); // arms the notification and picks up existing controllers
 
-    auto reply = inst.readRegister(0, 0x4d);
-    printf("📩 DFU VDM reply (0x4d): ");
-    for (int i = 0; i < 8; ++i) printf("%02x ", reply[i]);
-    printf("\n");
+        CFFileDescriptorRef fdref = nullptr;
+        if (!sched.cfg.daemon) {
+            CFFileDescriptorContext ctx = {0, this, nullptr, nullptr, nullptr};
+            fdref = CFFileDescriptorCreate(kCFAllocatorDefault, STDIN_FILENO, false, &NotifyWatcher::onStdin, &ctx);
+            CFRunLoopSourceRef fdsrc = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, fdref, 0);
+            CFRunLoopAddSource(CFRunLoopGetCurrent(), fdsrc, kCFRunLoopDefaultMode);
+            CFRelease(fdsrc);
+            CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+        }
 
-    if (res == 0) {
-        printf("✅ DFU command sent. Device should re-enumerate.\n");
-    } else {
-        printf("❌ DFU command failed with result code: %d\n", res);
+        sched.showWaiting();
+        CFRunLoopRun();
+        if (fdref) CFRelease(fdref);
     }
+};
+
+void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  --notify                wait for IOKit notifications instead of polling every second\n"
+                    "  --rids LIST             controller RIDs to use, comma separated, or 'all' (default 0)\n"
+                    "  --vdm NAME              VDM to send after DBMa (default dfu; --list-vdm shows all)\n"
+                    "  --port-vdm PORT=NAME    VDM for one port, e.g. hpm1=serial\n"
+                    "  --auto-restore          restore as soon as the target enumerates in DFU (no 'r' needed)\n"
+                    "  --stage-dir DIR         keep verified local copies of the IPSWs in DIR and restore from there\n"
+                    "  --tss-cache DIR         fetch personalization into DIR as soon as a target is in DFU (idevicerestore)\n"
+                    "  --warm                  pre-read staged IPSWs into the page cache\n"
+                    "  --daemon                no terminal input; take requests on the control socket instead\n"
+                    "  --socket PATH           control socket for --daemon (default /var/run/auto_dfu.sock)\n"
+                    "  --metrics-port N        serve Prometheus metrics on http://*:N/metrics\n"
+                    "  --coordinator PORT      run the cluster job queue on TCP PORT\n"
+                    "  --cluster HOST:PORT     take restore jobs from the coordinator at HOST:PORT\n"
+                    "  --peer-port N           with --cluster and --stage-dir, serve staged IPSWs to other stations\n"
+                    "  --host-name NAME        this station's name in the cluster (default: the host name)\n"
+                    "  --bind ADDR             IPv4 address for --coordinator and --peer-port (default 127.0.0.1)\n"
+                    "  --token-file FILE       cluster token, the first line of FILE; required with a --bind off loopback\n"
+                    "  --hold                  with --daemon, wait for a 'dfu <port>' request before entering DFU\n"
+                    "  --fallback-poll-ms N    re-check register 0x3f every N ms if IOKit posts nothing (default 2000)\n"
+                    "  --disconnect-errors N   consecutive I2C errors treated as an unplug (default 3)\n"
+                    "  --log-json FILE         also append every log line to FILE as NDJSON\n"
+                    "  --verbose               log controller command results and the VDM reply\n"
+                    "  --hpm-timeout-ms N      treat a controller call taking longer than N ms as hung (default 1000)\n"
+                    "  --trace-dir DIR         record every controller call to DIR/<port>.hpmtrace\n"
+                    "  --restore-tool NAME     cfgutil (default) or idevicerestore\n"
+                    "  --batch-window-ms N     restore identified targets of the same IPSW that come in within N ms together\n"
+                    "  --restore-timeout-min N stop a restore after N minutes (default 60, 0 = no limit)\n"
+                    "  --restore-idle-min N    stop a restore that prints nothing for N minutes (default 15, 0 = no limit)\n"
+                    "  --timing-log FILE       append per-phase timings as NDJSON ('t' prints percentiles)\n"
+                    "  --dbma-poll-ms N        first register 0x03 re-read after N ms (default 5)\n"
+                    "  --dbma-poll-max-ms N    cap for the doubling re-read interval (default 80)\n"
+                    "  --dbma-reissue-ms N     resend 'DBMa' if the mode hasn't changed after N ms (default 300)\n"
+                    "  --dbma-deadline-ms N    give up on DBMa after N ms (default 3000)\n"
+                    "  --reenumerate-ms N      only bind a DFU target that shows up within N ms of a VDM (default 30000)\n"
+                    "  --profiles FILE         learn per-model DBMa timing and keep it in FILE\n",
+            argv0);
 }
 
-int run_restore(const std::string &ipsw_path) {
-    printf("\U0001F527 Starting restore with cfgutil...\n");
-    std::string cmd = "cfgutil restore '" + ipsw_path + "'";
-    int ret = system(cmd.c_str());
-    if (ret == 0) {
-        printf("\U00002705 Restore completed successfully.\n");
-    } else {
-        printf("\U0000274C Restore failed with code %d.\n", ret);
+static bool ParseRids(const char *s, std::set<int32_t> &out) {
+    out.clear();
+    if (!strcmp(s, "all"))
+        return true;
+    while (*s) {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 0 || (*end && *end != ','))
+            return false;
+        out.insert((int32_t)v);
+        s = *end ? end + 1 : end;
     }
-    return ret;
+    return !out.empty();
 }
 
-std::string find_single_ipsw(const std::string &folder) {
-    DIR *dir = opendir(folder.c_str());
-    if (!dir) {
-        fprintf(stderr, "Error: Could not open ipsw directory: %s\n", folder.c_str());
-        exit(1);
-    }
-    std::string found;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        std::string name = entry->d_name;
-        if (name.size() > 5 && name.substr(name.size() - 5) == ".ipsw") {
-            if (!found.empty()) {
-                fprintf(stderr, "Error: More than one .ipsw file found in %s.\n", folder.c_str());
-                closedir(dir);
-                exit(1);
-            }
-            found = folder + "/" + name;
+template <class Duration> static bool ParseMs(const char *s, Duration &out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v <= 0)
+        return false;
+    out = milliseconds(v);
+    return true;
+}
+
+// The first line of `path`. It travels as one word of the line protocol,
+// so it can't be empty or contain spaces.
+static bool ReadToken(const char *path, std::string &out) {
+    FILE *f = *path ? fopen(path, "r") : nullptr;
+    if (!f)
+        return false;
+    char line[256] = {};
+    bool ok = fgets(line, sizeof(line), f) != nullptr;
+    fclose(f);
+    out = line;
+    while (!out.empty() && (out.back() == '\n' || out.back() == '\r')) out.pop_back();
+    return ok && !out.empty() && out.find_first_of(" \t") == std::string::npos;
+}
+
+int main(int argc, char **argv) {
+    bool notify = false;
+    std::string stageDir;
+    std::string tssDir;
+    std::string traceDir;
+    std::string profilesPath;
+    bool warm = false;
+    std::string socketPath = "/var/run/auto_dfu.sock";
+    int metricsPort = 0;
+    int coordinatorPort = 0, peerPort = 0;
+    std::string coordinator, hostName;
+    std::string bindAddress = "127.0.0.1", clusterToken;
+    Config cfg;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = true;
+        if (!strcmp(arg, "--notify")) {
+            notify = true;
+        } else if (!strcmp(arg, "--rids")) {
+            ok = ParseRids(val, cfg.rids), ++i;
+        } else if (!strcmp(arg, "--vdm")) {
+            ok = (cfg.vdm = FindVdmProfile(val)) != nullptr, ++i;
+        } else if (!strcmp(arg, "--port-vdm")) {
+            const char *eq = strchr(val, '=');
+            const VdmProfile *vdm = eq ? FindVdmProfile(eq + 1) : nullptr;
+            if (vdm)
+                cfg.portVdm[std::string(val, eq - val)] = vdm;
+            ok = vdm != nullptr, ++i;
+        } else if (!strcmp(arg, "--list-vdm")) {
+            for (auto &p : kVdmProfiles)
+                printf("%-10s %s\n", p.name, p.description);
+            return 0;
+        } else if (!strcmp(arg, "--auto-restore")) {
+            cfg.autoRestore = true;
+        } else if (!strcmp(arg, "--trace-dir")) {
+            traceDir = val, ok = *val, ++i;
+        } else if (!strcmp(arg, "--profiles")) {
+            profilesPath = val, ok = *val, ++i;
+        } else if (!strcmp(arg, "--tss-cache")) {
+            tssDir = val, ok = *val, ++i;
+        } else if (!strcmp(arg, "--stage-dir")) {
+            stageDir = val, ok = *val, ++i;
+        } else if (!strcmp(arg, "--warm")) {
+            warm = true;
+        } else if (!strcmp(arg, "--daemon")) {
+            cfg.daemon = true;
+        } else if (!strcmp(arg, "--socket")) {
+            socketPath = val, ok = *val, ++i;
+        } else if (!strcmp(arg, "--coordinator")) {
+            coordinatorPort = atoi(val), ok = coordinatorPort > 0 && coordinatorPort < 65536, ++i;
+        } else if (!strcmp(arg, "--cluster")) {
+            coordinator = val, ok = strchr(val, ':') != nullptr, ++i;
+        } else if (!strcmp(arg, "--peer-port")) {
+            peerPort = atoi(val), ok = peerPort > 0 && peerPort < 65536, ++i;
+        } else if (!strcmp(arg, "--host-name")) {
+            hostName = val, ok = *val, ++i;
+        } else if (!strcmp(arg, "--bind")) {
+            struct in_addr a;
+            bindAddress = val, ok = inet_pton(AF_INET, val, &a) == 1, ++i;
+        } else if (!strcmp(arg, "--token-file")) {
+            ok = ReadToken(val, clusterToken), ++i;
+        } else if (!strcmp(arg, "--metrics-port")) {
+            metricsPort = atoi(val), ok = metricsPort > 0 && metricsPort < 65536, ++i;
+        } else if (!strcmp(arg, "--hold")) {
+            cfg.holdPorts = true;
+        } else if (!strcmp(arg, "--fallback-poll-ms")) {
+            ok = ParseMs(val, cfg.fallbackPoll), ++i;
+        } else if (!strcmp(arg, "--disconnect-errors")) {
+            cfg.disconnectErrors = atoi(val), ok = cfg.disconnectErrors > 0, ++i;
+        } else if (!strcmp(arg, "--log-json")) {
+            ok = *val && Logger::shared().openJson(val), ++i;
+        } else if (!strcmp(arg, "--verbose")) {
+            Logger::shared().setLevel(LogLevel::Debug);
+        } else if (!strcmp(arg, "--hpm-timeout-ms")) {
+            ok = ParseMs(val, cfg.hpmTimeout), ++i;
+        } else if (!strcmp(arg, "--restore-tool")) {
+            ok = (cfg.restoreTool = FindRestoreBackend(val)) != nullptr, ++i;
+        } else if (!strcmp(arg, "--batch-window-ms")) {
+            ok = ParseMs(val, cfg.batchWindow), ++i;
+        } else if (!strcmp(arg, "--restore-timeout-min")) {
+            cfg.restoreLimits.total = std::chrono::minutes(atoi(val)), ok = *val && atoi(val) >= 0, ++i;
+        } else if (!strcmp(arg, "--restore-idle-min")) {
+            cfg.restoreLimits.idle = std::chrono::minutes(atoi(val)), ok = *val && atoi(val) >= 0, ++i;
+        } else if (!strcmp(arg, "--timing-log")) {
+            ok = *val && TimingLog::shared().open(val), ++i;
+        } else if (!strcmp(arg, "--dbma-poll-ms")) {
+            ok = ParseMs(val, cfg.dbma.initial), ++i;
+        } else if (!strcmp(arg, "--dbma-poll-max-ms")) {
+            ok = ParseMs(val, cfg.dbma.max), ++i;
+        } else if (!strcmp(arg, "--dbma-reissue-ms")) {
+            ok = ParseMs(val, cfg.dbma.reissue), ++i;
+        } else if (!strcmp(arg, "--dbma-deadline-ms")) {
+            ok = ParseMs(val, cfg.dbma.deadline), ++i;
+        } else if (!strcmp(arg, "--reenumerate-ms")) {
+            ok = ParseMs(val, cfg.reenumerateWindow), ++i;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
         }
     }
-    closedir(dir);
-    if (found.empty()) {
-        fprintf(stderr, "Error: No .ipsw file found in %s.\n", folder.c_str());
-        exit(1);
+    bool listensOutside = (coordinatorPort || peerPort) && bindAddress.compare(0, 4, "127.") != 0;
+    if ((cfg.holdPorts && !cfg.daemon) || (peerPort && (coordinator.empty() || stageDir.empty())) ||
+        (listensOutside && clusterToken.empty())) {
+        usage(argv[0]);
+        return 1;
     }
-    return found;
-}
+    Logger::shared().start();
 
-void set_nonblocking_terminal(bool enable) {
-    static struct termios oldt;
-    static bool is_set = false;
-    if (enable && !is_set) {
-        struct termios newt;
-        tcgetattr(STDIN_FILENO, &oldt);
-        newt = oldt;
-        newt.c_lflag &= ~(ICANON | ECHO);
-        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-        fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-        is_set = true;
-    } else if (!enable && is_set) {
-        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-        fcntl(STDIN_FILENO, F_SETFL, 0);
-        is_set = false;
+    LogInfo("", "Auto DFU Running...");
+    if (cfg.batchWindow.count() && !cfg.restoreTool->batches())
+        LogWarn("", "--batch-window-ms ignored: %s restores one target per run.", cfg.restoreTool->name());
+    EventBus coordinatorEvents;
+    ClusterQueue jobs(coordinatorEvents);
+    std::unique_ptr<ControlServer> coordinatorServer;
+    if (coordinatorPort) {
+        coordinatorServer = std::make_unique<ControlServer>(
+            bindAddress, (uint16_t)coordinatorPort, clusterToken,
+            [&jobs](const std::vector<std::string> &args, std::string &reply) { return jobs.handle(args, reply); },
+            coordinatorEvents);
+        if (!coordinatorServer->start()) {
+            LogError("", "Error: Could not listen on port %d: %s", coordinatorPort, strerror(errno));
+            return 1;
+        }
+        LogInfo("", "\U0001F310 Coordinator on %s:%d", bindAddress.c_str(), coordinatorPort);
     }
-}
-
-int main() {
-    printf("Auto DFU Running...\n");
-    bool waitingShown = false;
-    const std::string ipsw_path = find_single_ipsw("ipsw");
-    set_nonblocking_terminal(true);
-    while (true) {
-        try {
-            auto inst = FindDevice();
-            if (!inst) {
-                if (!waitingShown) {
-                    printf("\U0001F50D Waiting for Intel T2/Apple Silicon Mac...\n");
-                    waitingShown = true;
-                }
-                sleep(1);
-                continue;
-            }
-            waitingShown = false;
-            printf("\U0001F50C Device detected. Initiating DFU procedure...\n");
-            EnterDFUMode(*inst);
-            printf("\U0001F501 Monitoring for disconnect or restore trigger... (press 'r' to restore)\n");
-            bool restore_requested = false;
-            while (true) {
-                // Check for device disconnect
-                try {
-                    auto status = inst->readRegister(0, 0x3f);
-                    if (!(status[0] & 1)) break;
-                } catch (...) {
-                    break;
-                }
-                // Check for keypress
-                char ch = 0;
-                ssize_t n = read(STDIN_FILENO, &ch, 1);
-                if (n > 0 && (ch == 'r' || ch == 'R')) {
-                    restore_requested = true;
-                    break;
-                }
-                usleep(500000);
-            }
-            if (restore_requested) {
-                run_restore(ipsw_path);
-                printf("\U0001F501 Waiting for device to disconnect after restore...\n");
-                // Wait for disconnect
-                while (true) {
-                    try {
-                        auto status = inst->readRegister(0, 0x3f);
-                        if (!(status[0] & 1)) break;
-                    } catch (...) {
-                        break;
-                    }
-                    usleep(500000);
-                }
-                printf("\U0000274E Device disconnected after restore.\n");
-                printf("\U0001F501 Resuming device monitoring...\n");
-            } else {
-                printf("\U0000274E Device disconnected.\n");
-            }
-        } catch (const std::exception &e) {
-            fprintf(stderr, "\nError: %s\n", e.what());
-            sleep(2);
+    std::unique_ptr<ClusterClient> cluster;
+    if (!coordinator.empty()) {
+        if (hostName.empty()) {
+            char name[256] = {};
+            gethostname(name, sizeof(name) - 1);
+            hostName = name;
+        }
+        // Peers reach this station where its file server listens.
+        std::string peerHost = bindAddress == "0.0.0.0" ? hostName : bindAddress;
+        cluster = std::make_unique<ClusterClient>(coordinator, clusterToken, hostName,
+                                                  peerPort ? peerHost + ":" + std::to_string(peerPort) : "");
+        cfg.cluster = cluster.get();
+    }
+    IpswCatalog catalog("ipsw");
+    cfg.catalog = &catalog;
+    std::unique_ptr<IpswStager> stager;
+    if (!stageDir.empty()) {
+        stager = std::make_unique<IpswStager>(stageDir, warm);
+        stager->cluster = cluster.get();
+        stager->start();
+        IpswStager *s = stager.get();
+        catalog.onChange = [s, &catalog] { s->sync(catalog.all()); };
+        cfg.stager = s;
+    }
+    // Finding and parsing the firmware happens next to device detection; a
+    // target plugged in at boot is put in DFU right away, and only a
+    // restore waits for the catalog.
+    catalog.load([&catalog](bool ok) {
+        if (!ok)
+            LogError("", "Error: Could not open ipsw directory: %s; retrying every %d s.", catalog.directory().c_str(),
+                     IpswCatalog::kRetrySeconds);
+        else if (catalog.size() == 0)
+            LogWarn("", "\U0001F4E6 No usable .ipsw file in %s yet; restores fail until one is added.",
+                    catalog.directory().c_str());
+    });
+    std::unique_ptr<ModelProfiles> profiles;
+    if (!profilesPath.empty()) {
+        profiles = std::make_unique<ModelProfiles>(profilesPath);
+        if (!profiles->load()) {
+            LogError("", "Error: Could not read model profiles %s: %s", profilesPath.c_str(), strerror(errno));
+            return 1;
+        }
+        cfg.profiles = profiles.get();
+    }
+    std::unique_ptr<TssCache> tss;
+    if (!tssDir.empty()) {
+        tss = std::make_unique<TssCache>(tssDir);
+        if (!tss->open()) {
+            LogError("", "Error: Could not use %s for the TSS cache: %s", tssDir.c_str(), strerror(errno));
+            return 1;
+        }
+        if (!cfg.restoreTool->personalizes())
+            LogWarn("", "--tss-cache ignored: %s signs inside its own restore.", cfg.restoreTool->name());
+        else
+            cfg.tss = tss.get();
+    }
+    if (!traceDir.empty() && mkdir(traceDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LogError("", "Error: Could not create trace directory %s: %s", traceDir.c_str(), strerror(errno));
+        return 1;
+    }
+    if (!cfg.daemon)
+        set_nonblocking_terminal(true);
+    Scheduler sched(cfg);
+    std::unique_ptr<ControlServer> control;
+    if (cfg.daemon) {
+        control = std::make_unique<ControlServer>(
+            socketPath,
+            [&sched](const std::vector<std::string> &args, std::string &reply) { return sched.control(args, reply); },
+            sched.events);
+        if (!control->start()) {
+            LogError("", "Error: Could not listen on %s: %s", socketPath.c_str(), strerror(errno));
+            return 1;
+        }
+        LogInfo("", "\U0001F4E1 Control socket: %s", socketPath.c_str());
+    }
+    std::unique_ptr<MetricsServer> metrics;
+    if (metricsPort) {
+        metrics = std::make_unique<MetricsServer>((uint16_t)metricsPort);
+        if (!metrics->start()) {
+            LogError("", "Error: Could not listen on port %d: %s", metricsPort, strerror(errno));
+            return 1;
+        }
+        LogInfo("", "\U0001F4E1 Metrics: http://*:%d/metrics", metricsPort);
+    }
+    std::unique_ptr<PeerFileServer> peerFiles;
+    if (peerPort) {
+        IpswStager *s = stager.get();
+        peerFiles = std::make_unique<PeerFileServer>(bindAddress, (uint16_t)peerPort, clusterToken,
+                                                     [s](const std::string &name) { return s->localPath(name); });
+        if (!peerFiles->start()) {
+            LogError("", "Error: Could not listen on port %d: %s", peerPort, strerror(errno));
+            return 1;
+        }
+    }
+    if (cluster) {
+        cluster->freePorts = [&sched] { return sched.freePorts(); };
+        if (IpswStager *s = stager.get())
+            cluster->files = [s] { return s->files(); };
+        cluster->start();
+        LogInfo("", "\U0001F310 Joining the cluster at %s as %s", coordinator.c_str(), hostName.c_str());
+    }
+    try {
+        sched.plugins.callTimeout = cfg.hpmTimeout;
+        sched.plugins.traceDir = traceDir;
+        PluginCache *plugins = &sched.plugins;
+        sched.topology.onRemoved = [plugins](uint64_t entryID) { plugins->invalidate(entryID); };
+        sched.topology.start();
+        sched.executor.start();
+        sched.restores.start();
+        sched.interests.start();
+        sched.dfuDevices.start();
+        if (notify) {
+            NotifyWatcher watcher(sched);
+            watcher.run();
+        } else {
+            Poller poller(sched);
+            poller.run();
         }
+    } catch (const std::exception &e) {
+        LogError("", "Error: %s", e.what());
     }
-    set_nonblocking_terminal(false);
+    if (cluster)
+        cluster->stop(); // its heartbeat reads `sched`
+    if (!cfg.daemon)
+        set_nonblocking_terminal(false);
     return 0;
 }
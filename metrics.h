@@ -0,0 +1,236 @@
+#ifndef metrics_h
+#define metrics_h
+
+// Station counters for fleet monitoring, served in the Prometheus text format
+// from GET /metrics. Recording is a relaxed atomic add and never takes a
+// lock; only the exporter thread reads everything back, so a scrape can see
+// a histogram mid-update, which Prometheus tolerates.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "qos.h"
+
+// Fixed-bucket histogram. The sum is kept in millionths so it fits an
+// integer atomic. The default buckets are for durations in seconds, from a
+// single I2C transaction up to a full restore.
+class Histogram {
+public:
+    static constexpr size_t kMaxBuckets = 20;
+
+    Histogram() : Histogram({0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300, 900, 1800, 3600}) {}
+
+    Histogram(std::initializer_list<double> upper) : n(std::min(upper.size(), kMaxBuckets)) {
+        std::copy(upper.begin(), upper.begin() + n, bounds);
+    }
+
+    void observe(double v) {
+        size_t i = 0;
+        while (i < n && v > bounds[i]) ++i;
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sumMicro.fetch_add((uint64_t)(v * 1e6), std::memory_order_relaxed);
+    }
+
+    // Appends the _bucket/_sum/_count series; `labels` is "" or `k="v"`.
+    void render(std::string &out, const char *name, const std::string &labels) const {
+        char line[256];
+        uint64_t total = 0;
+        const char *sep = labels.empty() ? "" : ",";
+        for (size_t i = 0; i <= n; ++i) {
+            total += counts[i].load(std::memory_order_relaxed);
+            if (i < n)
+                snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels.c_str(), sep, bounds[i],
+                         (unsigned long long)total);
+            else
+                snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels.c_str(), sep,
+                         (unsigned long long)total);
+            out += line;
+        }
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        snprintf(line, sizeof(line), "%s_sum%s %.6f\n%s_count%s %llu\n", name, braces.c_str(),
+                 sumMicro.load(std::memory_order_relaxed) / 1e6, name, braces.c_str(), (unsigned long long)total);
+        out += line;
+    }
+
+private:
+    size_t n;
+    double bounds[kMaxBuckets];
+    std::atomic<uint64_t> counts[kMaxBuckets + 1] = {};
+    std::atomic<uint64_t> sumMicro{0};
+};
+
+class Metrics {
+public:
+    static Metrics &shared() {
+        static Metrics m;
+        return m;
+    }
+
+    // The phases TimingLog records; anything else is not exported.
+    static constexpr const char *kPhases[] = {"enumerate", "detect",  "dbma",       "vdm",
+                                              "reenumerate", "restore", "disconnect", "session"};
+    static constexpr size_t kPhaseCount = sizeof(kPhases) / sizeof(kPhases[0]);
+
+    Histogram dbmaCommands{1, 2, 3, 4, 6, 8, 12, 16}; // 'DBMa' commands per attempt
+    std::atomic<uint64_t> hpmErrors{0};               // failed AppleHPMLib calls
+    std::atomic<uint64_t> hpmTimeouts{0};             // calls that ran past the deadline
+    std::atomic<int64_t> activePorts{0};
+
+    // `code` is the VDMs result nibble, or -1 if the command wasn't accepted.
+    void vdmResult(int code) {
+        vdmResults[code >= 0 && code < 16 ? code : 16].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void phase(const char *name, double ms, bool ok) {
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            if (strcmp(name, kPhases[i]) != 0)
+                continue;
+            phases[i].observe(ms / 1000.0);
+            phaseFailures[i].fetch_add(ok ? 0 : 1, std::memory_order_relaxed);
+            if (!strcmp(name, "restore"))
+                (ok ? restoresOk : restoresFailed).fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    std::string render() const {
+        std::string out;
+        char line[160];
+        auto counter = [&](const char *name, const char *help, uint64_t v) {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+                     (unsigned long long)v);
+            out += line;
+        };
+        out += "# HELP auto_dfu_active_ports Ports with a worker running.\n# TYPE auto_dfu_active_ports gauge\n";
+        out += "auto_dfu_active_ports " + std::to_string(activePorts.load(std::memory_order_relaxed)) + "\n";
+        counter("auto_dfu_hpm_errors_total", "AppleHPMLib calls that failed.", hpmErrors.load(std::memory_order_relaxed));
+        counter("auto_dfu_hpm_timeouts_total", "AppleHPMLib calls abandoned at the deadline.",
+                hpmTimeouts.load(std::memory_order_relaxed));
+
+        out += "# HELP auto_dfu_dbma_commands DBMa commands issued per DFU attempt.\n"
+               "# TYPE auto_dfu_dbma_commands histogram\n";
+        dbmaCommands.render(out, "auto_dfu_dbma_commands", "");
+
+        out += "# HELP auto_dfu_vdm_results_total VDMs command results by code.\n"
+               "# TYPE auto_dfu_vdm_results_total counter\n";
+        for (int i = 0; i <= 16; ++i) {
+            uint64_t v = vdmResults[i].load(std::memory_order_relaxed);
+            if (!v)
+                continue;
+            if (i < 16)
+                snprintf(line, sizeof(line), "auto_dfu_vdm_results_total{code=\"%d\"} %llu\n", i, (unsigned long long)v);
+            else
+                snprintf(line, sizeof(line), "auto_dfu_vdm_results_total{code=\"rejected\"} %llu\n",
+                         (unsigned long long)v);
+            out += line;
+        }
+
+        out += "# HELP auto_dfu_restores_total Finished cfgutil restores.\n# TYPE auto_dfu_restores_total counter\n";
+        out += "auto_dfu_restores_total{result=\"success\"} " +
+               std::to_string(restoresOk.load(std::memory_order_relaxed)) + "\n";
+        out += "auto_dfu_restores_total{result=\"failure\"} " +
+               std::to_string(restoresFailed.load(std::memory_order_relaxed)) + "\n";
+
+        out += "# HELP auto_dfu_phase_seconds Time spent per phase.\n# TYPE auto_dfu_phase_seconds histogram\n";
+        for (size_t i = 0; i < kPhaseCount; ++i)
+            phases[i].render(out, "auto_dfu_phase_seconds", std::string("phase=\"") + kPhases[i] + "\"");
+        out += "# HELP auto_dfu_phase_failures_total Phases that ended unsuccessfully.\n"
+               "# TYPE auto_dfu_phase_failures_total counter\n";
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            snprintf(line, sizeof(line), "auto_dfu_phase_failures_total{phase=\"%s\"} %llu\n", kPhases[i],
+                     (unsigned long long)phaseFailures[i].load(std::memory_order_relaxed));
+            out += line;
+        }
+        return out;
+    }
+
+private:
+    Histogram phases[kPhaseCount];
+    std::atomic<uint64_t> phaseFailures[kPhaseCount] = {};
+    std::atomic<uint64_t> vdmResults[17] = {};
+    std::atomic<uint64_t> restoresOk{0};
+    std::atomic<uint64_t> restoresFailed{0};
+};
+
+// Minimal HTTP server for the scrape: one thread, one request per connection.
+class MetricsServer {
+public:
+    explicit MetricsServer(uint16_t port) : port(port) {}
+
+    ~MetricsServer() {
+        if (listenFd >= 0) close(listenFd);
+    }
+
+    bool start() {
+        signal(SIGPIPE, SIG_IGN);
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            return false;
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 8) != 0)
+            return false;
+        std::thread([this] {
+            SetThreadQos(QOS_CLASS_UTILITY);
+            acceptLoop();
+        }).detach();
+        return true;
+    }
+
+private:
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            // A scraper that connects and says nothing mustn't wedge the loop.
+            struct timeval tv = {2, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            serve(fd);
+            close(fd);
+        }
+    }
+
+    static void serve(int fd) {
+        std::string req;
+        char chunk[512];
+        ssize_t n;
+        while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192 &&
+               (n = read(fd, chunk, sizeof(chunk))) > 0)
+            req.append(chunk, n);
+        bool ok = req.compare(0, 12, "GET /metrics") == 0 && req.size() > 12 && (req[12] == ' ' || req[12] == '?');
+        std::string body = ok ? Metrics::shared().render() : "not found\n";
+        std::string head = std::string("HTTP/1.0 ") + (ok ? "200 OK" : "404 Not Found") +
+                           "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        std::string msg = head + body;
+        size_t off = 0;
+        while (off < msg.size() && (n = write(fd, msg.data() + off, msg.size() - off)) > 0) off += n;
+    }
+
+    uint16_t port;
+    int listenFd = -1;
+};
+
+#endif /* metrics_h */
@@ -0,0 +1,282 @@
+#ifndef profiles_h
+#define profiles_h
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dispatch/dispatch.h>
+#include <unistd.h>
+
+#include "hpm.h"
+#include "log.h"
+#include "qos.h"
+#include "timing.h"
+
+// Transition latencies learned per target model, kept across runs in a
+// small text file. A model is "CPID-BDID" as the target reports it in DFU.
+// That is only known after the VDM, so the DBMa schedule for a session is
+// chosen from the model last seen with the same Discover Identity reply
+// (register 0x48), or failing that, last seen on the same port; the
+// session's samples are filed under the model it turned out to be.
+class ModelProfiles {
+public:
+    enum Phase { DBMa, Reenumerate, Disconnect, kPhaseCount };
+
+    static constexpr size_t kSamples = 64;  // most recent kept per model and phase
+    static constexpr size_t kMinSamples = 8; // before the schedule is tuned
+
+    explicit ModelProfiles(std::string path)
+        : path(std::move(path)), queue(MakeSerialQueue("auto_dfu.profiles", QOS_CLASS_UTILITY)) {}
+
+    // Lets a pending saveLater() finish.
+    ~ModelProfiles() {
+        dispatch_sync_f(queue, nullptr, [](void *) {});
+        dispatch_release(queue);
+    }
+
+    // Reads the file if there is one. Returns false only if it exists and
+    // can't be read.
+    bool load() {
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f)
+            return errno == ENOENT;
+        std::lock_guard<std::mutex> guard(lock);
+        char line[4096];
+        while (fgets(line, sizeof(line), f)) {
+            char kind[16], key[128], value[128];
+            int used = 0;
+            if (line[0] == '#' || sscanf(line, "%15s %127s %n", kind, key, &used) != 2)
+                continue;
+            if ((!strcmp(kind, "id") || !strcmp(kind, "port")) && sscanf(line + used, "%127s", value) == 1) {
+                (!strcmp(kind, "id") ? byIdentity : byPort)[key] = value;
+                continue;
+            }
+            int phase = PhaseIndex(kind);
+            if (phase < 0)
+                continue;
+            std::deque<double> &samples = models[key][phase];
+            char *p = line + used, *end;
+            for (double v; (v = strtod(p, &end)), end != p; p = end)
+                push(samples, v);
+        }
+        fclose(f);
+        return true;
+    }
+
+    // The model a session is probably talking to, "" if there's no telling.
+    std::string guess(const std::string &identity, const std::string &port) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = identity.empty() ? byIdentity.end() : byIdentity.find(identity);
+        if (it != byIdentity.end())
+            return it->second;
+        it = byPort.find(port);
+        return it == byPort.end() ? "" : it->second;
+    }
+
+    // Remembers what a session turned out to be.
+    void learn(const std::string &identity, const std::string &port, const std::string &model) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!identity.empty())
+            byIdentity[identity] = model;
+        byPort[port] = model;
+    }
+
+    void record(const std::string &model, Phase phase, double ms) {
+        std::lock_guard<std::mutex> guard(lock);
+        push(models[model][phase], ms);
+    }
+
+    // The DBMa schedule for `model`: first re-read when the quickest tenth
+    // of switches had happened, then re-read at a fraction of the p95 so the switch is
+    // seen soon after it happens, and only resend 'DBMa' or give up well
+    // past what the model normally takes. `base` (the command-line
+    // settings) is used as is until there are enough samples, and its
+    // re-read cap is never exceeded. Its deadline is the floor: a model
+    // that usually switches fast still gets all of --dbma-deadline-ms
+    // before an attempt fails, and only a slow one is given longer.
+    PollConfig tune(const std::string &model, const PollConfig &base) {
+        std::vector<double> v;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = models.find(model);
+            if (model.empty() || it == models.end() || it->second[DBMa].size() < kMinSamples)
+                return base;
+            v.assign(it->second[DBMa].begin(), it->second[DBMa].end());
+        }
+        std::sort(v.begin(), v.end());
+        double p10 = TimingLog::Percentile(v, 10), p95 = TimingLog::Percentile(v, 95);
+        PollConfig out;
+        out.max = std::max<microseconds>(milliseconds(2),
+                                         std::min<microseconds>(base.max, milliseconds((long long)(p95 / 8))));
+        out.initial = std::max(milliseconds(1), milliseconds((long long)p10));
+        out.reissue = std::max(milliseconds(50), milliseconds((long long)(p95 * 1.5)));
+        out.deadline =
+            std::max<microseconds>(base.deadline, std::min<microseconds>(milliseconds(60000), out.reissue * 3));
+        return out;
+    }
+
+    // How long after the VDM a DFU target counts as this session's: four
+    // times the model's p95 re-enumeration, at least 5 s. `base`
+    // (--reenumerate-ms) is the limit, and the answer until there are
+    // enough samples.
+    milliseconds reenumerateWindow(const std::string &model, milliseconds base) {
+        double p95;
+        if (!percentile(model, Reenumerate, 95, p95))
+            return base;
+        return std::min(base, std::max(milliseconds(5000), milliseconds((long long)(p95 * 4))));
+    }
+
+    // How often to re-read register 0x3f while waiting for the unplug after
+    // a restore, when IOKit stays quiet: a quarter of the model's p95, at
+    // least 250 ms apart. `base` (--fallback-poll-ms) is the longest
+    // interval, and the answer until there are enough samples.
+    milliseconds disconnectPoll(const std::string &model, milliseconds base) {
+        double p95;
+        if (!percentile(model, Disconnect, 95, p95))
+            return base;
+        return std::min(base, std::max(milliseconds(250), milliseconds((long long)(p95 / 4))));
+    }
+
+    // Writes everything back, through a temporary file so a crash never
+    // leaves half a file.
+    bool save() {
+        std::string tmp = path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "w");
+        if (!f)
+            return false;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            fprintf(f, "# auto_dfu model profiles: <phase> <model> <ms>... | id <identity> <model> | port <label> <model>\n");
+            for (auto &m : models)
+                for (int i = 0; i < kPhaseCount; ++i) {
+                    if (m.second[i].empty())
+                        continue;
+                    fprintf(f, "%s %s", kPhaseNames[i], m.first.c_str());
+                    for (double v : m.second[i]) fprintf(f, " %.1f", v);
+                    fputc('\n', f);
+                }
+            for (auto &kv : byIdentity) fprintf(f, "id %s %s\n", kv.first.c_str(), kv.second.c_str());
+            for (auto &kv : byPort) fprintf(f, "port %s %s\n", kv.first.c_str(), kv.second.c_str());
+        }
+        bool ok = fclose(f) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+        if (!ok)
+            unlink(tmp.c_str());
+        return ok;
+    }
+
+    // save() on a utility queue, so the port executor never waits on the
+    // disk. Requests made while one is queued are folded into it.
+    void saveLater() {
+        if (savePending.exchange(true))
+            return;
+        dispatch_async_f(queue, this, [](void *ctx) {
+            auto *self = static_cast<ModelProfiles *>(ctx);
+            self->savePending = false; // changes from here on need another save
+            if (!self->save())
+                LogWarn("", "\U0001F9EC Could not save model profiles %s: %s", self->path.c_str(), strerror(errno));
+        });
+    }
+
+    // p50/p95 per model and phase, and the DBMa schedule in use.
+    void printSummary(FILE *to, const PollConfig &base) {
+        std::map<std::string, std::vector<double>> rows[kPhaseCount];
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto &m : models)
+                for (int i = 0; i < kPhaseCount; ++i)
+                    if (!m.second[i].empty())
+                        rows[i][m.first].assign(m.second[i].begin(), m.second[i].end());
+        }
+        if (rows[DBMa].empty() && rows[Reenumerate].empty() && rows[Disconnect].empty())
+            return;
+        fprintf(to, "\U0001F9EC %-12s %-12s %5s %9s %9s\n", "model", "phase", "n", "p50 ms", "p95 ms");
+        for (int i = 0; i < kPhaseCount; ++i)
+            for (auto &kv : rows[i]) {
+                std::vector<double> &v = kv.second;
+                if (v.empty())
+                    continue;
+                std::sort(v.begin(), v.end());
+                fprintf(to, "\U0001F9EC %-12s %-12s %5zu %9.1f %9.1f\n", kv.first.c_str(), kPhaseNames[i], v.size(),
+                        TimingLog::Percentile(v, 50), TimingLog::Percentile(v, 95));
+            }
+        for (auto &kv : rows[DBMa]) {
+            PollConfig c = tune(kv.first, base);
+            fprintf(to, "\U0001F9EC %-12s dbma schedule: first %lld ms, every %lld ms, resend %lld ms, give up %lld ms\n",
+                    kv.first.c_str(), (long long)(c.initial.count() / 1000), (long long)(c.max.count() / 1000),
+                    (long long)(c.reissue.count() / 1000), (long long)(c.deadline.count() / 1000));
+        }
+    }
+
+private:
+    static constexpr const char *kPhaseNames[kPhaseCount] = {"dbma", "reenumerate", "disconnect"};
+
+    static int PhaseIndex(const char *name) {
+        for (int i = 0; i < kPhaseCount; ++i)
+            if (!strcmp(name, kPhaseNames[i]))
+                return i;
+        return -1;
+    }
+
+    // The `p`th percentile of a phase, once it has kMinSamples.
+    bool percentile(const std::string &model, Phase phase, double p, double &out) {
+        std::vector<double> v;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = models.find(model);
+            if (model.empty() || it == models.end() || it->second[phase].size() < kMinSamples)
+                return false;
+            v.assign(it->second[phase].begin(), it->second[phase].end());
+        }
+        std::sort(v.begin(), v.end());
+        out = TimingLog::Percentile(v, p);
+        return true;
+    }
+
+    static void push(std::deque<double> &samples, double v) {
+        if (v < 0)
+            return;
+        samples.push_back(v);
+        if (samples.size() > kSamples)
+            samples.pop_front();
+    }
+
+    std::string path;
+    dispatch_queue_t queue;
+    std::atomic<bool> savePending{false};
+    std::mutex lock; // guards everything below
+    std::map<std::string, std::array<std::deque<double>, kPhaseCount>> models;
+    std::map<std::string, std::string> byIdentity; // Discover Identity hex -> model
+    std::map<std::string, std::string> byPort;     // port label -> model
+};
+
+// The partner's Discover Identity reply as the controller keeps it in
+// register 0x48: a count byte, then the ID header, cert stat and product
+// VDOs, which are the same for every unit of a model. "" if the controller
+// has none.
+inline std::string ReadPartnerIdentity(HPMPort &inst) {
+    HPMRegister reg;
+    try {
+        inst.readRegister(0, 0x48, reg);
+    } catch (const hung_controller &) {
+        throw;
+    } catch (const std::exception &) {
+        return "";
+    }
+    if (std::all_of(reg.begin() + 1, reg.begin() + 13, [](uint8_t b) { return b == 0; }))
+        return "";
+    char hex[13 * 2 + 1];
+    for (int i = 0; i < 13; ++i) snprintf(hex + i * 2, 3, "%02x", reg[i]);
+    return hex;
+}
+
+#endif /* profiles_h */
@@ -0,0 +1,130 @@
+#ifndef progress_h
+#define progress_h
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+// Restore progress read from the restore tool's output, one line at a time.
+// cfgutil prints a phase name with a percentage ("Restoring system: 42%");
+// idevicerestore prints a heading ("Sending filesystem now...") and then a
+// bar ("[=====     ] 42.0%"). Either starts over at 0 for each phase, so
+// rates and the ETA are per phase. Neither prints byte counts; bytes per
+// second is the percentage rate applied to the IPSW's size, which is what a
+// slow cable, host or file server slows down.
+class RestoreProgress {
+public:
+    struct Sample {
+        bool valid = false;    // false until the first percentage shows up
+        std::string phase;
+        double percent = 0;
+        double bytesPerSec = 0; // 0 until two samples in the same phase
+        double etaSec = -1;     // rest of the current phase, -1 if unknown
+    };
+
+    // Starts a new restore of an image of `bytes` (0 if unknown).
+    void begin(uint64_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        total = bytes;
+        cur = Sample();
+        whole = -1;
+        heading.clear();
+    }
+
+    // Feeds one output line taken at `nowNs`. Returns true when the whole
+    // percentage moved or the phase changed, i.e. when it's worth telling
+    // anyone about.
+    bool update(const std::string &line, uint64_t nowNs) {
+        double pct;
+        std::string phase;
+        if (!Parse(line, phase, pct)) {
+            if (line.size() > 3 && line.compare(line.size() - 3, 3, "...") == 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                heading = line.substr(0, line.find_last_not_of(". ") + 1);
+            }
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (phase.empty())
+            phase = heading.empty() ? cur.phase : heading;
+        if (!cur.valid || phase != cur.phase || pct < cur.percent) {
+            cur.phase = phase;
+            cur.bytesPerSec = 0;
+            cur.etaSec = -1;
+            startPct = pct;
+            startNs = nowNs;
+        } else if (pct > startPct && nowNs > startNs) {
+            double secs = (nowNs - startNs) / 1e9;
+            double perSec = (pct - startPct) / secs;
+            cur.bytesPerSec = perSec / 100.0 * total;
+            cur.etaSec = (100.0 - pct) / perSec;
+        }
+        cur.valid = true;
+        cur.percent = pct;
+        bool changed = (int)pct != whole || phase != lastPhase;
+        whole = (int)pct;
+        lastPhase = phase;
+        return changed;
+    }
+
+    // Takes over a sample parsed elsewhere; a batch restore parses once for
+    // all of its ports.
+    void assign(const Sample &s) {
+        std::lock_guard<std::mutex> guard(lock);
+        cur = s;
+    }
+
+    Sample snapshot() {
+        std::lock_guard<std::mutex> guard(lock);
+        return cur;
+    }
+
+    // "percent=42 bps=12500000 eta=120 phase=Restoring system"; empty
+    // before the first percentage.
+    static std::string Format(const Sample &s) {
+        if (!s.valid)
+            return "";
+        char buf[96];
+        snprintf(buf, sizeof(buf), "percent=%.0f bps=%.0f eta=%.0f phase=", s.percent, s.bytesPerSec, s.etaSec);
+        return buf + s.phase;
+    }
+
+    // Finds "<phase> NN%" or "<phase>: NN.N%" in a line.
+    static bool Parse(const std::string &line, std::string &phase, double &pct) {
+        size_t sign = line.rfind('%');
+        if (sign == std::string::npos || sign == 0)
+            return false;
+        size_t start = sign;
+        while (start > 0 && (isdigit((unsigned char)line[start - 1]) || line[start - 1] == '.'))
+            --start;
+        if (start == sign)
+            return false;
+        pct = strtod(line.c_str() + start, nullptr);
+        if (pct < 0 || pct > 100)
+            return false;
+        size_t end = start;
+        while (end > 0 && (isspace((unsigned char)line[end - 1]) || strchr(":-([", line[end - 1])))
+            --end;
+        size_t begin = line.find_first_not_of(" \t");
+        phase = begin < end ? line.substr(begin, end - begin) : "";
+        if (phase.find_first_not_of("[]=#>-. ") == std::string::npos)
+            phase.clear(); // only a progress bar
+        return true;
+    }
+
+private:
+    std::mutex lock; // guards everything below
+    uint64_t total = 0;
+    Sample cur;
+    double startPct = 0;
+    uint64_t startNs = 0;
+    int whole = -1;
+    std::string lastPhase;
+    std::string heading; // last "Doing something..." line
+};
+
+#endif /* progress_h */
@@ -0,0 +1,33 @@
+#ifndef qos_h
+#define qos_h
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#include <dispatch/dispatch.h>
+#include <pthread.h>
+
+// Which work the scheduler should favour. Anything on a port's way to DFU
+// (the executor, the I/O threads, IOKit port/USB notifications) runs at
+// user-interactive so a busy host doesn't stretch DBMa; detection and the
+// operator's commands at user-initiated; bookkeeping (log, metrics,
+// catalog, cluster) at utility; bulk copying and hashing at background,
+// which also throttles its disk I/O.
+//
+// Timers are armed with leeway so the kernel can coalesce the wakeups of a
+// station that is mostly waiting: a tenth of the delay, at most half a
+// second. A 2 ms DBMa poll still fires within 0.2 ms of when it's due.
+
+inline dispatch_queue_t MakeSerialQueue(const char *label, qos_class_t qos) {
+    return dispatch_queue_create(label, dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, qos, 0));
+}
+
+// For std::threads, as their first statement.
+inline void SetThreadQos(qos_class_t qos) { pthread_set_qos_class_self_np(qos, 0); }
+
+inline uint64_t TimerLeeway(std::chrono::nanoseconds delay) {
+    return (uint64_t)std::min<int64_t>(delay.count() / 10, 500 * (int64_t)NSEC_PER_MSEC);
+}
+
+#endif /* qos_h */
@@ -0,0 +1,308 @@
+#ifndef restore_h
+#define restore_h
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/event.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "qos.h"
+
+extern char **environ;
+
+// One restore child. Output lines and the exit status are delivered on the
+// supervisor thread; wait() blocks the caller until the child is gone, or
+// `onExit` says so without anyone blocking.
+struct RestoreJob {
+    pid_t pid = -1;
+    std::string tag;
+    std::function<void(const std::string &)> onLine;
+    std::function<void(int status)> onExit; // same value wait() returns
+
+    // Exit code of the child, or -signal if it was killed.
+    int wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [this] { return finished; });
+        return status;
+    }
+
+    // Like wait(), but returns false if the child is still running after
+    // `timeout`.
+    bool waitFor(std::chrono::milliseconds timeout, int &code) {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!cv.wait_for(guard, timeout, [this] { return finished; }))
+            return false;
+        code = status;
+        return true;
+    }
+
+    bool done() {
+        std::lock_guard<std::mutex> guard(lock);
+        return finished;
+    }
+
+    // How long since the child last wrote anything (or was started).
+    std::chrono::steady_clock::duration idle() {
+        std::lock_guard<std::mutex> guard(lock);
+        return std::chrono::steady_clock::now() - lastOutput;
+    }
+
+    // Asks the child to stop; wait() then reports the signal.
+    void cancel(int sig = SIGTERM) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!finished && pid > 0)
+            kill(pid, sig);
+    }
+
+private:
+    friend class RestoreSupervisor;
+    int outFd = -1;
+    std::string partial;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool finished = false;
+    int status = -1;
+    std::chrono::steady_clock::time_point lastOutput = std::chrono::steady_clock::now();
+};
+
+// Runs restore tools as child processes and tracks them all from one kqueue
+// thread: EVFILT_PROC for exit and EVFILT_READ for the merged stdout/stderr
+// pipe. Any number of restores can be in flight, each tagged with its port.
+class RestoreSupervisor {
+public:
+    ~RestoreSupervisor() {
+        if (kq >= 0) {
+            struct kevent ev;
+            EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_ONESHOT, NOTE_TRIGGER, 0, nullptr);
+            kevent(kq, &ev, 1, nullptr, 0, nullptr);
+            if (thread.joinable()) thread.join();
+            close(kq);
+        }
+    }
+
+    void start() {
+        kq = kqueue();
+        if (kq < 0)
+            throw std::runtime_error("kqueue failed");
+        thread = std::thread([this] {
+            SetThreadQos(QOS_CLASS_USER_INITIATED);
+            loop();
+        });
+    }
+
+    // Spawns argv[0] (looked up in PATH) with stdin on /dev/null. Returns
+    // nullptr if the spawn itself failed.
+    std::shared_ptr<RestoreJob> spawn(const std::vector<std::string> &args, const std::string &tag,
+                                      std::function<void(const std::string &)> onLine,
+                                      std::function<void(int status)> onExit = nullptr) {
+        int fds[2];
+        if (pipe(fds) != 0)
+            return nullptr;
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+        posix_spawn_file_actions_addclose(&actions, fds[0]);
+        posix_spawn_file_actions_addclose(&actions, fds[1]);
+
+        std::vector<char *> argv;
+        for (auto &a : args) argv.push_back(const_cast<char *>(a.c_str()));
+        argv.push_back(nullptr);
+
+        auto job = std::make_shared<RestoreJob>();
+        job->tag = tag;
+        job->onLine = std::move(onLine);
+        job->onExit = std::move(onExit);
+        job->outFd = fds[0];
+
+        std::lock_guard<std::mutex> guard(lock);
+        int err = posix_spawnp(&job->pid, argv[0], &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (err != 0) {
+            close(fds[0]);
+            errno = err;
+            return nullptr;
+        }
+        jobs[job->pid] = job;
+
+        struct kevent ev[2];
+        EV_SET(&ev[0], job->outFd, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)job->pid);
+        EV_SET(&ev[1], job->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, nullptr);
+        if (kevent(kq, ev, 2, nullptr, 0, nullptr) != 0 && errno == ESRCH) {
+            // Already gone before we could watch it; reap it here.
+            finish(job);
+        }
+        return job;
+    }
+
+private:
+    void loop() {
+        struct kevent events[16];
+        while (true) {
+            int n = kevent(kq, nullptr, 0, events, 16, nullptr);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            for (int i = 0; i < n; ++i) {
+                auto &ev = events[i];
+                if (ev.filter == EVFILT_USER)
+                    return;
+                pid_t pid = ev.filter == EVFILT_PROC ? (pid_t)ev.ident : (pid_t)(intptr_t)ev.udata;
+                auto it = jobs.find(pid);
+                if (it == jobs.end())
+                    continue;
+                if (ev.filter == EVFILT_READ) {
+                    drain(*it->second);
+                    if (ev.flags & EV_EOF) {
+                        // Writer closed; stop the level-triggered EOF from spinning until NOTE_EXIT.
+                        struct kevent del;
+                        EV_SET(&del, ev.ident, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+                        kevent(kq, &del, 1, nullptr, 0, nullptr);
+                    }
+                } else
+                    finish(it->second);
+            }
+        }
+    }
+
+    // Reads whatever the child has written and hands out complete lines.
+    void drain(RestoreJob &job) {
+        char buf[4096];
+        ssize_t n;
+        while (job.outFd >= 0 && (n = read(job.outFd, buf, sizeof(buf))) > 0) {
+            {
+                std::lock_guard<std::mutex> guard(job.lock);
+                job.lastOutput = std::chrono::steady_clock::now();
+            }
+            job.partial.append(buf, n);
+            size_t pos;
+            // cfgutil redraws progress with '\r', treat it like a line break
+            while ((pos = job.partial.find_first_of("\r\n")) != std::string::npos) {
+                std::string line = job.partial.substr(0, pos);
+                job.partial.erase(0, pos + 1);
+                if (!line.empty() && job.onLine)
+                    job.onLine(line);
+            }
+        }
+    }
+
+    void finish(std::shared_ptr<RestoreJob> job) {
+        drain(*job);
+        if (!job->partial.empty() && job->onLine)
+            job->onLine(job->partial);
+        job->partial.clear();
+        close(job->outFd); // also removes the EVFILT_READ registration
+        job->outFd = -1;
+
+        int wstatus = 0;
+        int code = -1;
+        if (waitpid(job->pid, &wstatus, 0) == job->pid)
+            code = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -WTERMSIG(wstatus);
+        jobs.erase(job->pid);
+        {
+            std::lock_guard<std::mutex> guard(job->lock);
+            job->status = code;
+            job->finished = true;
+        }
+        job->cv.notify_all();
+        if (job->onExit)
+            job->onExit(code);
+    }
+
+    int kq = -1;
+    std::thread thread;
+    std::mutex lock;
+    std::map<pid_t, std::shared_ptr<RestoreJob>> jobs;
+};
+
+// The tool that performs a restore: how to invoke it for an IPSW and a set
+// of target ECIDs (empty if the target wasn't identified).
+class RestoreBackend {
+public:
+    virtual ~RestoreBackend() = default;
+    virtual const char *name() const = 0;
+    // Whether one run can restore several targets.
+    virtual bool batches() const = 0;
+    // `cacheDir` holds prefetched personalization, or is empty.
+    virtual std::vector<std::string> command(const std::string &ipsw, const std::vector<std::string> &ecids,
+                                             const std::string &cacheDir) const = 0;
+    // Whether personalizeCommand() works: the tool can fetch and save the
+    // personalization for one target without restoring it.
+    virtual bool personalizes() const { return false; }
+    virtual std::vector<std::string> personalizeCommand(const std::string &, const std::string &,
+                                                        const std::string &) const {
+        return {};
+    }
+};
+
+// Apple Configurator's command line tool.
+class CfgutilBackend : public RestoreBackend {
+public:
+    const char *name() const override { return "cfgutil"; }
+    bool batches() const override { return true; }
+    std::vector<std::string> command(const std::string &ipsw, const std::vector<std::string> &ecids,
+                                     const std::string &) const override {
+        std::vector<std::string> args{"cfgutil"};
+        for (auto &e : ecids) args.insert(args.end(), {"--ecid", e});
+        args.insert(args.end(), {"restore", ipsw});
+        return args;
+    }
+};
+
+// libimobiledevice's idevicerestore. It reads the components straight out
+// of the IPSW zip, talks to the target itself rather than through the
+// Configurator stack, and prints its own progress. One target per run.
+class IdevicerestoreBackend : public RestoreBackend {
+public:
+    const char *name() const override { return "idevicerestore"; }
+    bool batches() const override { return false; }
+    std::vector<std::string> command(const std::string &ipsw, const std::vector<std::string> &ecids,
+                                     const std::string &cacheDir) const override {
+        std::vector<std::string> args{"idevicerestore", "--erase", "--no-input"};
+        if (!ecids.empty())
+            args.insert(args.end(), {"--ecid", ecids[0]});
+        if (!cacheDir.empty())
+            args.insert(args.end(), {"--cache-path", cacheDir});
+        args.push_back(ipsw);
+        return args;
+    }
+
+    bool personalizes() const override { return true; }
+
+    // --shsh only fetches the TSS response into <cache>/shsh and exits.
+    std::vector<std::string> personalizeCommand(const std::string &ipsw, const std::string &ecid,
+                                                const std::string &cacheDir) const override {
+        return {"idevicerestore", "--shsh", "--no-input", "--ecid", ecid, "--cache-path", cacheDir, ipsw};
+    }
+};
+
+inline const RestoreBackend *FindRestoreBackend(const std::string &name) {
+    static const CfgutilBackend cfgutil;
+    static const IdevicerestoreBackend idevicerestore;
+    if (name == cfgutil.name()) return &cfgutil;
+    if (name == idevicerestore.name()) return &idevicerestore;
+    return nullptr;
+}
+
+#endif /* restore_h */
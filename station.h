@@ -0,0 +1,1441 @@
+#ifndef station_h
+#define station_h
+
+// The station itself: plugin handles for the controllers, the port
+// workers, restore runs and batches, and the Scheduler that owns them.
+// main.cpp wires it to IOKit (the topology, interest and DFU watchers) and
+// runs the polling or notification loop around it; bench/scenario.cpp runs
+// the same Scheduler against simulated controllers and a stand-in restore
+// tool.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <IOKit/IOCFPlugIn.h>
+#include <IOKit/IOKitLib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "AppleHPMLib.h"
+#include "cluster.h"
+#include "connection.h"
+#include "control.h"
+#include "dfu_usb.h"
+#include "executor.h"
+#include "hpm.h"
+#include "hpm_trace.h"
+#include "ipsw_catalog.h"
+#include "ipsw_stage.h"
+#include "log.h"
+#include "metrics.h"
+#include "profiles.h"
+#include "progress.h"
+#include "restore.h"
+#include "timing.h"
+#include "topology.h"
+#include "tss_cache.h"
+
+struct IOObjectDeleter {
+    io_object_t arg;
+    IOObjectDeleter(io_object_t arg) : arg(arg) {}
+    ~IOObjectDeleter() { if (arg) IOObjectRelease(arg); }
+};
+
+// AppleHPMLib plugin for one controller service.
+class AppleHPMBackend : public HPMBackend {
+public:
+    explicit AppleHPMBackend(io_service_t service) {
+        SInt32 score;
+        IOReturn ret = IOCreatePlugInInterfaceForService(service, kAppleHPMLibType,
+                                                         kIOCFPlugInInterfaceID, &plugin, &score);
+        if (ret != kIOReturnSuccess)
+            throw failure("IOCreatePlugInInterfaceForService failed");
+
+        HRESULT res = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kAppleHPMLibInterface),
+                                                (LPVOID *)&device);
+        if (res != S_OK) {
+            IODestroyPlugInInterface(plugin);
+            throw failure("QueryInterface failed");
+        }
+    }
+
+    ~AppleHPMBackend() override { IODestroyPlugInInterface(plugin); }
+
+    int read(uint64_t chipAddr, uint8_t dataAddr, void *buf, uint64_t maxLen, uint32_t flags,
+             uint64_t *readLen) override {
+        return (*device)->Read(device, chipAddr, dataAddr, buf, maxLen, flags, readLen);
+    }
+
+    int write(uint64_t chipAddr, uint8_t dataAddr, const void *buf, uint64_t len, uint32_t flags) override {
+        return (*device)->Write(device, chipAddr, dataAddr, buf, len, flags);
+    }
+
+    int command(uint64_t chipAddr, uint32_t cmd, uint32_t flags) override {
+        return (*device)->Command(device, chipAddr, cmd, flags);
+    }
+
+private:
+    IOCFPlugInInterface **plugin = nullptr;
+    AppleHPMLib **device = nullptr;
+};
+
+struct HPMPluginInstance : HPMPort {
+    io_service_t service = 0; // retained for interest notifications; 0 for a simulated controller
+
+    // Talks to the controller through `io`; records every call into
+    // `traceFile` unless it is empty.
+    HPMPluginInstance(std::unique_ptr<HPMBackend> io, io_service_t service, milliseconds callTimeout,
+                      const std::string &traceFile, const std::string &label)
+        : HPMPort(std::make_unique<DeadlineBackend>(Traced(std::move(io), traceFile, label), callTimeout)) {
+        if (service)
+            IOObjectRetain(service);
+        this->service = service;
+        this->label = label;
+    }
+
+    ~HPMPluginInstance() {
+        if (service)
+            IOObjectRelease(service);
+    }
+
+private:
+    static std::unique_ptr<HPMBackend> Traced(std::unique_ptr<HPMBackend> io, const std::string &traceFile,
+                                              const std::string &label) {
+        if (!traceFile.empty())
+            io = std::make_unique<TraceBackend>(std::move(io), traceFile, label);
+        return io;
+    }
+};
+
+struct DetectedPort {
+    uint64_t entryID = 0;
+    std::string label;
+    std::shared_ptr<HPMPluginInstance> inst;
+};
+
+// Plugin instances for the controllers we probe, keyed by registry entry ID,
+// so that probing a port we've already seen costs one I2C read instead of a
+// full plugin setup. Entries are dropped when the topology reports the
+// service terminated; workers that still hold a handle keep it alive until
+// they notice the failure.
+class PluginCache {
+public:
+    milliseconds callTimeout{1000}; // deadline for every AppleHPMLib call
+    std::string traceDir;            // per-port HPM call traces, off if empty
+
+    // Opens the controller behind a node. AppleHPMLib unless replaced; the
+    // scenario benchmark puts its simulated controllers here.
+    std::function<std::unique_ptr<HPMBackend>(const HPMNode &)> open = [](const HPMNode &node) {
+        return std::unique_ptr<HPMBackend>(new AppleHPMBackend(node.service.get()));
+    };
+
+    std::shared_ptr<HPMPluginInstance> find(uint64_t entryID) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(entryID);
+        return it == entries.end() ? nullptr : it->second;
+    }
+
+    // Builds the plugin for `node` and remembers it. Throws if the
+    // controller can't be opened.
+    std::shared_ptr<HPMPluginInstance> create(const HPMNode &node) {
+        std::string trace = traceDir.empty() ? "" : traceDir + "/" + node.label + ".hpmtrace";
+        auto inst = std::make_shared<HPMPluginInstance>(open(node), node.service.get(), callTimeout, trace,
+                                                        node.label);
+        std::lock_guard<std::mutex> guard(lock);
+        entries[node.entryID] = inst;
+        return inst;
+    }
+
+    void invalidate(uint64_t entryID) {
+        std::lock_guard<std::mutex> guard(lock);
+        entries.erase(entryID);
+    }
+
+    // A controller call hung: drop the handle so the next probe builds a new
+    // plugin, and keep the port out of scans for a back-off that doubles with
+    // each consecutive hang (5 s up to 5 min).
+    void quarantine(uint64_t entryID, const std::string &label) {
+        std::lock_guard<std::mutex> guard(lock);
+        entries.erase(entryID);
+        Backoff &b = backoff[entryID];
+        milliseconds wait = std::min(milliseconds(5000 << std::min(b.faults, 6)), milliseconds(300000));
+        ++b.faults;
+        b.until = Clock::now() + wait;
+        LogWarn(label.c_str(), "\U0001F6A7 Controller not responding; quarantined for %lld s (%d in a row)",
+                (long long)(wait.count() / 1000), b.faults);
+    }
+
+    // Time left in quarantine, zero if the port may be probed.
+    milliseconds quarantined(uint64_t entryID) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = backoff.find(entryID);
+        if (it == backoff.end())
+            return milliseconds(0);
+        auto left = std::chrono::duration_cast<milliseconds>(it->second.until - Clock::now());
+        return std::max(left, milliseconds(0));
+    }
+
+    // A session went through; forget earlier hangs.
+    void healthy(uint64_t entryID) {
+        std::lock_guard<std::mutex> guard(lock);
+        backoff.erase(entryID);
+    }
+
+private:
+    struct Backoff {
+        int faults = 0;
+        Clock::time_point until;
+    };
+
+    std::mutex lock;
+    std::map<uint64_t, std::shared_ptr<HPMPluginInstance>> entries;
+    std::map<uint64_t, Backoff> backoff;
+};
+
+// Checks one controller for a connected partner. On success fills `port`
+// with a ready-to-use plugin instance.
+inline bool ProbeService(PluginCache &cache, const HPMNode &node, DetectedPort &port) {
+    if (cache.quarantined(node.entryID).count())
+        return false;
+    try {
+        PhaseSpan span("detect", node.label);
+        auto inst = cache.find(node.entryID);
+        bool fresh = !inst;
+        if (fresh)
+            inst = cache.create(node);
+        HPMRegister reg;
+        inst->readRegister(0, 0x3f, reg);
+        if (!(reg[0] & 1)) {
+            span.discard();
+            return false; // not connected
+        }
+        span.finish(true);
+
+        port.entryID = node.entryID;
+        port.label = node.label;
+        port.inst = inst;
+        if (!node.path.empty())
+            LogInfo(port.label.c_str(), "Apple Thunderbolt Controller: %s (RID %d)", node.path.c_str(), node.rid);
+        return true;
+    } catch (const hung_controller &) {
+        cache.quarantine(node.entryID, node.label);
+        return false;
+    } catch (...) {
+        // A handle that stopped answering is not worth keeping around.
+        cache.invalidate(node.entryID);
+        return false;
+    }
+}
+
+// Returns every connected controller among `nodes` that is not already
+// being handled by a worker (listed in `busy`). The candidates come from the
+// topology map; only the 0x3f reads touch the hardware.
+inline std::vector<DetectedPort> FindDevices(const std::vector<HPMNode> &nodes, PluginCache &cache,
+                                             const std::set<uint64_t> &busy) {
+    PhaseSpan span("enumerate", "");
+    std::vector<DetectedPort> found;
+    for (auto &node : nodes) {
+        if (busy.count(node.entryID))
+            continue;
+        DetectedPort port;
+        if (ProbeService(cache, node, port))
+            found.push_back(std::move(port));
+    }
+    // Idle scans aren't interesting; only keep the ones that led to a session.
+    if (found.empty())
+        span.discard();
+    else
+        span.finish(true);
+    return found;
+}
+
+// A restore that runs longer than `total`, or prints nothing for `idle`, is
+// considered stuck and killed. Zero disables a limit.
+struct RestoreLimits {
+    std::chrono::minutes total{60};
+    std::chrono::minutes idle{15};
+};
+
+// Optional callbacks into a running restore. `progress` is fed every output
+// line; `onProgress` runs on the supervisor thread when it moves, `onExit`
+// once the child is gone.
+struct RestoreHooks {
+    std::shared_ptr<RestoreProgress> progress;
+    std::function<void(const RestoreProgress::Sample &)> onProgress;
+    std::function<void()> onExit;
+};
+
+// One cfgutil restore as a supervised child, for one target or a batch of
+// them. Only the ports it restores look at it, through poll(), which never
+// blocks; detection and the other ports keep going. Targets with a known
+// ECID are pinned to it instead of whatever cfgutil picks.
+class RestoreRun {
+public:
+    struct Unit {
+        std::string port;
+        std::string ecid; // empty if the target wasn't identified
+    };
+
+    std::shared_ptr<RestoreJob> job;
+    std::string cacheDir; // prefetched personalization for the tool, if any
+
+    // Returns false (and logs why) if cfgutil couldn't be started. `tag`
+    // prefixes the log lines.
+    bool start(RestoreSupervisor &restores, const RestoreBackend &tool, const std::string &ipsw_path,
+               const std::string &tag, const std::vector<Unit> &units, const RestoreHooks &hooks = RestoreHooks()) {
+        this->tag = tag;
+        this->tool = tool.name();
+        std::vector<std::string> ecids;
+        std::string shown;
+        for (auto &u : units) {
+            if (u.ecid.empty())
+                continue;
+            ecids.push_back(u.ecid);
+            shown += (shown.empty() ? "" : ", ") + u.ecid;
+        }
+        if (!shown.empty())
+            LogInfo(tag.c_str(), "\U0001F527 Starting restore with %s (ECID %s)...", tool.name(), shown.c_str());
+        else
+            LogInfo(tag.c_str(), "\U0001F527 Starting restore with %s...", tool.name());
+        std::vector<std::string> args = tool.command(ipsw_path, ecids, cacheDir);
+        for (auto &u : units) spans.emplace_back(new PhaseSpan("restore", u.port, u.ecid));
+        progress = hooks.progress;
+        if (progress) {
+            struct stat st;
+            progress->begin(stat(ipsw_path.c_str(), &st) == 0 ? st.st_size : 0);
+        }
+        std::string label = tag;
+        std::shared_ptr<RestoreProgress> p = progress;
+        auto onProgress = hooks.onProgress;
+        const char *name = tool.name();
+        job = restores.spawn(args, label, [label, name, p, onProgress](const std::string &line) {
+            LogInfo(label.c_str(), "%s: %s", name, line.c_str());
+            if (p && p->update(line, MonotonicNs()) && onProgress)
+                onProgress(p->snapshot());
+        }, [onExit = hooks.onExit](int) {
+            if (onExit) onExit();
+        });
+        if (!job) {
+            LogWarn(tag.c_str(), "\U0000274C Could not start %s: %s", tool.name(), strerror(errno));
+            for (auto &s : spans) s->finish(false);
+            return false;
+        }
+        started = Clock::now();
+        return true;
+    }
+
+    // Returns true once cfgutil is gone, with its exit code in `ret`. Until
+    // then it flags a restore that won't make its time limit, and stops one
+    // that ran past it or went quiet: SIGTERM first, SIGKILL 10 s later.
+    // Every port of a batch polls the same run; the result is logged once.
+    bool poll(const RestoreLimits &limits, int &ret) {
+        if (job->waitFor(milliseconds(0), ret)) {
+            if (reported)
+                return true;
+            reported = true;
+            for (auto &s : spans) s->finish(ret == 0);
+            if (ret == 0)
+                LogInfo(tag.c_str(), "\U00002705 Restore completed successfully.");
+            else
+                LogWarn(tag.c_str(), "\U0000274C Restore failed with code %d.", ret);
+            return true;
+        }
+        auto now = Clock::now();
+        if (stopping) {
+            if (now >= killAt && !killed) {
+                job->cancel(SIGKILL);
+                killed = true;
+            }
+            return false;
+        }
+        if (progress && limits.total.count() && !warnedSlow) {
+            // Flag a slow host, cable or IPSW source while there's still time.
+            RestoreProgress::Sample s = progress->snapshot();
+            if (s.etaSec > 0 && now - started + std::chrono::seconds((long long)s.etaSec) > limits.total) {
+                LogWarn(tag.c_str(), "\U0001F422 Restore is slow (%s %.0f%%, %.1f MB/s); it may not finish in time.",
+                        s.phase.c_str(), s.percent, s.bytesPerSec / 1e6);
+                warnedSlow = true;
+            }
+        }
+        bool overdue = limits.total.count() && now - started > limits.total;
+        bool silent = limits.idle.count() && job->idle() > limits.idle;
+        if (overdue || silent) {
+            LogWarn(tag.c_str(), "\U000023F0 %s %s; stopping it.", tool,
+                    overdue ? "ran past its time limit" : "stopped making progress");
+            job->cancel();
+            stopping = true;
+            killAt = now + std::chrono::seconds(10);
+        }
+        return false;
+    }
+
+private:
+    std::string tag;
+    const char *tool = "";
+    std::vector<std::unique_ptr<PhaseSpan>> spans;
+    std::shared_ptr<RestoreProgress> progress;
+    Clock::time_point started, killAt;
+    bool warnedSlow = false, stopping = false, killed = false, reported = false;
+};
+
+// Collects restores of the same IPSW that come in within `window` of the
+// first one and starts them as one cfgutil run with an --ecid per target,
+// so cfgutil's startup, framework load and device discovery are paid once
+// per batch instead of once per unit. Executor queue only: members join,
+// then poll until whichever of them comes back first after the window
+// starts the batch for all.
+class RestoreBatcher {
+public:
+    enum State { Collecting, Started, Failed };
+
+    milliseconds window{0}; // zero turns batching off
+    const RestoreBackend *tool = nullptr;
+    std::string cacheDir;
+
+    void join(uint64_t id, const std::string &ipsw, const RestoreRun::Unit &unit, const RestoreHooks &hooks) {
+        leave(id); // an earlier session of the port that never came back for its run
+        Batch &b = batches[ipsw];
+        if (b.members.empty())
+            b.opened = Clock::now();
+        b.members.push_back({id, unit, hooks});
+        memberOf[id] = ipsw;
+        started.erase(id);
+    }
+
+    // Also drops a run that was started for `id` but not picked up yet.
+    void leave(uint64_t id) {
+        started.erase(id);
+        auto it = memberOf.find(id);
+        if (it == memberOf.end())
+            return;
+        auto &members = batches[it->second].members;
+        members.erase(std::remove_if(members.begin(), members.end(), [id](const Member &m) { return m.id == id; }),
+                      members.end());
+        if (members.empty())
+            batches.erase(it->second);
+        memberOf.erase(it);
+    }
+
+    // Started hands out the run; Collecting says how long until the batch
+    // is due in `wait`.
+    State poll(RestoreSupervisor &restores, uint64_t id, std::shared_ptr<RestoreRun> &run, milliseconds &wait) {
+        auto done = started.find(id);
+        if (done != started.end()) {
+            run = done->second;
+            started.erase(done);
+            return run ? Started : Failed;
+        }
+        auto it = memberOf.find(id);
+        if (it == memberOf.end())
+            return Failed;
+        std::string ipsw = it->second;
+        Batch &b = batches[ipsw];
+        auto due = b.opened + window;
+        if (Clock::now() < due) {
+            wait = std::chrono::ceil<milliseconds>(due - Clock::now());
+            return Collecting;
+        }
+        launch(restores, ipsw, b);
+        batches.erase(ipsw);
+        return poll(restores, id, run, wait);
+    }
+
+private:
+    struct Member {
+        uint64_t id;
+        RestoreRun::Unit unit;
+        RestoreHooks hooks;
+    };
+    struct Batch {
+        Clock::time_point opened;
+        std::vector<Member> members;
+    };
+
+    void launch(RestoreSupervisor &restores, const std::string &ipsw, Batch &b) {
+        std::vector<RestoreRun::Unit> units;
+        std::string tag;
+        for (auto &m : b.members) {
+            units.push_back(m.unit);
+            tag += (tag.empty() ? "" : "+") + m.unit.port;
+        }
+        // One progress for the run, copied into each member's.
+        std::vector<Member> members = b.members;
+        RestoreHooks hooks;
+        hooks.progress = std::make_shared<RestoreProgress>();
+        hooks.onProgress = [members](const RestoreProgress::Sample &s) {
+            for (auto &m : members) {
+                if (m.hooks.progress) m.hooks.progress->assign(s);
+                if (m.hooks.onProgress) m.hooks.onProgress(s);
+            }
+        };
+        hooks.onExit = [members] {
+            for (auto &m : members)
+                if (m.hooks.onExit) m.hooks.onExit();
+        };
+        if (members.size() > 1)
+            LogInfo(tag.c_str(), "\U0001F4E6 Restoring %zu targets with one %s run.", members.size(), tool->name());
+        auto run = std::make_shared<RestoreRun>();
+        run->cacheDir = cacheDir;
+        if (!run->start(restores, *tool, ipsw, tag, units, hooks))
+            run = nullptr;
+        for (auto &m : b.members) {
+            started[m.id] = run;
+            memberOf.erase(m.id);
+        }
+    }
+
+    std::map<std::string, Batch> batches; // by IPSW path
+    std::map<uint64_t, std::string> memberOf;
+    std::map<uint64_t, std::shared_ptr<RestoreRun>> started; // not picked up by the member yet
+};
+
+// Chooses the firmware for a restore: by CPID/BDID when the target has been
+// identified in DFU, otherwise only if the catalog holds a single IPSW.
+inline bool PickIpsw(IpswCatalog &catalog, IpswStager *stager, const DfuTarget *target, std::string &path,
+              const char *tag) {
+    IpswInfo info;
+    if (target && !target->cpid.empty() && !target->bdid.empty()) {
+        uint32_t chip = (uint32_t)strtoul(target->cpid.c_str(), nullptr, 16);
+        uint32_t board = (uint32_t)strtoul(target->bdid.c_str(), nullptr, 16);
+        if (!catalog.lookup(chip, board, info)) {
+            LogWarn(tag, "\U0000274C No IPSW in %s supports CPID %s BDID %s.", catalog.directory().c_str(),
+                    target->cpid.c_str(), target->bdid.c_str());
+            return false;
+        }
+    } else if (!catalog.single(info)) {
+        LogWarn(tag, "\U0000274C Target not identified and %s holds %zu IPSWs; can't choose one.",
+                catalog.directory().c_str(), catalog.size());
+        return false;
+    }
+    path = stager ? stager->pathFor(info) : info.path;
+    LogInfo(tag, "\U0001F4E6 Using %s (%s %s)%s", info.name.c_str(), info.productVersion.c_str(),
+            info.buildVersion.c_str(), path != info.path ? " from local stage" : "");
+    return true;
+}
+
+// Where to restore the catalog IPSW called `name` from.
+inline bool FindIpswByName(IpswCatalog &catalog, IpswStager *stager, const std::string &name, std::string &path) {
+    for (auto &info : catalog.all())
+        if (info.name == name) {
+            path = stager ? stager->pathFor(info) : info.path;
+            return true;
+        }
+    return false;
+}
+
+// The percentile table, then the per-model profiles if they're kept, as
+// text so it goes through the logger or a socket.
+inline std::string TimingSummary(ModelProfiles *profiles, const PollConfig &base) {
+    char *buf = nullptr;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    TimingLog::shared().printSummary(mem);
+    if (profiles)
+        profiles->printSummary(mem, base);
+    fclose(mem);
+    std::string table(buf, len);
+    free(buf);
+    return table;
+}
+
+struct Config {
+    IpswCatalog *catalog = nullptr;
+    IpswStager *stager = nullptr;
+    PollConfig dbma;
+    bool autoRestore = false;
+    milliseconds reenumerateWindow{30000}; // longest a target may take from the VDM to showing up in DFU
+    milliseconds fallbackPoll{2000}; // register 0x3f re-check when IOKit stays quiet
+    int disconnectErrors = 3;        // consecutive I2C failures that count as an unplug
+    milliseconds errorRecheck{100};  // register 0x3f re-read after a failed one
+    milliseconds failedHold{2000};   // a port whose session failed isn't picked up again for this long
+    bool daemon = false;             // no terminal; driven through the control socket
+    bool holdPorts = false;          // don't DFU new ports until asked to
+    std::set<int32_t> rids{0};       // controllers to use; empty means every RID
+    const VdmProfile *vdm = &kVdmProfiles[0];            // sent after DBMa
+    std::map<std::string, const VdmProfile *> portVdm;   // per-port override, by label
+    milliseconds hpmTimeout{1000};   // deadline for each AppleHPMLib call
+    RestoreLimits restoreLimits;
+    milliseconds batchWindow{0};     // collect same-IPSW restores this long into one cfgutil run
+    const RestoreBackend *restoreTool = FindRestoreBackend("cfgutil");
+    TssCache *tss = nullptr;         // personalization fetched while targets wait in DFU
+    ModelProfiles *profiles = nullptr; // learned per-model DBMa schedules
+    ClusterClient *cluster = nullptr;  // shared job queue, see cluster.h
+};
+
+// Where a port is in its session. The control socket's "list" shows the
+// coarser name from StateName(). Done and Failed are the two ways out: the
+// worker is released either way and the port is picked up again when it's
+// next seen.
+enum class PortState { Idle, Detected, DBMa, VDMSent, AwaitDFU, Restoring, AwaitDisconnect, Done, Failed };
+
+inline const char *StateName(PortState s) {
+    switch (s) {
+    case PortState::Idle:
+    case PortState::Detected:
+    case PortState::DBMa:
+    case PortState::VDMSent: return "dfu";
+    case PortState::AwaitDFU: return "monitor";
+    case PortState::Restoring: return "restoring";
+    case PortState::AwaitDisconnect: return "disconnect-wait";
+    case PortState::Done: return "done";
+    case PortState::Failed: return "failed";
+    }
+    return "?";
+}
+
+// One state machine per connected port, stepped by the scheduler's
+// PortExecutor: Idle → Detected → DBMa → VDMSent → AwaitDFU → Restoring →
+// AwaitDisconnect → Done. An error in any state goes to Failed instead
+// (see abandon()). A step does at most a couple of controller
+// transactions and returns when it wants to run next, so all the ports share
+// one thread and a slow port only costs the others its I2C time. IOKit
+// messages, control requests, DFU targets and the restore child's exit kick
+// the machine instead of waking a sleeping thread.
+struct PortWorker : PortMachine {
+    PortWorker(const Config &cfg, RestoreSupervisor &restores, RestoreBatcher &batcher, PluginCache &plugins)
+        : cfg(cfg), restores(restores), batcher(batcher), plugins(plugins) {}
+
+    const Config &cfg;
+    RestoreSupervisor &restores;
+    RestoreBatcher &batcher;
+    PluginCache &plugins;
+    uint64_t entryID = 0;
+    std::shared_ptr<HPMPluginInstance> inst;
+    std::atomic<bool> awaitingRestore{false};
+    std::atomic<bool> restoreRequested{false};
+    std::atomic<bool> dfuRequested{false};     // retry DFU entry from the monitor stage
+    std::atomic<bool> restoreCancelled{false};
+    std::atomic<PortState> state{PortState::Idle};
+    std::atomic<const VdmProfile *> vdm{&kVdmProfiles[0]};
+    EventBus *events = nullptr;
+    std::shared_ptr<ConnectionTracker> conn = std::make_shared<ConnectionTracker>();
+    std::unique_ptr<ServiceInterestWatcher::Subscription> interest;
+    std::atomic<bool> done{false};
+    Clock::time_point started = Clock::now();
+    std::atomic<uint64_t> vdmSentNs{0}; // a DFU VDM went out, for the re-enumeration span; 0 if not
+    std::atomic<uint64_t> bindByNs{0};  // a DFU target showing up after this isn't ours
+    std::atomic<double> reenumerateMs{-1}; // VDM to DFU target, for the model profile
+
+    // Set from the DFU USB watcher once the target re-enumerates; the rest
+    // comes from control socket requests. All guarded by targetLock.
+    std::mutex targetLock;
+    bool haveTarget = false;
+    DfuTarget target;
+    std::string ipswOverride;
+    std::string tssKey; // personalization being prefetched for the target
+    uint64_t clusterJob = 0; // the cluster job this session is restoring for
+    std::shared_ptr<RestoreJob> job;
+    std::shared_ptr<RestoreProgress> progress = std::make_shared<RestoreProgress>(); // current or last restore
+
+    void requestRestore(const std::string &ipsw = "") {
+        {
+            std::lock_guard<std::mutex> guard(targetLock);
+            ipswOverride = ipsw;
+        }
+        restoreCancelled = false;
+        restoreRequested = true;
+        kick();
+    }
+
+    void requestDfu(const VdmProfile *profile = nullptr) {
+        if (profile)
+            vdm = profile;
+        dfuRequested = true;
+        kick();
+    }
+
+    // Drops a pending restore request or stops a running one. A running
+    // batch restore is stopped for every port in it.
+    void cancelRestore() {
+        restoreCancelled = true;
+        restoreRequested = false;
+        {
+            std::lock_guard<std::mutex> guard(targetLock);
+            if (job)
+                job->cancel();
+        }
+        kick(); // leave a batch that hasn't started yet
+    }
+
+    // Restores with the IPSW a cluster job asked for.
+    void takeJob(const ClusterJob &j, const std::string &path) {
+        {
+            std::lock_guard<std::mutex> guard(targetLock);
+            clusterJob = j.id;
+        }
+        emit("cluster-job id=" + std::to_string(j.id) + " ipsw=" + j.ipsw);
+        requestRestore(path);
+    }
+
+    void emit(const std::string &what) {
+        if (events)
+            events->publish("event " + inst->label + " " + what);
+    }
+
+    bool hasIpswOverride() {
+        std::lock_guard<std::mutex> guard(targetLock);
+        return !ipswOverride.empty();
+    }
+
+    bool hasTarget() {
+        std::lock_guard<std::mutex> guard(targetLock);
+        return haveTarget;
+    }
+
+    bool getTarget(DfuTarget &out) {
+        std::lock_guard<std::mutex> guard(targetLock);
+        if (haveTarget) out = target;
+        return haveTarget;
+    }
+
+    microseconds step() override {
+        const char *tag = inst->label.c_str();
+        try {
+            switch (state.load()) {
+            case PortState::Idle:
+                LogInfo(tag, "\U0001F50C Device detected. Initiating %s procedure...", vdm.load()->name);
+                session.reset(new PhaseSpan("session", inst->label));
+                state = PortState::Detected;
+                return milliseconds(0);
+            case PortState::Detected:
+                return beginDfu();
+            case PortState::DBMa:
+                return stepDBMa();
+            case PortState::VDMSent:
+                return sendVdm();
+            case PortState::AwaitDFU:
+                return monitor();
+            case PortState::Restoring:
+                return restoring();
+            case PortState::AwaitDisconnect:
+                return awaitDisconnect();
+            case PortState::Done:
+            case PortState::Failed:
+                if (!done) {
+                    Metrics::shared().activePorts.fetch_sub(1, std::memory_order_relaxed);
+                    done = true;
+                }
+                return kUntilKicked;
+            }
+        } catch (const hung_controller &) {
+            emit("quarantined");
+            plugins.quarantine(entryID, inst->label);
+            abandon();
+            return milliseconds(0);
+        } catch (const std::exception &e) {
+            LogError(tag, "Error: %s", e.what());
+            abandon();
+            return cfg.failedHold;
+        }
+        return milliseconds(0);
+    }
+
+private:
+    enum Presence { Present, Gone, Unsure };
+
+    milliseconds beginDfu() {
+        dfuRequested = false;
+        vdmSentNs = 0; // a retry may use a profile that doesn't enter DFU
+        emit("dfu-start");
+        current = vdm;
+        LogInfo(inst->label.c_str(), "\U0001F510 Entering DBMa...");
+        schedule = cfg.dbma;
+        bindWindow = cfg.reenumerateWindow;
+        if (cfg.profiles) {
+            if (identity.empty())
+                identity = ReadPartnerIdentity(*inst);
+            model = cfg.profiles->guess(identity, inst->label);
+            schedule = cfg.profiles->tune(model, cfg.dbma);
+            bindWindow = cfg.profiles->reenumerateWindow(model, cfg.reenumerateWindow);
+            if (!model.empty())
+                LogDebug(inst->label.c_str(), "Looks like %s: DBMa re-read from %lld ms every %lld ms, give up at %lld ms",
+                         model.c_str(), (long long)(schedule.initial.count() / 1000),
+                         (long long)(schedule.max.count() / 1000), (long long)(schedule.deadline.count() / 1000));
+        }
+        dbmaSpan.reset(new PhaseSpan("dbma", inst->label));
+        dbmaStarted = Clock::now();
+        dbma.reset(new DBMaSequence(*inst, schedule));
+        state = PortState::DBMa;
+        return milliseconds(0);
+    }
+
+    microseconds stepDBMa() {
+        Clock::duration wait;
+        DBMaSequence::Result r = dbma->step(wait);
+        if (r == DBMaSequence::Pending)
+            return std::chrono::ceil<microseconds>(wait);
+        dbma.reset();
+        dbmaSpan->finish(r == DBMaSequence::Reached);
+        dbmaSamples.push_back((double)ElapsedMs(dbmaStarted)); // a timeout counts as taking the deadline
+        if (r == DBMaSequence::Reached) {
+            LogInfo(inst->label.c_str(), "\U00002705 Entered DBMa mode.");
+            state = PortState::VDMSent;
+            return milliseconds(0);
+        }
+        ReportNoDBMa(*inst);
+        return enterMonitor(false);
+    }
+
+    milliseconds sendVdm() {
+        bool ok = SendVdm(*inst, *current);
+        if (ok && current->entersDfu) {
+            uint64_t now = MonotonicNs();
+            bindByNs = now + (uint64_t)bindWindow.count() * 1000000;
+            vdmSentNs = now;
+        }
+        return enterMonitor(ok);
+    }
+
+    milliseconds enterMonitor(bool ok) {
+        const char *tag = inst->label.c_str();
+        sent = ok;
+        emit(std::string(sent ? "vdm-sent" : "dfu-failed") + " profile=" + current->name);
+        if (cfg.autoRestore && sent && current->entersDfu)
+            LogInfo(tag, "\U0001F501 Waiting for the target to enumerate in DFU, restore starts automatically...");
+        else if (cfg.daemon)
+            LogInfo(tag, "\U0001F501 Monitoring for disconnect or restore request...");
+        else
+            LogInfo(tag, "\U0001F501 Monitoring for disconnect or restore trigger... (press 'r' to restore)");
+        errors = 0;
+        quietPoll = cfg.fallbackPoll;
+        awaitingRestore = true;
+        state = PortState::AwaitDFU;
+        return milliseconds(0);
+    }
+
+    // The partner is gone once IOKit terminated the service, register 0x3f
+    // says disconnected, or the controller failed `disconnectErrors` reads
+    // in a row (a single I2C error is not an unplug).
+    Presence checkPresence() {
+        if (conn->wait(milliseconds(0)) == ConnectionTracker::Terminated)
+            return Gone;
+        try {
+            HPMRegister status;
+            inst->readRegister(0, 0x3f, status);
+            errors = 0;
+            return status[0] & 1 ? Present : Gone;
+        } catch (const hung_controller &) {
+            throw; // not an unplug; step() quarantines the port
+        } catch (...) {
+            return ++errors >= cfg.disconnectErrors ? Gone : Unsure;
+        }
+    }
+
+    // Register 0x3f is only read when something kicks us, or every
+    // `quietPoll` otherwise; after an error, look again soon.
+    milliseconds recheck() const { return errors ? cfg.errorRecheck : quietPoll; }
+
+    milliseconds monitor() {
+        if (restoreRequested || dfuRequested) {
+            awaitingRestore = false;
+            if (restoreRequested) {
+                state = PortState::Restoring;
+                return milliseconds(0);
+            }
+            return beginDfu();
+        }
+        if (checkPresence() == Gone) {
+            awaitingRestore = false;
+            LogInfo(inst->label.c_str(), "\U0000274E Device disconnected.");
+            return endSession();
+        }
+        return recheck();
+    }
+
+    milliseconds restoring() {
+        const char *tag = inst->label.c_str();
+        if (!run && !batched && !cfg.catalog->ready() && !hasIpswOverride()) {
+            if (!waitingCatalog)
+                emit("restore-waiting reason=catalog");
+            waitingCatalog = true;
+            return milliseconds(200);
+        }
+        if (!run && !batched && cfg.tss) {
+            std::string key;
+            {
+                std::lock_guard<std::mutex> guard(targetLock);
+                key = tssKey;
+            }
+            // Let a fetch that's already under way finish rather than sign twice.
+            if (!key.empty() && cfg.tss->state(key) == TssCache::Fetching) {
+                if (!waitingTss)
+                    emit("restore-waiting reason=tss");
+                waitingTss = true;
+                return milliseconds(500);
+            }
+            waitingTss = false;
+        }
+        if (!run && !batched) {
+            DfuTarget t;
+            bool known = getTarget(t);
+            std::string ipsw_path;
+            {
+                std::lock_guard<std::mutex> guard(targetLock);
+                ipsw_path = ipswOverride;
+            }
+            if (ipsw_path.empty() && !PickIpsw(*cfg.catalog, cfg.stager, known ? &t : nullptr, ipsw_path, tag)) {
+                restoreDone(-1, "no-ipsw");
+                return enterDisconnectWait();
+            }
+            restoreIpsw = ipsw_path;
+            RestoreHooks hooks;
+            // The child's callbacks may outlive this machine.
+            std::weak_ptr<PortMachine> self = weak_from_this();
+            hooks.progress = progress;
+            hooks.onProgress = [self](const RestoreProgress::Sample &s) {
+                if (auto m = self.lock())
+                    static_cast<PortWorker &>(*m).emit("progress " + RestoreProgress::Format(s));
+            };
+            hooks.onExit = [self] {
+                if (auto m = self.lock())
+                    m->kick();
+            };
+            RestoreRun::Unit unit{inst->label, known ? t.ecid : ""};
+            if (batcher.window.count() && known) {
+                // Only identified targets can share a run; cfgutil needs their ECIDs.
+                batcher.join(entryID, ipsw_path, unit, hooks);
+                batched = true;
+                emit("restore-queued ipsw=" + ipsw_path);
+            } else {
+                emit("restore-start ipsw=" + ipsw_path);
+                run = std::make_shared<RestoreRun>();
+                if (cfg.tss)
+                    run->cacheDir = cfg.tss->directory();
+                if (!run->start(restores, *cfg.restoreTool, ipsw_path, inst->label, {unit}, hooks)) {
+                    run.reset();
+                    restoreDone(-1);
+                    return enterDisconnectWait();
+                }
+                adoptJob();
+            }
+        }
+        if (batched) {
+            if (restoreCancelled) {
+                batcher.leave(entryID);
+                batched = false;
+                restoreDone(-1, "cancelled");
+                return enterDisconnectWait();
+            }
+            milliseconds wait{0};
+            switch (batcher.poll(restores, entryID, run, wait)) {
+            case RestoreBatcher::Collecting:
+                return wait;
+            case RestoreBatcher::Failed:
+                batched = false;
+                restoreDone(-1);
+                return enterDisconnectWait();
+            case RestoreBatcher::Started:
+                batched = false;
+                emit("restore-start ipsw=" + restoreIpsw);
+                adoptJob();
+                break;
+            }
+        }
+        int ret;
+        if (!run->poll(cfg.restoreLimits, ret))
+            return milliseconds(1000); // the limits are checked once a second; exit kicks sooner
+        {
+            std::lock_guard<std::mutex> guard(targetLock);
+            job = nullptr;
+        }
+        run.reset();
+        restoreDone(ret);
+        return enterDisconnectWait();
+    }
+
+    // Reports the end of a restore, to the cluster too if it was a job.
+    void restoreDone(int code, const char *reason = nullptr) {
+        emit("restore-done code=" + std::to_string(code) + (reason ? std::string(" reason=") + reason : ""));
+        finishJob(code);
+    }
+
+    void finishJob(int code) {
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> guard(targetLock);
+            id = clusterJob;
+            clusterJob = 0;
+        }
+        if (id && cfg.cluster)
+            cfg.cluster->finish(id, code);
+    }
+
+    // Makes the running job reachable for cancelRestore().
+    void adoptJob() {
+        std::lock_guard<std::mutex> guard(targetLock);
+        job = run->job;
+        if (restoreCancelled)
+            job->cancel();
+    }
+
+    milliseconds enterDisconnectWait() {
+        LogInfo(inst->label.c_str(), "\U0001F501 Waiting for device to disconnect after restore...");
+        DfuTarget t;
+        bool known = getTarget(t);
+        disconnectSpan.reset(new PhaseSpan("disconnect", inst->label, known ? t.ecid : ""));
+        disconnectStarted = Clock::now();
+        errors = 0;
+        quietPoll = cfg.fallbackPoll;
+        if (cfg.profiles)
+            quietPoll = cfg.profiles->disconnectPoll(known && !t.cpid.empty() ? t.cpid + "-" + t.bdid : model,
+                                                     cfg.fallbackPoll);
+        state = PortState::AwaitDisconnect;
+        return milliseconds(0);
+    }
+
+    milliseconds awaitDisconnect() {
+        if (checkPresence() != Gone)
+            return recheck();
+        disconnectSpan->finish(true);
+        disconnectMs = (double)ElapsedMs(disconnectStarted);
+        LogInfo(inst->label.c_str(), "\U0000274E Device disconnected after restore.");
+        return endSession();
+    }
+
+    // Moves a session that a controller error cut short to Failed, wherever
+    // it was: it leaves a batch that hasn't started, hands a claimed cluster
+    // job back as failed and records the session as failed. A restore only
+    // this port was watching is stopped, since nothing would enforce its
+    // limits or report its result; one shared with a batch carries on for
+    // the other ports.
+    void abandon() {
+        awaitingRestore = false;
+        restoreRequested = false;
+        bool restoring = run || batched;
+        if (batched) {
+            batcher.leave(entryID);
+            batched = false;
+        }
+        if (run) {
+            if (run.use_count() == 1)
+                run->job->cancel();
+            run.reset();
+            std::lock_guard<std::mutex> guard(targetLock);
+            job = nullptr;
+        }
+        if (restoring)
+            restoreDone(-1, "error");
+        finishJob(-1);
+        DfuTarget t;
+        if (session && getTarget(t))
+            session->setEcid(t.ecid);
+        if (session)
+            session->finish(false);
+        state = PortState::Failed;
+    }
+
+    milliseconds endSession() {
+        emit("disconnected");
+        DfuTarget t;
+        if (getTarget(t))
+            session->setEcid(t.ecid);
+        session->finish(sent);
+        plugins.healthy(entryID);
+        finishJob(-1); // unplugged before the job's restore ran
+        if (cfg.profiles)
+            learn();
+        state = PortState::Done;
+        return milliseconds(0);
+    }
+
+    // Files the session's latencies under the model it turned out to be
+    // (or the one it was taken for, if it never showed up in DFU).
+    void learn() {
+        DfuTarget t;
+        bool known = getTarget(t) && !t.cpid.empty();
+        if (known)
+            model = t.cpid + "-" + t.bdid;
+        if (model.empty())
+            return;
+        for (double ms : dbmaSamples) cfg.profiles->record(model, ModelProfiles::DBMa, ms);
+        cfg.profiles->record(model, ModelProfiles::Reenumerate, reenumerateMs);
+        cfg.profiles->record(model, ModelProfiles::Disconnect, disconnectMs);
+        if (known)
+            cfg.profiles->learn(identity, inst->label, model);
+        cfg.profiles->saveLater();
+    }
+
+    // Executor queue only.
+    const VdmProfile *current = nullptr; // profile of the DFU attempt in flight
+    bool sent = false;
+    int errors = 0; // consecutive failed 0x3f reads
+    std::unique_ptr<PhaseSpan> session, dbmaSpan, disconnectSpan;
+    std::unique_ptr<DBMaSequence> dbma;
+    PollConfig schedule;              // the running DBMaSequence refers to it
+    std::string identity, model;      // for the model profile
+    milliseconds bindWindow{0};       // --reenumerate-ms, or the model's
+    milliseconds quietPoll{0};        // --fallback-poll-ms, or the model's while awaiting the unplug
+    Clock::time_point dbmaStarted, disconnectStarted;
+    std::vector<double> dbmaSamples;  // one per DBMa attempt this session
+    double disconnectMs = -1;
+    std::shared_ptr<RestoreRun> run; // shared with the other ports of a batch
+    bool batched = false;            // waiting in `batcher` for the run to start
+    bool waitingTss = false, waitingCatalog = false;
+    std::string restoreIpsw;
+};
+
+// Owns the port workers. Only touched from the main thread (the polling loop
+// or the notification run loop); the workers run on `executor` and just flip
+// their atomics.
+struct Scheduler {
+    const Config &cfg;
+    HPMTopology topology;
+    PluginCache plugins;
+    RestoreSupervisor restores;
+    RestoreBatcher batcher; // executor queue only
+    ServiceInterestWatcher interests;
+    DfuUSBWatcher dfuDevices{[this](const DfuTarget &t) { bindDfuTarget(t); }};
+    EventBus events;
+    PortExecutor executor;
+    std::mutex lock; // guards `workers`/`held` against the DFU watcher queue and control clients
+    std::map<uint64_t, std::shared_ptr<PortWorker>> workers;
+    std::map<uint64_t, DetectedPort> held; // connected, waiting for a "dfu" request (--hold)
+    bool waitingShown = false;
+
+    explicit Scheduler(const Config &cfg) : cfg(cfg) {
+        batcher.window = cfg.restoreTool->batches() ? cfg.batchWindow : milliseconds(0);
+        batcher.tool = cfg.restoreTool;
+        if (cfg.tss)
+            batcher.cacheDir = cfg.tss->directory();
+    }
+
+    // Drops finished workers so their ports can be picked up again.
+    void reap() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = workers.begin(); it != workers.end();) {
+            if (it->second->done) {
+                it = workers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    bool busy(uint64_t entryID) {
+        std::lock_guard<std::mutex> guard(lock);
+        return workers.count(entryID) != 0 || held.count(entryID) != 0;
+    }
+
+    std::set<uint64_t> busySet() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::set<uint64_t> ids;
+        for (auto &kv : workers) ids.insert(kv.first);
+        for (auto &kv : held) ids.insert(kv.first);
+        return ids;
+    }
+
+    // One pass of polling mode over `nodes`: a worker for every connected
+    // controller that doesn't have one.
+    void scan(const std::vector<HPMNode> &nodes) {
+        reap();
+        for (auto &port : FindDevices(nodes, plugins, busySet()))
+            start(std::move(port));
+    }
+
+    // Notification mode: `node` posted a message, so it may have been
+    // plugged in. Returns false if it wasn't taken up: not connected, or
+    // quarantined.
+    bool probe(const HPMNode &node) {
+        reap();
+        if (busy(node.entryID))
+            return true;
+        DetectedPort port;
+        if (!ProbeService(plugins, node, port))
+            return false;
+        start(std::move(port));
+        return true;
+    }
+
+    // Pairs a target that just enumerated in DFU with the port session that
+    // sent it there. Only sessions whose DFU VDM went out within
+    // --reenumerate-ms are considered: the one whose hpmN matches the USB
+    // ancestry if we can tell, otherwise the only one there is. A restore
+    // erases whatever it's bound to, so a unit put in DFU by hand, or one
+    // that two ports could have sent, is left alone.
+    void bindDfuTarget(const DfuTarget &t) {
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t now = MonotonicNs();
+        PortWorker *match = nullptr;
+        std::vector<PortWorker *> candidates;
+        for (auto &kv : workers) {
+            PortWorker *w = kv.second.get();
+            if (w->done || w->hasTarget() || !w->vdmSentNs || now > w->bindByNs)
+                continue;
+            if (t.portIndex >= 0 && RegistryNameIndex(w->inst->label.c_str(), "hpm") == t.portIndex) {
+                match = w;
+                break;
+            }
+            candidates.push_back(w);
+        }
+        if (!match && candidates.size() == 1)
+            match = candidates[0];
+        if (!match && candidates.size() > 1) {
+            std::string ports;
+            for (auto *w : candidates) ports += (ports.empty() ? "" : ", ") + w->inst->label;
+            LogWarn("", "\U0001F50E DFU device ECID %s (CPID %s) appeared, but any of %s could have sent it; "
+                        "not binding it.",
+                    t.ecid.c_str(), t.cpid.c_str(), ports.c_str());
+            return;
+        }
+        if (!match) {
+            LogInfo("", "\U0001F50E DFU device ECID %s (CPID %s) appeared but no port is waiting for it.",
+                    t.ecid.c_str(), t.cpid.c_str());
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> tguard(match->targetLock);
+            match->target = t;
+            match->haveTarget = true;
+        }
+        LogInfo(match->inst->label.c_str(), "\U0001F50E Target in DFU: ECID %s, CPID %s, BDID %s",
+                t.ecid.c_str(), t.cpid.c_str(), t.bdid.c_str());
+        match->emit("dfu-target ecid=" + t.ecid + " cpid=" + t.cpid + " bdid=" + t.bdid);
+        if (uint64_t sent = match->vdmSentNs) {
+            uint64_t now = MonotonicNs();
+            TimingLog::shared().record(match->inst->label, t.ecid, "reenumerate", sent, now, true);
+            match->reenumerateMs = (now - sent) / 1e6;
+        }
+        prefetchTss(*match, t);
+        // A job restores (and erases) the target, so it's only claimed when
+        // the operator asked for restores without a keypress.
+        if (cfg.autoRestore && cfg.cluster)
+            claimJob(*match, t);
+        else if (cfg.autoRestore)
+            match->requestRestore();
+    }
+
+    // Asks the cluster for a job for `t`. Without one the target is restored
+    // as if there were no cluster.
+    void claimJob(PortWorker &w, const DfuTarget &t) {
+        std::vector<std::string> ipsws;
+        uint32_t chip = (uint32_t)strtoul(t.cpid.c_str(), nullptr, 16);
+        uint32_t board = (uint32_t)strtoul(t.bdid.c_str(), nullptr, 16);
+        if (!t.cpid.empty() && !t.bdid.empty())
+            for (auto &info : cfg.catalog->all())
+                if (std::find(info.boards.begin(), info.boards.end(), std::make_pair(chip, board)) != info.boards.end())
+                    ipsws.push_back(info.name);
+        std::weak_ptr<PortMachine> self = w.weak_from_this();
+        const Config *c = &cfg;
+        cfg.cluster->claim(t.ecid, ipsws, [self, c](bool ok, const ClusterJob &job) {
+            auto m = self.lock();
+            std::string path;
+            if (ok && (!m || !FindIpswByName(*c->catalog, c->stager, job.ipsw, path))) {
+                if (m)
+                    LogWarn(static_cast<PortWorker &>(*m).inst->label.c_str(),
+                            "\U0001F310 Job %llu wants %s, which isn't in the catalog.", (unsigned long long)job.id,
+                            job.ipsw.c_str());
+                c->cluster->finish(job.id, -1);
+                ok = false;
+            }
+            if (!m)
+                return;
+            if (ok)
+                static_cast<PortWorker &>(*m).takeJob(job, path);
+            else
+                static_cast<PortWorker &>(*m).requestRestore();
+        });
+    }
+
+    // Ports that could take another target right now.
+    int freePorts() {
+        size_t total = topology.ports(cfg.rids).size();
+        std::lock_guard<std::mutex> guard(lock);
+        size_t busy = workers.size() + held.size();
+        return total > busy ? (int)(total - busy) : 0;
+    }
+
+    // Starts signing for a target that just showed up in DFU, so it's done
+    // by the time the restore needs it.
+    void prefetchTss(PortWorker &w, const DfuTarget &t) {
+        if (!cfg.tss || t.cpid.empty() || t.bdid.empty())
+            return;
+        IpswInfo info;
+        if (!cfg.catalog->lookup((uint32_t)strtoul(t.cpid.c_str(), nullptr, 16),
+                                 (uint32_t)strtoul(t.bdid.c_str(), nullptr, 16), info))
+            return;
+        std::string key = TssCache::Key(info.buildVersion, t.bdid, t.ecid);
+        {
+            std::lock_guard<std::mutex> guard(w.targetLock);
+            w.tssKey = key;
+        }
+        // The same file the restore will use, so a staged copy spares the share.
+        std::string path = cfg.stager ? cfg.stager->pathFor(info) : info.path;
+        cfg.tss->prefetch(restores, *cfg.restoreTool, path, key, t.ecid, w.inst->label);
+    }
+
+    void start(DetectedPort &&port) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (cfg.holdPorts) {
+            LogInfo(port.label.c_str(), "\U0001F50C Device detected, holding until a dfu request.");
+            events.publish("event " + port.label + " detected held=1");
+            held[port.entryID] = std::move(port);
+            waitingShown = false;
+            return;
+        }
+        startLocked(std::move(port));
+    }
+
+    void startLocked(DetectedPort &&port, const VdmProfile *vdm = nullptr) {
+        events.publish("event " + port.label + " detected");
+        auto w = std::make_shared<PortWorker>(cfg, restores, batcher, plugins);
+        if (!vdm) {
+            auto it = cfg.portVdm.find(port.label);
+            vdm = it != cfg.portVdm.end() ? it->second : cfg.vdm;
+        }
+        w->vdm = vdm;
+        w->entryID = port.entryID;
+        w->inst = std::move(port.inst);
+        w->events = &events;
+        PortWorker *raw = w.get();
+        w->conn->onWake = [raw] { raw->kick(); };
+        if (w->inst->service)
+            w->interest = interests.subscribe(w->inst->service, w->conn);
+        Metrics::shared().activePorts.fetch_add(1, std::memory_order_relaxed);
+        executor.add(w);
+        workers.emplace(port.entryID, std::move(w));
+        waitingShown = false;
+    }
+
+    void showWaiting() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (workers.empty() && held.empty() && !waitingShown) {
+            LogInfo("", "\U0001F50D Waiting for Intel T2/Apple Silicon Mac...");
+            waitingShown = true;
+        }
+    }
+
+    PortWorker *findWorker(const std::string &label) {
+        for (auto &kv : workers)
+            if (kv.second->inst->label == label && !kv.second->done)
+                return kv.second.get();
+        return nullptr;
+    }
+
+    // Control socket requests: list, dfu <port>, restore <port> [ipsw],
+    // cancel <port>, timing. Returns "" on success or the error text.
+    std::string control(const std::vector<std::string> &args, std::string &reply) {
+        const std::string &cmd = args[0];
+        if (cmd == "timing") {
+            reply += TimingSummary(cfg.profiles, cfg.dbma);
+            return "";
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (cmd == "list") {
+            for (auto it = held.begin(); it != held.end();) {
+                // Held ports aren't monitored; make sure they're still there.
+                HPMRegister status;
+                bool connected = false;
+                try {
+                    it->second.inst->readRegister(0, 0x3f, status);
+                    connected = status[0] & 1;
+                } catch (...) {
+                }
+                if (!connected) {
+                    it = held.erase(it);
+                    continue;
+                }
+                reply += "port " + it->second.label + " held\n";
+                ++it;
+            }
+            for (auto &kv : workers) {
+                PortWorker &w = *kv.second;
+                if (w.done)
+                    continue;
+                reply += "port " + w.inst->label + " " + StateName(w.state) + " vdm=" + w.vdm.load()->name;
+                DfuTarget t;
+                if (w.getTarget(t))
+                    reply += " ecid=" + t.ecid + " cpid=" + t.cpid + " bdid=" + t.bdid;
+                if (w.state == PortState::Restoring) {
+                    std::string p = RestoreProgress::Format(w.progress->snapshot());
+                    if (!p.empty())
+                        reply += " " + p;
+                }
+                reply += "\n";
+            }
+            return "";
+        }
+        if (cmd == "vdm") {
+            for (auto &p : kVdmProfiles)
+                reply += std::string("vdm ") + p.name + " " + p.description + "\n";
+            return "";
+        }
+        if (args.size() < 2)
+            return "usage: " + cmd + " <port>";
+        const std::string &label = args[1];
+        if (cmd == "dfu") {
+            const VdmProfile *vdm = nullptr;
+            if (args.size() > 2 && !(vdm = FindVdmProfile(args[2])))
+                return "unknown VDM profile " + args[2];
+            for (auto it = held.begin(); it != held.end(); ++it) {
+                if (it->second.label == label) {
+                    DetectedPort port = std::move(it->second);
+                    held.erase(it);
+                    startLocked(std::move(port), vdm);
+                    return "";
+                }
+            }
+            PortWorker *w = findWorker(label);
+            if (!w)
+                return "no such port";
+            if (!w->awaitingRestore || w->hasTarget())
+                return "port is busy";
+            w->requestDfu(vdm);
+            return "";
+        }
+        if (cmd == "restore") {
+            PortWorker *w = findWorker(label);
+            if (!w)
+                return "no such port";
+            if (!w->awaitingRestore)
+                return "port is not waiting for a restore";
+            std::string ipsw;
+            if (args.size() > 2) {
+                ipsw = args[2];
+                if (ipsw.find('/') == std::string::npos)
+                    ipsw = cfg.catalog->directory() + "/" + ipsw;
+                if (access(ipsw.c_str(), R_OK) != 0)
+                    return "cannot read " + ipsw;
+            }
+            w->requestRestore(ipsw);
+            return "";
+        }
+        if (cmd == "cancel") {
+            PortWorker *w = findWorker(label);
+            if (!w)
+                return "no such port";
+            w->cancelRestore();
+            return "";
+        }
+        return "unknown command";
+    }
+
+    // 'r' restores every port that is sitting in DFU waiting for a trigger,
+    // 't' prints the per-phase latency summary.
+    void handleKey(char ch) {
+        if (ch == 't' || ch == 'T') {
+            std::string table = TimingSummary(cfg.profiles, cfg.dbma);
+            for (size_t pos = 0, nl; (nl = table.find('\n', pos)) != std::string::npos; pos = nl + 1)
+                LogInfo("", "%s", table.substr(pos, nl - pos).c_str());
+            return;
+        }
+        if (ch == 'r' || ch == 'R') {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto &kv : workers)
+                if (kv.second->awaitingRestore)
+                    kv.second->requestRestore();
+        }
+    }
+};
+
+#endif /* station_h */
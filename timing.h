@@ -0,0 +1,130 @@
+#ifndef timing_h
+#define timing_h
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+#include <mach/mach_time.h>
+#include <sys/time.h>
+
+// Monotonic nanoseconds from mach_absolute_time.
+inline uint64_t MonotonicNs() {
+    static mach_timebase_info_data_t tb = [] {
+        mach_timebase_info_data_t t;
+        mach_timebase_info(&t);
+        return t;
+    }();
+    return mach_absolute_time() * tb.numer / tb.denom;
+}
+
+// Per-phase latency log. Every finished span is appended to an NDJSON file
+// (when one is configured) and kept in memory for the percentile summary.
+class TimingLog {
+public:
+    static TimingLog &shared() {
+        static TimingLog log;
+        return log;
+    }
+
+    bool open(const std::string &path) {
+        std::lock_guard<std::mutex> guard(lock);
+        out = fopen(path.c_str(), "a");
+        if (out)
+            setvbuf(out, nullptr, _IOLBF, 0);
+        return out != nullptr;
+    }
+
+    // `port` and `ecid` may be empty when not known yet.
+    void record(const std::string &port, const std::string &ecid, const char *phase, uint64_t startNs,
+                uint64_t endNs, bool ok) {
+        double ms = (endNs - startNs) / 1e6;
+        Metrics::shared().phase(phase, ms, ok);
+        std::lock_guard<std::mutex> guard(lock);
+        samples[phase].push_back(ms);
+        if (!out)
+            return;
+        struct timeval tv;
+        gettimeofday(&tv, nullptr);
+        fprintf(out, "{\"ts\":%lld.%03d,\"port\":\"%s\",\"ecid\":\"%s\",\"phase\":\"%s\",\"ms\":%.3f,\"ok\":%s}\n",
+                (long long)tv.tv_sec, (int)(tv.tv_usec / 1000), port.c_str(), ecid.c_str(), phase, ms,
+                ok ? "true" : "false");
+    }
+
+    void printSummary(FILE *to) {
+        std::lock_guard<std::mutex> guard(lock);
+        fprintf(to, "\U0001F4CA %-14s %7s %10s %10s %10s %10s\n", "phase", "n", "p50 ms", "p95 ms", "p99 ms", "max ms");
+        for (auto &kv : samples) {
+            std::vector<double> v = kv.second;
+            std::sort(v.begin(), v.end());
+            fprintf(to, "\U0001F4CA %-14s %7zu %10.1f %10.1f %10.1f %10.1f\n", kv.first.c_str(), v.size(),
+                    Percentile(v, 50), Percentile(v, 95), Percentile(v, 99), v.back());
+        }
+        if (samples.empty())
+            fprintf(to, "\U0001F4CA (no samples yet)\n");
+    }
+
+    // The in-memory samples by phase, unsorted.
+    std::map<std::string, std::vector<double>> snapshot() {
+        std::lock_guard<std::mutex> guard(lock);
+        return samples;
+    }
+
+    // Forgets the in-memory samples (the NDJSON file keeps everything).
+    void reset() {
+        std::lock_guard<std::mutex> guard(lock);
+        samples.clear();
+    }
+
+    // Nearest-rank percentile of sorted samples.
+    static double Percentile(const std::vector<double> &sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        size_t rank = (size_t)(p / 100.0 * sorted.size() + 0.999999);
+        rank = std::max<size_t>(1, std::min(rank, sorted.size()));
+        return sorted[rank - 1];
+    }
+
+private:
+    std::mutex lock;
+    FILE *out = nullptr;
+    std::map<std::string, std::vector<double>> samples;
+};
+
+// Times one phase from construction to finish() (or destruction, which
+// records it as failed).
+class PhaseSpan {
+public:
+    PhaseSpan(const char *phase, std::string port, std::string ecid = "")
+        : phase(phase), port(std::move(port)), ecid(std::move(ecid)), start(MonotonicNs()) {}
+
+    ~PhaseSpan() {
+        if (!finished)
+            finish(false);
+    }
+
+    void setPort(const std::string &p) { port = p; }
+    void setEcid(const std::string &e) { ecid = e; }
+
+    // Drops the span without recording it.
+    void discard() { finished = true; }
+
+    void finish(bool ok) {
+        finished = true;
+        TimingLog::shared().record(port, ecid, phase, start, MonotonicNs(), ok);
+    }
+
+private:
+    const char *phase;
+    std::string port;
+    std::string ecid;
+    uint64_t start;
+    bool finished = false;
+};
+
+#endif /* timing_h */
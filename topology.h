@@ -0,0 +1,185 @@
+#ifndef topology_h
+#define topology_h
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <dispatch/dispatch.h>
+
+#include "qos.h"
+
+// Retained io_service_t that can be copied around like a value.
+class IOServiceRef {
+public:
+    IOServiceRef() = default;
+    explicit IOServiceRef(io_service_t s) : s(s) { if (s) IOObjectRetain(s); }
+    IOServiceRef(const IOServiceRef &o) : IOServiceRef(o.s) {}
+    IOServiceRef &operator=(const IOServiceRef &o) {
+        if (o.s) IOObjectRetain(o.s);
+        if (s) IOObjectRelease(s);
+        s = o.s;
+        return *this;
+    }
+    ~IOServiceRef() { if (s) IOObjectRelease(s); }
+
+    io_service_t get() const { return s; }
+
+private:
+    io_service_t s = 0;
+};
+
+// One AppleHPM service as the registry describes it.
+struct HPMNode {
+    uint64_t entryID = 0;
+    int32_t rid = -1;   // -1 if the service has no RID property
+    std::string path;   // IOService plane path
+    std::string label;  // log prefix: registry nub name, hpmN
+    IOServiceRef service;
+};
+
+// Short label for log lines: the "hpmN" nub name from the registry path if we
+// can find one, otherwise the registry entry ID.
+inline std::string PortLabel(const char *path, uint64_t entryID) {
+    const char *p = path ? strstr(path, "/hpm") : nullptr;
+    if (p) {
+        std::string name(p + 1);
+        size_t end = name.find_first_of("@/");
+        return name.substr(0, end);
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "port-%llx", (unsigned long long)entryID);
+    return buf;
+}
+
+// Fills `node` from the registry: all properties come from one
+// IORegistryEntryCreateCFProperties call.
+inline bool DescribeHPM(io_service_t service, HPMNode &node) {
+    if (IORegistryEntryGetRegistryEntryID(service, &node.entryID) != kIOReturnSuccess)
+        return false;
+    CFMutableDictionaryRef props = nullptr;
+    if (IORegistryEntryCreateCFProperties(service, &props, kCFAllocatorDefault, 0) != kIOReturnSuccess || !props)
+        return false;
+    CFNumberRef rid = (CFNumberRef)CFDictionaryGetValue(props, CFSTR("RID"));
+    node.rid = -1;
+    if (rid && CFGetTypeID(rid) == CFNumberGetTypeID())
+        CFNumberGetValue(rid, kCFNumberSInt32Type, &node.rid);
+    CFRelease(props);
+    io_string_t pathName;
+    bool havePath = IORegistryEntryGetPath(service, kIOServicePlane, pathName) == kIOReturnSuccess;
+    node.path = havePath ? pathName : "";
+    node.label = PortLabel(havePath ? pathName : nullptr, node.entryID);
+    node.service = IOServiceRef(service);
+    return true;
+}
+
+// Every AppleHPM service on the machine with its RID and label, read once
+// and then kept current from first-match and terminated notifications, so
+// picking ports to probe is a map lookup rather than a registry walk.
+class HPMTopology {
+public:
+    ~HPMTopology() {
+        if (addIter) IOObjectRelease(addIter);
+        if (termIter) IOObjectRelease(termIter);
+        if (notifyPort) IONotificationPortDestroy(notifyPort);
+        if (queue) dispatch_release(queue);
+    }
+
+    // Called on the topology queue after a service went away.
+    std::function<void(uint64_t entryID)> onRemoved;
+
+    void start() {
+        queue = MakeSerialQueue("auto_dfu.topology", QOS_CLASS_USER_INITIATED);
+        notifyPort = IONotificationPortCreate(kIOMainPortDefault);
+        if (!notifyPort)
+            throw std::runtime_error("IONotificationPortCreate failed");
+        IONotificationPortSetDispatchQueue(notifyPort, queue);
+        // IOServiceAddMatchingNotification consumes one reference per call.
+        CFMutableDictionaryRef matching = IOServiceMatching("AppleHPM");
+        if (!matching)
+            throw std::runtime_error("IOServiceMatching failed");
+        CFRetain(matching);
+        if (IOServiceAddMatchingNotification(notifyPort, kIOFirstMatchNotification, matching,
+                                             &HPMTopology::onAdded, this, &addIter) != kIOReturnSuccess ||
+            IOServiceAddMatchingNotification(notifyPort, kIOTerminatedNotification, matching,
+                                             &HPMTopology::onTerminated, this, &termIter) != kIOReturnSuccess)
+            throw std::runtime_error("IOServiceAddMatchingNotification failed");
+        // Arm both and take in what's already there before anyone asks.
+        dispatch_sync_f(queue, this, [](void *ctx) {
+            auto *self = static_cast<HPMTopology *>(ctx);
+            onAdded(self, self->addIter);
+            onTerminated(self, self->termIter);
+        });
+    }
+
+    // Controllers whose RID is in `rids` (all of them if `rids` is empty).
+    std::vector<HPMNode> ports(const std::set<int32_t> &rids) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<HPMNode> out;
+        for (auto &kv : nodes)
+            if (rids.empty() || rids.count(kv.second.rid))
+                out.push_back(kv.second);
+        return out;
+    }
+
+    bool find(uint64_t entryID, HPMNode &out) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = nodes.find(entryID);
+        if (it == nodes.end())
+            return false;
+        out = it->second;
+        return true;
+    }
+
+private:
+    static void onAdded(void *refcon, io_iterator_t iter) {
+        auto *self = static_cast<HPMTopology *>(refcon);
+        io_service_t service;
+        while ((service = IOIteratorNext(iter))) {
+            HPMNode node;
+            if (DescribeHPM(service, node)) {
+                std::lock_guard<std::mutex> guard(self->lock);
+                // A second RID on the same nub gets its own label.
+                bool taken = false;
+                for (auto &kv : self->nodes) taken |= kv.second.label == node.label && kv.first != node.entryID;
+                if (taken)
+                    node.label += "-r" + std::to_string(node.rid);
+                self->nodes[node.entryID] = node;
+            }
+            IOObjectRelease(service);
+        }
+    }
+
+    static void onTerminated(void *refcon, io_iterator_t iter) {
+        auto *self = static_cast<HPMTopology *>(refcon);
+        io_service_t service;
+        while ((service = IOIteratorNext(iter))) {
+            uint64_t entryID = 0;
+            if (IORegistryEntryGetRegistryEntryID(service, &entryID) == kIOReturnSuccess) {
+                {
+                    std::lock_guard<std::mutex> guard(self->lock);
+                    self->nodes.erase(entryID);
+                }
+                if (self->onRemoved) self->onRemoved(entryID);
+            }
+            IOObjectRelease(service);
+        }
+    }
+
+    std::mutex lock; // guards nodes
+    std::map<uint64_t, HPMNode> nodes;
+    dispatch_queue_t queue = nullptr;
+    IONotificationPortRef notifyPort = nullptr;
+    io_iterator_t addIter = 0;
+    io_iterator_t termIter = 0;
+};
+
+#endif /* topology_h */
@@ -0,0 +1,91 @@
+#ifndef tss_cache_h
+#define tss_cache_h
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "log.h"
+#include "restore.h"
+
+// Personalization (TSS/SHSH) responses fetched ahead of the restore and kept
+// in one directory that every restore reads from. An entry is keyed by
+// build, board and ECID. Fetching starts as soon as a target shows up in
+// DFU, so Apple's signing round trip runs while other ports are still in
+// DBMa/VDM rather than at the start of each restore. Only backends that can
+// fetch personalization on their own (RestoreBackend::personalizeCommand)
+// use it.
+class TssCache {
+public:
+    enum State { Missing, Fetching, Ready, Failed };
+
+    explicit TssCache(std::string dir) : dir(std::move(dir)) {}
+
+    // Creates the directory if needed.
+    bool open() {
+        struct stat st;
+        if (stat(dir.c_str(), &st) == 0)
+            return S_ISDIR(st.st_mode);
+        return mkdir(dir.c_str(), 0755) == 0;
+    }
+
+    const std::string &directory() const { return dir; }
+
+    static std::string Key(const std::string &build, const std::string &bdid, const std::string &ecid) {
+        return build + "-" + bdid + "-" + ecid;
+    }
+
+    // Starts fetching unless the entry is ready or already on its way. A
+    // failed fetch is tried again next time.
+    void prefetch(RestoreSupervisor &restores, const RestoreBackend &tool, const std::string &ipsw,
+                  const std::string &key, const std::string &ecid, const std::string &tag) {
+        std::vector<std::string> args = tool.personalizeCommand(ipsw, ecid, dir);
+        if (args.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            State &s = entries[key];
+            if (s == Fetching || s == Ready)
+                return;
+            s = Fetching;
+        }
+        LogInfo(tag.c_str(), "\U0001F5DD  Fetching personalization for ECID %s...", ecid.c_str());
+        std::string label = tag;
+        auto job = restores.spawn(
+            args, tag, [label](const std::string &line) { LogDebug(label.c_str(), "tss: %s", line.c_str()); },
+            [this, key, label](int code) { finished(key, label, code); });
+        if (!job) {
+            LogWarn(tag.c_str(), "\U0000274C Could not start %s: %s", tool.name(), strerror(errno));
+            std::lock_guard<std::mutex> guard(lock);
+            entries[key] = Failed;
+        }
+    }
+
+    State state(const std::string &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(key);
+        return it == entries.end() ? Missing : it->second;
+    }
+
+private:
+    // Runs on the supervisor thread once the fetch has exited.
+    void finished(const std::string &key, const std::string &tag, int code) {
+        std::lock_guard<std::mutex> guard(lock);
+        entries[key] = code == 0 ? Ready : Failed;
+        if (code == 0)
+            LogInfo(tag.c_str(), "\U0001F5DD  Personalization cached (%s).", key.c_str());
+        else
+            LogWarn(tag.c_str(), "\U0001F5DD  Personalization fetch failed with code %d; the restore will sign itself.",
+                    code);
+    }
+
+    std::string dir;
+    std::mutex lock; // guards entries
+    std::map<std::string, State> entries;
+};
+
+#endif /* tss_cache_h */
@@ -0,0 +1,195 @@
+#ifndef zip_h
+#define zip_h
+
+// Minimal read-only zip access for IPSWs. Only the central directory and the
+// entries asked for are read; nothing else in the archive is touched, which
+// matters for 15 GB files on a network share. Handles zip64.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct ZipEntry {
+    std::string name;
+    uint16_t method = 0; // 0 = stored, 8 = deflate
+    uint32_t crc = 0;
+    uint64_t compSize = 0;
+    uint64_t size = 0;
+    uint64_t localOffset = 0;
+};
+
+namespace zipdetail {
+
+inline uint16_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+inline uint32_t le32(const uint8_t *p) { return le16(p) | ((uint32_t)le16(p + 2) << 16); }
+inline uint64_t le64(const uint8_t *p) { return le32(p) | ((uint64_t)le32(p + 4) << 32); }
+
+inline bool preadAll(int fd, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = static_cast<uint8_t *>(buf);
+    while (len) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+} // namespace zipdetail
+
+// Reads the central directory of the archive open on `fd`.
+inline bool ZipReadDirectory(int fd, std::vector<ZipEntry> &out, std::string &err) {
+    using namespace zipdetail;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        err = "fstat failed";
+        return false;
+    }
+    uint64_t fileSize = st.st_size;
+
+    // End of central directory: 22 bytes plus up to 64 KB of comment.
+    uint64_t tailLen = fileSize < 65557 ? fileSize : 65557;
+    std::vector<uint8_t> tail(tailLen);
+    if (!preadAll(fd, tail.data(), tailLen, fileSize - tailLen)) {
+        err = "read failed";
+        return false;
+    }
+    long eocd = -1;
+    for (long i = (long)tailLen - 22; i >= 0; --i) {
+        if (le32(&tail[i]) == 0x06054b50) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd < 0) {
+        err = "not a zip archive";
+        return false;
+    }
+    uint64_t count = le16(&tail[eocd + 10]);
+    uint64_t cdSize = le32(&tail[eocd + 12]);
+    uint64_t cdOffset = le32(&tail[eocd + 16]);
+
+    // Zip64 locator sits right in front of the classic record.
+    if (eocd >= 20 && le32(&tail[eocd - 20]) == 0x07064b50) {
+        uint64_t z64Offset = le64(&tail[eocd - 20 + 8]);
+        uint8_t z64[56];
+        if (!preadAll(fd, z64, sizeof(z64), z64Offset) || le32(z64) != 0x06064b50) {
+            err = "bad zip64 end of central directory";
+            return false;
+        }
+        count = le64(z64 + 32);
+        cdSize = le64(z64 + 40);
+        cdOffset = le64(z64 + 48);
+    }
+    if (cdOffset + cdSize > fileSize) {
+        err = "central directory out of range";
+        return false;
+    }
+
+    std::vector<uint8_t> cd(cdSize);
+    if (!preadAll(fd, cd.data(), cdSize, cdOffset)) {
+        err = "read failed";
+        return false;
+    }
+    out.clear();
+    out.reserve(count);
+    size_t pos = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (pos + 46 > cd.size() || le32(&cd[pos]) != 0x02014b50) {
+            err = "corrupt central directory";
+            return false;
+        }
+        const uint8_t *h = &cd[pos];
+        ZipEntry e;
+        e.method = le16(h + 10);
+        e.crc = le32(h + 16);
+        e.compSize = le32(h + 20);
+        e.size = le32(h + 24);
+        uint16_t nameLen = le16(h + 28), extraLen = le16(h + 30), commentLen = le16(h + 32);
+        e.localOffset = le32(h + 42);
+        if (pos + 46 + nameLen + extraLen + commentLen > cd.size()) {
+            err = "corrupt central directory";
+            return false;
+        }
+        e.name.assign((const char *)h + 46, nameLen);
+
+        // Zip64 extended info carries whichever fields overflowed, in order.
+        const uint8_t *x = h + 46 + nameLen, *xend = x + extraLen;
+        while (x + 4 <= xend) {
+            uint16_t id = le16(x), len = le16(x + 2);
+            const uint8_t *d = x + 4, *dend = d + len;
+            if (dend > xend)
+                break;
+            if (id == 0x0001) {
+                if (e.size == 0xffffffff && d + 8 <= dend) e.size = le64(d), d += 8;
+                if (e.compSize == 0xffffffff && d + 8 <= dend) e.compSize = le64(d), d += 8;
+                if (e.localOffset == 0xffffffff && d + 8 <= dend) e.localOffset = le64(d), d += 8;
+            }
+            x = dend;
+        }
+        out.push_back(std::move(e));
+        pos += 46 + nameLen + extraLen + commentLen;
+    }
+    return true;
+}
+
+// Offset of the entry's data: the local header has its own name/extra
+// lengths, which can differ from the central directory's.
+inline bool ZipDataOffset(int fd, const ZipEntry &e, uint64_t &offset, std::string &err) {
+    using namespace zipdetail;
+    uint8_t lh[30];
+    if (!preadAll(fd, lh, sizeof(lh), e.localOffset) || le32(lh) != 0x04034b50) {
+        err = "bad local header for " + e.name;
+        return false;
+    }
+    offset = e.localOffset + 30 + le16(lh + 26) + le16(lh + 28);
+    return true;
+}
+
+// Extracts one (small) entry into memory. Meant for manifests, not payloads.
+inline bool ZipExtract(int fd, const ZipEntry &e, std::string &out, std::string &err) {
+    using namespace zipdetail;
+    uint64_t dataOffset;
+    if (!ZipDataOffset(fd, e, dataOffset, err))
+        return false;
+    std::string comp(e.compSize, '\0');
+    if (!preadAll(fd, &comp[0], comp.size(), dataOffset)) {
+        err = "read failed for " + e.name;
+        return false;
+    }
+    if (e.method == 0) {
+        out = std::move(comp);
+        return true;
+    }
+    if (e.method != 8) {
+        err = "unsupported compression method for " + e.name;
+        return false;
+    }
+    out.assign(e.size, '\0');
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        err = "inflateInit2 failed";
+        return false;
+    }
+    zs.next_in = (Bytef *)&comp[0];
+    zs.avail_in = (uInt)comp.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = (uInt)out.size();
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != e.size) {
+        err = "inflate failed for " + e.name;
+        return false;
+    }
+    return true;
+}
+
+#endif /* zip_h */